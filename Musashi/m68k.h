@@ -357,6 +357,22 @@ void m68k_pulse_halt(void);
 void m68k_pulse_bus_error(void);
 
 
+/* Instruction fetch fast path.
+ * You must enable M68K_FETCH_PAGE_CACHE in m68kconf.h.
+ * From a memory read with a program function code, the host can tell the
+ * current CPU that the len bytes at CPU address base live at ptr in host
+ * memory. Instruction words inside that range are then read from ptr
+ * directly, until the supervisor flag changes, the host calls
+ * m68k_invalidate_fetch_pages() or it sets another range. Use len=0 to clear.
+ * Only do this for memory where reads have no side effects that the
+ * host needs to see.
+ */
+void m68k_set_fetch_page(unsigned int base, unsigned int len, const unsigned char *ptr);
+
+/* Drop the fetch ranges of all CPUs, e.g. because the memory map changed. */
+void m68k_invalidate_fetch_pages(void);
+
+
 /* Context switching to allow multiple CPUs */
 
 /* Get the size of the cpu context in bytes */
@@ -169,6 +169,13 @@
 #define M68K_EMULATE_PREFETCH       OPT_OFF
 
 
+/* If ON, instruction words are read straight from host memory for the code
+ * page the host set with m68k_set_fetch_page(), rather than going through
+ * m68k_read_memory_xx() for every word. Only used without prefetch emulation.
+ */
+#define M68K_FETCH_PAGE_CACHE       OPT_ON
+
+
 /* If ON, the CPU will generate address error exceptions if it tries to
  * access a word or longword at an odd address.
  * NOTE: This is only emulated properly for 68000 mode.
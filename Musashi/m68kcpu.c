@@ -58,6 +58,7 @@ extern void m68ki_build_opcode_table(void);
 int  m68ki_initial_cycles;
 int  m68ki_remaining_cycles = 0;                     /* Number of clocks remaining */
 uint m68ki_tracing = 0;
+uint m68ki_fetch_gen = 1;                            /* Bumped to drop all fetch ranges */
 uint m68ki_address_space;
 
 #ifdef M68K_LOG_ENABLE
@@ -1165,6 +1166,21 @@ void m68k_pulse_halt(void)
 	CPU_STOPPED |= STOP_LEVEL_HALT;
 }
 
+/* Instruction fetch page cache */
+void m68k_set_fetch_page(unsigned int base, unsigned int len, const unsigned char *ptr)
+{
+	m68ki_cpu.fetch_base = base;
+	m68ki_cpu.fetch_len = len;
+	m68ki_cpu.fetch_s = FLAG_S;
+	m68ki_cpu.fetch_gen = m68ki_fetch_gen;
+	m68ki_cpu.fetch_ptr = ptr;
+}
+
+void m68k_invalidate_fetch_pages(void)
+{
+	m68ki_fetch_gen++;
+}
+
 /* Get and set the current CPU context */
 /* This is to allow for multiple CPUs */
 unsigned int m68k_context_size()
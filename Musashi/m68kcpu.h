@@ -1014,12 +1014,20 @@ typedef struct
 	uint16 mmu_tmp_buserror_fc;   /* temporary hack: (first) bus error fc */
 	uint16 mmu_tmp_buserror_rw;   /* temporary hack: (first) bus error rw */
 	uint16 mmu_tmp_buserror_sz;   /* temporary hack: (first) bus error size` */
+
+	/* Instruction fetch fast path, see m68k_set_fetch_page() */
+	uint fetch_base;        /* CPU address of the cached range */
+	uint fetch_len;         /* its length, 0 if nothing is cached */
+	uint fetch_s;           /* supervisor flag the range was set in */
+	uint fetch_gen;         /* m68ki_fetch_gen at the time it was set */
+	const uint8 *fetch_ptr; /* the range in host memory */
 } m68ki_cpu_core;
 
 
 extern m68ki_cpu_core m68ki_cpu;
 extern sint           m68ki_remaining_cycles;
 extern uint           m68ki_tracing;
+extern uint           m68ki_fetch_gen;
 extern const uint8    m68ki_shift_8_table[];
 extern const uint16   m68ki_shift_16_table[];
 extern const uint     m68ki_shift_32_table[];
@@ -1085,6 +1093,18 @@ static inline uint m68ki_read_imm_16(void)
 	return result;
 }
 #else
+#if M68K_FETCH_PAGE_CACHE
+{
+	uint off = REG_PC - m68ki_cpu.fetch_base;
+	if(off < m68ki_cpu.fetch_len && m68ki_cpu.fetch_len - off >= 2 &&
+			m68ki_cpu.fetch_gen == m68ki_fetch_gen && m68ki_cpu.fetch_s == FLAG_S)
+	{
+		const uint8 *p = m68ki_cpu.fetch_ptr + off;
+		REG_PC += 2;
+		return (p[0] << 8) | p[1];
+	}
+}
+#endif /* M68K_FETCH_PAGE_CACHE */
 	REG_PC += 2;
 	return m68k_read_immediate_16(ADDRESS_68K(REG_PC-2));
 #endif /* M68K_EMULATE_PREFETCH */
@@ -1135,6 +1155,18 @@ static inline uint m68ki_read_imm_32(void)
 #else
 	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
 	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+#if M68K_FETCH_PAGE_CACHE
+{
+	uint off = REG_PC - m68ki_cpu.fetch_base;
+	if(off < m68ki_cpu.fetch_len && m68ki_cpu.fetch_len - off >= 4 &&
+			m68ki_cpu.fetch_gen == m68ki_fetch_gen && m68ki_cpu.fetch_s == FLAG_S)
+	{
+		const uint8 *p = m68ki_cpu.fetch_ptr + off;
+		REG_PC += 4;
+		return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	}
+}
+#endif /* M68K_FETCH_PAGE_CACHE */
 	REG_PC += 4;
 	return m68k_read_immediate_32(ADDRESS_68K(REG_PC-4));
 #endif /* M68K_EMULATE_PREFETCH */
@@ -0,0 +1,177 @@
+/*
+ Checkpoint files: machine state for crash recovery.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+/*
+A checkpoint is a list of named sections. Devices store their state as one
+section each; RAMs store a list of pages. A full checkpoint has every RAM page,
+a delta only the pages written since the checkpoint before it, which makes
+writing one cheap: most of the time the guest only touches a small part of
+memory. Restoring means applying the last full checkpoint and every delta
+written after it, in order.
+
+File format: the magic, a uint32 that is 1 for a full checkpoint, then
+sections of a ckpt_sect_t plus len bytes of data. RAM sections are a
+sequence of a uint32 page number plus the page data. Everything is in host
+byte order; checkpoints are not meant to be portable.
+*/
+
+#define CKPT_MAGIC "PLXCKP1\n"
+
+typedef struct {
+	char name[16];
+	uint32_t len;
+} ckpt_sect_t;
+
+struct ckpt_t {
+	FILE *f;			//When writing
+	char *filename;
+	char *tmpname;
+	int full;
+	uint8_t *data;		//When reading: the whole file
+	long size;
+};
+
+ckpt_t *ckpt_create(const char *filename, int full) {
+	ckpt_t *c=calloc(sizeof(ckpt_t), 1);
+	c->filename=strdup(filename);
+	c->tmpname=malloc(strlen(filename)+8);
+	sprintf(c->tmpname, "%s.tmp", filename);
+	c->full=full;
+	c->f=fopen(c->tmpname, "wb");
+	if (!c->f) {
+		perror(c->tmpname);
+		ckpt_free(c);
+		return NULL;
+	}
+	uint32_t fl=full;
+	fwrite(CKPT_MAGIC, 8, 1, c->f);
+	fwrite(&fl, sizeof(fl), 1, c->f);
+	return c;
+}
+
+static void put_hdr(ckpt_t *c, const char *name, int len) {
+	ckpt_sect_t s={0};
+	strncpy(s.name, name, sizeof(s.name)-1);
+	s.len=len;
+	fwrite(&s, sizeof(s), 1, c->f);
+}
+
+void ckpt_put(ckpt_t *c, const char *name, const void *data, int len) {
+	put_hdr(c, name, len);
+	fwrite(data, len, 1, c->f);
+}
+
+void ckpt_put_ram(ckpt_t *c, const char *name, ram_t *ram) {
+	int n=ram_page_count(ram);
+	int len=0;
+	for (int p=0; p<n; p++) {
+		if (c->full || ram_page_dirty(ram, p)) len+=sizeof(uint32_t)+ram_page_len(ram, p);
+	}
+	put_hdr(c, name, len);
+	for (int p=0; p<n; p++) {
+		if (c->full || ram_page_dirty(ram, p)) {
+			uint32_t pn=p;
+			fwrite(&pn, sizeof(pn), 1, c->f);
+			fwrite(ram_page_data(ram, p), ram_page_len(ram, p), 1, c->f);
+		}
+	}
+}
+
+int ckpt_close(ckpt_t *c) {
+	int ok=(fflush(c->f)==0 && fsync(fileno(c->f))==0);
+	if (fclose(c->f)!=0) ok=0;
+	c->f=NULL;
+	if (ok && rename(c->tmpname, c->filename)!=0) ok=0;
+	if (!ok) perror(c->filename);
+	ckpt_free(c);
+	return ok;
+}
+
+ckpt_t *ckpt_open(const char *filename) {
+	FILE *f=fopen(filename, "rb");
+	if (!f) return NULL;
+	ckpt_t *c=calloc(sizeof(ckpt_t), 1);
+	fseek(f, 0, SEEK_END);
+	c->size=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	c->data=malloc(c->size);
+	int ok=(fread(c->data, c->size, 1, f)==1);
+	fclose(f);
+	if (!ok || c->size<12 || memcmp(c->data, CKPT_MAGIC, 8)!=0) {
+		printf("%s: not a checkpoint file\n", filename);
+		ckpt_free(c);
+		return NULL;
+	}
+	uint32_t fl;
+	memcpy(&fl, c->data+8, sizeof(fl));
+	c->full=fl;
+	return c;
+}
+
+int ckpt_is_full(ckpt_t *c) {
+	return c->full;
+}
+
+//Find a section. Returns its data and sets *len, or returns NULL.
+static uint8_t *find_sect(ckpt_t *c, const char *name, uint32_t *len) {
+	long pos=12;
+	while (pos+(long)sizeof(ckpt_sect_t)<=c->size) {
+		ckpt_sect_t s;
+		memcpy(&s, c->data+pos, sizeof(s));
+		pos+=sizeof(s);
+		if (pos+s.len>c->size) break;
+		if (strncmp(s.name, name, sizeof(s.name))==0) {
+			*len=s.len;
+			return c->data+pos;
+		}
+		pos+=s.len;
+	}
+	return NULL;
+}
+
+int ckpt_get(ckpt_t *c, const char *name, void *data, int len) {
+	uint32_t slen;
+	uint8_t *p=find_sect(c, name, &slen);
+	if (!p || slen!=len) {
+		printf("checkpoint: no valid state for %s\n", name);
+		return 0;
+	}
+	memcpy(data, p, len);
+	return 1;
+}
+
+void ckpt_get_ram(ckpt_t *c, const char *name, ram_t *ram) {
+	uint32_t len;
+	uint8_t *p=find_sect(c, name, &len);
+	if (!p) return;
+	uint8_t *end=p+len;
+	while (p+sizeof(uint32_t)<=end) {
+		uint32_t pn;
+		memcpy(&pn, p, sizeof(pn));
+		p+=sizeof(pn);
+		if (pn>=ram_page_count(ram) || p+ram_page_len(ram, pn)>end) break;
+		memcpy(ram_page_data(ram, pn), p, ram_page_len(ram, pn));
+		p+=ram_page_len(ram, pn);
+	}
+}
+
+void ckpt_free(ckpt_t *c) {
+	if (c->f) fclose(c->f);
+	free(c->filename);
+	free(c->tmpname);
+	free(c->data);
+	free(c);
+}
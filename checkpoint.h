@@ -0,0 +1,39 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "ramrom.h"
+
+typedef struct ckpt_t ckpt_t;
+
+//Start writing a checkpoint file. It only replaces filename when
+//ckpt_close() succeeds. full is stored in the file so restoring knows where
+//a chain of deltas starts. Returns NULL on error.
+ckpt_t *ckpt_create(const char *filename, int full);
+
+//Add a named section of device state.
+void ckpt_put(ckpt_t *c, const char *name, const void *data, int len);
+
+//Add the pages of a RAM that were written since the previous checkpoint, or
+//all pages if the checkpoint is full. The caller clears the dirty state.
+void ckpt_put_ram(ckpt_t *c, const char *name, ram_t *ram);
+
+//Finish writing. Returns 0 on error.
+int ckpt_close(ckpt_t *c);
+
+//Read a checkpoint file. Returns NULL on error.
+ckpt_t *ckpt_open(const char *filename);
+
+//Returns true if the checkpoint is a full one rather than a delta.
+int ckpt_is_full(ckpt_t *c);
+
+//Copy a section of device state into data. Returns 0 if there's no such
+//section or it has a different length.
+int ckpt_get(ckpt_t *c, const char *name, void *data, int len);
+
+//Apply the RAM pages stored in the checkpoint.
+void ckpt_get_ram(ckpt_t *c, const char *name, ram_t *ram);
+
+void ckpt_free(ckpt_t *c);
+
+#endif
@@ -0,0 +1,503 @@
+/*
+ Compressed, deduplicated disk image format.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "cimg.h"
+
+/*
+A compressed image splits the raw disk image into fixed-size chunks. Every
+distinct chunk is stored only once (chunks are addressed by a hash of their
+contents) and is compressed with a small LZ4-style compressor. A chunk map
+then says, for every chunk of the raw image, which stored chunk holds its data.
+Reading decompresses only the chunks that are touched; recently used chunks
+are kept decompressed in a small cache.
+
+File layout (all integers little-endian):
+ header: magic "PLXCIMG1", u32 version, u32 chunk_size, u64 image_size,
+         u32 chunk count, u32 stored chunk count, u64 map offset,
+         u64 stored-chunk table offset
+ chunk data, back to back
+ chunk map: one u32 stored-chunk index per chunk
+ stored-chunk table: per stored chunk u64 offset, u32 length, u32 flags, u64 hash
+*/
+
+#define CIMG_MAGIC "PLXCIMG1"
+#define CIMG_VERSION 1
+#define CIMG_HDR_SIZE 48
+#define CIMG_ENT_SIZE 24
+
+#define CIMG_FLAG_LZ 1	//Stored chunk is compressed; otherwise it's raw
+#define CIMG_MAX_CHUNK_SIZE (16*1024*1024)
+
+//Amount of decompressed chunks we keep around
+#define CACHE_SLOTS 32
+
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t flags;
+	uint64_t hash;
+} cimg_ent_t;
+
+typedef struct {
+	int stored;			//Stored chunk index in this slot, or -1 if empty
+	unsigned int last_use;
+	uint8_t *data;
+} cache_slot_t;
+
+struct cimg_t {
+	FILE *f;
+	int chunk_size;
+	uint64_t image_size;
+	int n_chunks;
+	int n_stored;
+	uint32_t *map;
+	cimg_ent_t *ent;
+	uint8_t *cbuf;		//Buffer for compressed data read from file
+	cache_slot_t cache[CACHE_SLOTS];
+	unsigned int use_ctr;
+};
+
+static void put32(uint8_t *p, uint32_t v) {
+	for (int i=0; i<4; i++) p[i]=v>>(i*8);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+	for (int i=0; i<8; i++) p[i]=v>>(i*8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static uint64_t get64(const uint8_t *p) {
+	return get32(p)|((uint64_t)get32(p+4)<<32);
+}
+
+//64-bit FNV-1a
+static uint64_t chunk_hash(const uint8_t *d, int len) {
+	uint64_t h=0xcbf29ce484222325ULL;
+	for (int i=0; i<len; i++) {
+		h^=d[i];
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+LZ4-style block compression. A compressed block is a sequence of tokens. Each
+token byte has the literal length in the upper nibble and the match length minus
+4 in the lower nibble; a nibble of 15 means more length bytes follow (each 255
+adds to the length; the first byte <255 ends it). After the token (and its
+literal length bytes) come the literals, then a 16-bit little-endian match offset
+and the extra match length bytes. The last token only has literals.
+*/
+
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 14
+
+static int lz_put_len(uint8_t *out, int op, int len) {
+	while (len>=255) {
+		out[op++]=255;
+		len-=255;
+	}
+	out[op++]=len;
+	return op;
+}
+
+//Compress in to out. Returns compressed size, or -1 if it doesn't fit in out_max.
+static int lz_compress(const uint8_t *in, int len, uint8_t *out, int out_max) {
+	static int32_t htab[1<<LZ_HASH_BITS];
+	for (int i=0; i<(1<<LZ_HASH_BITS); i++) htab[i]=-1;
+	int ip=0, anchor=0, op=0;
+	//Leave the last few bytes as literals so matches never run off the end.
+	int match_limit=len-LZ_MINMATCH-8;
+	while (ip<match_limit) {
+		uint32_t seq=in[ip]|(in[ip+1]<<8)|(in[ip+2]<<16)|((uint32_t)in[ip+3]<<24);
+		uint32_t h=(seq*2654435761U)>>(32-LZ_HASH_BITS);
+		int ref=htab[h];
+		htab[h]=ip;
+		if (ref<0 || ip-ref>0xffff || memcmp(&in[ref], &in[ip], LZ_MINMATCH)!=0) {
+			ip++;
+			continue;
+		}
+		int mlen=LZ_MINMATCH;
+		while (ip+mlen<len-8 && in[ref+mlen]==in[ip+mlen]) mlen++;
+		int llen=ip-anchor;
+		//worst case size of this sequence
+		if (op+1+llen/255+1+llen+2+mlen/255+1>out_max) return -1;
+		int tok=op++;
+		out[tok]=((llen>=15?15:llen)<<4)|(mlen-LZ_MINMATCH>=15?15:mlen-LZ_MINMATCH);
+		if (llen>=15) op=lz_put_len(out, op, llen-15);
+		memcpy(&out[op], &in[anchor], llen);
+		op+=llen;
+		out[op++]=(ip-ref)&0xff;
+		out[op++]=(ip-ref)>>8;
+		if (mlen-LZ_MINMATCH>=15) op=lz_put_len(out, op, mlen-LZ_MINMATCH-15);
+		ip+=mlen;
+		anchor=ip;
+	}
+	//Trailing literals
+	int llen=len-anchor;
+	if (op+1+llen/255+1+llen>out_max) return -1;
+	out[op++]=(llen>=15?15:llen)<<4;
+	if (llen>=15) op=lz_put_len(out, op, llen-15);
+	memcpy(&out[op], &in[anchor], llen);
+	op+=llen;
+	return op;
+}
+
+//Decompress in to out. Returns decompressed size, or -1 on corrupt data.
+static int lz_decompress(const uint8_t *in, int len, uint8_t *out, int out_max) {
+	int ip=0, op=0;
+	while (ip<len) {
+		int tok=in[ip++];
+		int llen=tok>>4;
+		if (llen==15) {
+			int b;
+			do {
+				if (ip>=len) return -1;
+				b=in[ip++];
+				llen+=b;
+			} while (b==255);
+		}
+		if (ip+llen>len || op+llen>out_max) return -1;
+		memcpy(&out[op], &in[ip], llen);
+		ip+=llen;
+		op+=llen;
+		if (ip>=len) break; //last token has no match
+		if (ip+2>len) return -1;
+		int off=in[ip]|(in[ip+1]<<8);
+		ip+=2;
+		int mlen=(tok&15);
+		if (mlen==15) {
+			int b;
+			do {
+				if (ip>=len) return -1;
+				b=in[ip++];
+				mlen+=b;
+			} while (b==255);
+		}
+		mlen+=LZ_MINMATCH;
+		if (off==0 || off>op || op+mlen>out_max) return -1;
+		//Byte-by-byte as the match may overlap the output
+		for (int i=0; i<mlen; i++) {
+			out[op]=out[op-off];
+			op++;
+		}
+	}
+	return op;
+}
+
+int cimg_is_cimg(const char *filename) {
+	FILE *f=fopen(filename, "rb");
+	if (!f) return 0;
+	char magic[8];
+	int r=fread(magic, 8, 1, f);
+	fclose(f);
+	return (r==1 && memcmp(magic, CIMG_MAGIC, 8)==0);
+}
+
+cimg_t *cimg_open(const char *filename) {
+	FILE *f=fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+	uint8_t hdr[CIMG_HDR_SIZE];
+	if (fread(hdr, CIMG_HDR_SIZE, 1, f)!=1 || memcmp(hdr, CIMG_MAGIC, 8)!=0) {
+		printf("%s: not a compressed disk image\n", filename);
+		fclose(f);
+		return NULL;
+	}
+	if (get32(&hdr[8])!=CIMG_VERSION) {
+		printf("%s: unsupported compressed image version %d\n", filename, get32(&hdr[8]));
+		fclose(f);
+		return NULL;
+	}
+	uint32_t chunk_size=get32(&hdr[12]);
+	uint64_t image_size=get64(&hdr[16]);
+	uint32_t n_chunks=get32(&hdr[24]);
+	uint32_t n_stored=get32(&hdr[28]);
+	//Chunks must hold whole sectors, and the map must cover the whole image.
+	if (chunk_size==0 || chunk_size%512!=0 || chunk_size>CIMG_MAX_CHUNK_SIZE ||
+			n_chunks!=(image_size+chunk_size-1)/chunk_size || n_stored>n_chunks) {
+		printf("%s: corrupt compressed image header\n", filename);
+		fclose(f);
+		return NULL;
+	}
+	cimg_t *c=calloc(sizeof(cimg_t), 1);
+	c->f=f;
+	c->chunk_size=chunk_size;
+	c->image_size=image_size;
+	c->n_chunks=n_chunks;
+	c->n_stored=n_stored;
+	uint64_t map_off=get64(&hdr[32]);
+	uint64_t tab_off=get64(&hdr[40]);
+
+	c->map=calloc(c->n_chunks, sizeof(uint32_t));
+	c->ent=calloc(c->n_stored, sizeof(cimg_ent_t));
+	uint8_t *buf=malloc((size_t)c->n_chunks*4+(size_t)c->n_stored*CIMG_ENT_SIZE);
+	int ok=1;
+	fseek(f, map_off, SEEK_SET);
+	if (fread(buf, 4, c->n_chunks, f)!=c->n_chunks) ok=0;
+	for (int i=0; i<c->n_chunks && ok; i++) {
+		c->map[i]=get32(&buf[i*4]);
+		if (c->map[i]>=c->n_stored) ok=0;
+	}
+	fseek(f, tab_off, SEEK_SET);
+	if (ok && fread(buf, CIMG_ENT_SIZE, c->n_stored, f)!=c->n_stored) ok=0;
+	for (int i=0; i<c->n_stored && ok; i++) {
+		c->ent[i].offset=get64(&buf[i*CIMG_ENT_SIZE]);
+		c->ent[i].len=get32(&buf[i*CIMG_ENT_SIZE+8]);
+		c->ent[i].flags=get32(&buf[i*CIMG_ENT_SIZE+12]);
+		c->ent[i].hash=get64(&buf[i*CIMG_ENT_SIZE+16]);
+		if (c->ent[i].len>c->chunk_size) ok=0;
+		//A raw chunk must be complete, or we'd return stale data for its tail.
+		if (!(c->ent[i].flags&CIMG_FLAG_LZ) && c->ent[i].len!=c->chunk_size) ok=0;
+	}
+	free(buf);
+	if (!ok) {
+		printf("%s: corrupt compressed image index\n", filename);
+		cimg_close(c);
+		return NULL;
+	}
+	c->cbuf=malloc(c->chunk_size);
+	for (int i=0; i<CACHE_SLOTS; i++) {
+		c->cache[i].stored=-1;
+		c->cache[i].data=malloc(c->chunk_size);
+	}
+	return c;
+}
+
+uint64_t cimg_size(cimg_t *c) {
+	return c->image_size;
+}
+
+//Returns the decompressed data for the given chunk of the image, either from
+//cache or by decompressing it.
+static uint8_t *get_chunk(cimg_t *c, int chunk) {
+	int stored=c->map[chunk];
+	c->use_ctr++;
+	int lru=0;
+	for (int i=0; i<CACHE_SLOTS; i++) {
+		if (c->cache[i].stored==stored) {
+			c->cache[i].last_use=c->use_ctr;
+			return c->cache[i].data;
+		}
+		if (c->cache[i].last_use<c->cache[lru].last_use) lru=i;
+	}
+	cache_slot_t *s=&c->cache[lru];
+	cimg_ent_t *e=&c->ent[stored];
+	s->stored=-1;
+	fseek(c->f, e->offset, SEEK_SET);
+	if (fread(c->cbuf, 1, e->len, c->f)!=e->len) {
+		printf("cimg: short read on chunk %d\n", chunk);
+		return NULL;
+	}
+	if (e->flags&CIMG_FLAG_LZ) {
+		int r=lz_decompress(c->cbuf, e->len, s->data, c->chunk_size);
+		if (r!=c->chunk_size) {
+			printf("cimg: corrupt chunk %d\n", chunk);
+			return NULL;
+		}
+	} else {
+		memcpy(s->data, c->cbuf, c->chunk_size);
+	}
+	s->stored=stored;
+	s->last_use=c->use_ctr;
+	return s->data;
+}
+
+int cimg_read(cimg_t *c, uint64_t offset, uint8_t *buf, int len) {
+	int done=0;
+	while (done<len) {
+		if (offset>=c->image_size) {
+			//Reads past the end return zeroes, like reading a sparse file would.
+			memset(&buf[done], 0, len-done);
+			break;
+		}
+		int chunk=offset/c->chunk_size;
+		int coff=offset%c->chunk_size;
+		int n=c->chunk_size-coff;
+		if (n>len-done) n=len-done;
+		uint8_t *d=get_chunk(c, chunk);
+		if (!d) return -1;
+		memcpy(&buf[done], &d[coff], n);
+		done+=n;
+		offset+=n;
+	}
+	return 0;
+}
+
+void cimg_close(cimg_t *c) {
+	if (c->f) fclose(c->f);
+	for (int i=0; i<CACHE_SLOTS; i++) free(c->cache[i].data);
+	free(c->cbuf);
+	free(c->map);
+	free(c->ent);
+	free(c);
+}
+
+//Hash table from chunk hash to stored chunk index, used while converting.
+typedef struct {
+	uint64_t hash;
+	int stored;
+} dedup_ent_t;
+
+//Returns true if the stored chunk e, already written to f, holds the same data
+//as chunk. cbuf and dbuf are scratch buffers of chunk_size bytes.
+static int chunk_equals(FILE *f, const cimg_ent_t *e, const uint8_t *chunk, int chunk_size,
+						uint8_t *cbuf, uint8_t *dbuf) {
+	fseek(f, e->offset, SEEK_SET);
+	if (fread(cbuf, 1, e->len, f)!=e->len) return 0;
+	if (e->flags&CIMG_FLAG_LZ) {
+		if (lz_decompress(cbuf, e->len, dbuf, chunk_size)!=chunk_size) return 0;
+		return memcmp(dbuf, chunk, chunk_size)==0;
+	}
+	return memcmp(cbuf, chunk, chunk_size)==0;
+}
+
+int cimg_convert(const char *rawfile, const char *outfile, int chunk_size) {
+	FILE *in=fopen(rawfile, "rb");
+	if (!in) {
+		perror(rawfile);
+		return 0;
+	}
+	//Opened for reading as well, as deduplication compares against chunks already written.
+	FILE *out=fopen(outfile, "w+b");
+	if (!out) {
+		perror(outfile);
+		fclose(in);
+		return 0;
+	}
+	fseek(in, 0, SEEK_END);
+	uint64_t image_size=ftell(in);
+	fseek(in, 0, SEEK_SET);
+	int n_chunks=(image_size+chunk_size-1)/chunk_size;
+
+	uint32_t *map=calloc(n_chunks, sizeof(uint32_t));
+	cimg_ent_t *ent=calloc(n_chunks, sizeof(cimg_ent_t));
+	int dd_size=1;
+	while (dd_size<n_chunks*2) dd_size<<=1;
+	dedup_ent_t *dd=calloc(dd_size, sizeof(dedup_ent_t));
+	for (int i=0; i<dd_size; i++) dd[i].stored=-1;
+	uint8_t *chunk=malloc(chunk_size);
+	uint8_t *cbuf=malloc(chunk_size);
+	uint8_t *cmpbuf=malloc(chunk_size);
+	int n_stored=0;
+	uint64_t pos=CIMG_HDR_SIZE;
+	uint64_t compressed_bytes=0;
+
+	//Header gets rewritten when we know everything.
+	uint8_t hdr[CIMG_HDR_SIZE]={0};
+	fwrite(hdr, CIMG_HDR_SIZE, 1, out);
+
+	for (int i=0; i<n_chunks; i++) {
+		memset(chunk, 0, chunk_size);
+		fread(chunk, 1, chunk_size, in);
+		uint64_t h=chunk_hash(chunk, chunk_size);
+		int slot=h&(dd_size-1);
+		int found=-1;
+		while (dd[slot].stored>=0) {
+			//Compare the contents, so a hash collision can't merge different chunks.
+			if (dd[slot].hash==h && chunk_equals(out, &ent[dd[slot].stored], chunk, chunk_size, cbuf, cmpbuf)) {
+				found=dd[slot].stored;
+				break;
+			}
+			slot=(slot+1)&(dd_size-1);
+		}
+		if (found<0) {
+			found=n_stored++;
+			dd[slot].hash=h;
+			dd[slot].stored=found;
+			fseek(out, pos, SEEK_SET);
+			int clen=lz_compress(chunk, chunk_size, cbuf, chunk_size-1);
+			ent[found].offset=pos;
+			ent[found].hash=h;
+			if (clen<0) {
+				ent[found].len=chunk_size;
+				ent[found].flags=0;
+				fwrite(chunk, chunk_size, 1, out);
+			} else {
+				ent[found].len=clen;
+				ent[found].flags=CIMG_FLAG_LZ;
+				fwrite(cbuf, clen, 1, out);
+			}
+			pos+=ent[found].len;
+			compressed_bytes+=ent[found].len;
+		}
+		map[i]=found;
+	}
+
+	uint64_t map_off=pos;
+	fseek(out, pos, SEEK_SET);
+	uint8_t b[CIMG_ENT_SIZE];
+	for (int i=0; i<n_chunks; i++) {
+		put32(b, map[i]);
+		fwrite(b, 4, 1, out);
+	}
+	uint64_t tab_off=map_off+(uint64_t)n_chunks*4;
+	for (int i=0; i<n_stored; i++) {
+		put64(&b[0], ent[i].offset);
+		put32(&b[8], ent[i].len);
+		put32(&b[12], ent[i].flags);
+		put64(&b[16], ent[i].hash);
+		fwrite(b, CIMG_ENT_SIZE, 1, out);
+	}
+	memcpy(hdr, CIMG_MAGIC, 8);
+	put32(&hdr[8], CIMG_VERSION);
+	put32(&hdr[12], chunk_size);
+	put64(&hdr[16], image_size);
+	put32(&hdr[24], n_chunks);
+	put32(&hdr[28], n_stored);
+	put64(&hdr[32], map_off);
+	put64(&hdr[40], tab_off);
+	fseek(out, 0, SEEK_SET);
+	fwrite(hdr, CIMG_HDR_SIZE, 1, out);
+	int ok=(ferror(out)==0);
+	if (fclose(out)!=0) ok=0;
+	fclose(in);
+
+	printf("%s: %d chunks of %d bytes, %d unique, %llu bytes of chunk data\n", outfile,
+			n_chunks, chunk_size, n_stored, (unsigned long long)compressed_bytes);
+	free(dd);
+	free(map);
+	free(ent);
+	free(chunk);
+	free(cbuf);
+	free(cmpbuf);
+	return ok;
+}
+
+int cimg_extract(const char *cimgfile, const char *rawfile) {
+	cimg_t *c=cimg_open(cimgfile);
+	if (!c) return 0;
+	FILE *out=fopen(rawfile, "wb");
+	if (!out) {
+		perror(rawfile);
+		cimg_close(c);
+		return 0;
+	}
+	int ok=1;
+	uint8_t *buf=malloc(c->chunk_size);
+	for (uint64_t p=0; p<c->image_size && ok; p+=c->chunk_size) {
+		int n=c->chunk_size;
+		if (p+n>c->image_size) n=c->image_size-p;
+		if (cimg_read(c, p, buf, n)<0) ok=0;
+		if (ok && fwrite(buf, n, 1, out)!=1) ok=0;
+	}
+	if (fclose(out)!=0) ok=0;
+	free(buf);
+	cimg_close(c);
+	return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef CIMG_H
+#define CIMG_H
+
+#include <stdint.h>
+
+typedef struct cimg_t cimg_t;
+
+//Default size of the chunks an image is split into.
+#define CIMG_DEFAULT_CHUNK_SIZE (64*1024)
+
+//Returns true if the file is a compressed image.
+int cimg_is_cimg(const char *filename);
+
+//Open a compressed image for reading. Returns NULL on error.
+cimg_t *cimg_open(const char *filename);
+void cimg_close(cimg_t *c);
+
+//Returns the size of the uncompressed image.
+uint64_t cimg_size(cimg_t *c);
+
+//Read len bytes at the given offset of the uncompressed image into buf.
+//Returns 0 on success, -1 on a read or decompression error.
+int cimg_read(cimg_t *c, uint64_t offset, uint8_t *buf, int len);
+
+//Convert a raw image into a compressed one and back. Return true on success.
+int cimg_convert(const char *rawfile, const char *outfile, int chunk_size);
+int cimg_extract(const char *cimgfile, const char *rawfile);
+
+#endif
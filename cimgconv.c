@@ -0,0 +1,49 @@
+/*
+ Converter between raw and compressed disk images.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cimg.h"
+
+static void usage(const char *name) {
+	printf("Usage: %s [-c chunk_kib] in.img out.cimg - compress a raw disk image\n", name);
+	printf("       %s -x in.cimg out.img - decompress to a raw disk image\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int extract=0;
+	int chunk_size=CIMG_DEFAULT_CHUNK_SIZE;
+	int i=1;
+	while (i<argc && argv[i][0]=='-') {
+		if (strcmp(argv[i], "-x")==0) {
+			extract=1;
+		} else if (strcmp(argv[i], "-c")==0 && i+1<argc) {
+			i++;
+			chunk_size=atoi(argv[i])*1024;
+		} else {
+			usage(argv[0]);
+		}
+		i++;
+	}
+	if (argc-i!=2) usage(argv[0]);
+	//Chunks need to hold whole sectors.
+	if (chunk_size<512 || (chunk_size%512)!=0) {
+		printf("Chunk size needs to be a multiple of 512 bytes\n");
+		exit(1);
+	}
+	int ok;
+	if (extract) {
+		ok=cimg_extract(argv[i], argv[i+1]);
+	} else {
+		ok=cimg_convert(argv[i], argv[i+1], chunk_size);
+	}
+	return ok?0:1;
+}
@@ -0,0 +1,64 @@
+/*
+ Checks that RAM written between checkpoints comes back from a full checkpoint
+ plus a delta. Run with 'make check'.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "ramrom.h"
+#include "checkpoint.h"
+
+#define RAM_SZ (64*1024)
+
+static int write_ckpt(const char *name, ram_t *ram, int full) {
+	ckpt_t *c=ckpt_create(name, full);
+	if (!c) return 0;
+	ckpt_put_ram(c, "RAM", ram);
+	ram_clear_dirty(ram);
+	return ckpt_close(c);
+}
+
+static int apply_ckpt(const char *name, ram_t *ram) {
+	ckpt_t *c=ckpt_open(name);
+	if (!c) return 0;
+	ckpt_get_ram(c, "RAM", ram);
+	ckpt_free(c);
+	return 1;
+}
+
+int main() {
+	char full[64], delta[64];
+	sprintf(full, "/tmp/ckpttest-%d.0", (int)getpid());
+	sprintf(delta, "/tmp/ckpttest-%d.1", (int)getpid());
+	ram_t *ram=ram_new(RAM_SZ);
+	ram_write16(ram, 0x100, 0x1234);
+	int ok=write_ckpt(full, ram, 1);
+	//A long write at the end of a page also writes the start of the next one.
+	ram_write32(ram, 0x0FFE, 0x11223344);
+	ram_write32(ram, RAM_SZ-0x2002, 0x55667788);
+	ok=ok && write_ckpt(delta, ram, 0);
+
+	ram_t *restored=ram_new(RAM_SZ);
+	ok=ok && apply_ckpt(full, restored) && apply_ckpt(delta, restored);
+	unlink(full);
+	unlink(delta);
+	if (!ok) {
+		printf("ckpttest: could not write or read checkpoints\n");
+		return 1;
+	}
+	for (int p=0; p<ram_page_count(ram); p++) {
+		if (memcmp(ram_page_data(ram, p), ram_page_data(restored, p), ram_page_len(ram, p))!=0) {
+			printf("ckpttest: page %d differs after restore\n", p);
+			return 1;
+		}
+	}
+	printf("ckpttest: ok\n");
+	return 0;
+}
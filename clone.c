@@ -0,0 +1,103 @@
+/*
+ Cloning of a running machine into many processes, e.g. to start a lot of
+ test runs from one booted system.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "clone.h"
+#include "uart.h"
+
+/*
+The emulator is fork()ed at a point where no CPU is executing, so every clone
+continues from exactly the same machine state. The host shares the memory of
+the clones copy-on-write, so a clone only costs the RAM pages its guest changes.
+Everything that is stored outside the process needs to be separated by the
+caller after clone_fork() returns; emu.c gives every clone its own COW disk
+layer and its own console socket.
+*/
+
+static int n_clones=0;
+static const char *marker=NULL;
+static uart_match_t match;
+static volatile sig_atomic_t requested=0;
+
+static void clone_sig_hdl(int sig) {
+	requested=1;
+}
+
+static void clone_console_out(char c) {
+	if (!marker || requested) return;
+	if (uart_match_add(&match, c, marker, strlen(marker))) {
+		requested=1;
+		marker=NULL; //only clone once
+	}
+}
+
+void clone_init(int n, const char *mark) {
+	n_clones=n;
+	if (mark && (mark[0]==0 || strlen(mark)>UART_MATCH_MAX)) {
+		printf("Clone marker needs to be 1 to %d characters\n", UART_MATCH_MAX);
+		exit(1);
+	}
+	marker=mark;
+	if (marker) uart_console_add_hook(clone_console_out);
+	signal(SIGHUP, clone_sig_hdl);
+}
+
+int clone_requested() {
+	return requested;
+}
+
+int clone_fork() {
+	requested=0;
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid[n_clones];
+	for (int i=0; i<n_clones; i++) {
+		pid[i]=fork();
+		if (pid[i]==0) {
+			signal(SIGHUP, SIG_DFL);
+			return i+1;
+		}
+		if (pid[i]<0) {
+			perror("fork");
+			n_clones=i;
+			break;
+		}
+	}
+	printf("\nStarted %d clones, waiting for them to exit.\n", n_clones);
+	signal(SIGHUP, SIG_IGN);
+	int failed=0;
+	for (int done=0; done<n_clones; ) {
+		int status;
+		pid_t p=wait(&status);
+		if (p<0) break;
+		int i;
+		for (i=0; i<n_clones && pid[i]!=p; i++) ;
+		if (i==n_clones) continue;
+		done++;
+		if (WIFEXITED(status)) {
+			printf("Clone %d exited with status %d\n", i+1, WEXITSTATUS(status));
+			if (WEXITSTATUS(status)!=0) failed++;
+		} else {
+			printf("Clone %d killed by signal %d\n", i+1, WTERMSIG(status));
+			failed++;
+		}
+	}
+	printf("%d of %d clones failed.\n", failed, n_clones);
+	fflush(stdout);
+	//The clones ran the exit handlers; running them here too would have
+	//this process overwrite what they wrote.
+	_exit(failed?1:0);
+}
@@ -0,0 +1,16 @@
+#ifndef CLONE_H
+#define CLONE_H
+
+//Enable cloning into n processes. Cloning starts when the guest prints
+//marker on the console (if not NULL) or when the process gets SIGHUP.
+void clone_init(int n, const char *marker);
+
+//Returns true if cloning has been triggered and hasn't happened yet.
+int clone_requested();
+
+//Fork the clones. Returns the clone number (1 to n) in the clones. The
+//original process waits until all clones exit and then exits itself without
+//running atexit handlers, with status 0 if all clones exited with status 0.
+int clone_fork();
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ Control socket: lets other programs query and steer a running emulator
+ through a Unix-domain socket.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+
+/*
+The protocol is line based: a client sends a command and its arguments
+separated by spaces, ended by a newline. The emulator sends back the output of
+the command followed by a line that is either 'ok' or 'error'. Commands are
+only read from the main loop, between timeslices, so they always see the
+machine in a consistent state. All sockets are non-blocking, except that
+replies are written out in full.
+*/
+
+#define MAX_CLIENTS 8
+#define LINE_SZ 256
+#define MAX_ARGS 8
+
+typedef struct {
+	int fd;				//-1 if unused
+	char line[LINE_SZ];
+	int len;
+} client_t;
+
+static int listen_fd=-1;
+static control_handler_t handler;
+static client_t clients[MAX_CLIENTS];
+
+int control_init(const char *path, control_handler_t h) {
+	struct sockaddr_un sa={.sun_family=AF_UNIX};
+	if (strlen(path)>=sizeof(sa.sun_path)) {
+		printf("%s: socket path too long\n", path);
+		return 0;
+	}
+	strcpy(sa.sun_path, path);
+	//A forked clone gets its own socket; drop the ones it inherited.
+	if (listen_fd>=0) close(listen_fd);
+	for (int i=0; i<MAX_CLIENTS; i++) {
+		if (listen_fd>=0 && clients[i].fd>=0) close(clients[i].fd);
+		clients[i].fd=-1;
+	}
+	listen_fd=-1;
+	int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path); //remove stale socket from a previous run
+	if (fd<0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa))!=0 || listen(fd, MAX_CLIENTS)!=0) {
+		perror(path);
+		if (fd>=0) close(fd);
+		return 0;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+	listen_fd=fd;
+	handler=h;
+	return 1;
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t r=send(fd, buf, len, MSG_NOSIGNAL);
+		if (r<=0) return; //client is gone; we notice when reading
+		buf+=r;
+		len-=r;
+	}
+}
+
+static void run_line(client_t *c, char *line) {
+	char *argv[MAX_ARGS];
+	int argc=0;
+	char *save;
+	for (char *w=strtok_r(line, " \t\r", &save); w && argc<MAX_ARGS; w=strtok_r(NULL, " \t\r", &save)) {
+		argv[argc++]=w;
+	}
+	if (argc==0) return;
+	char *buf=NULL;
+	size_t len=0;
+	FILE *out=open_memstream(&buf, &len);
+	int ok=handler(argc, argv, out);
+	fprintf(out, ok?"ok\n":"error\n");
+	fclose(out);
+	send_all(c->fd, buf, len);
+	free(buf);
+}
+
+static void handle_client(client_t *c) {
+	int r=recv(c->fd, c->line+c->len, LINE_SZ-1-c->len, MSG_DONTWAIT);
+	if (r==0 || (r<0 && errno!=EAGAIN && errno!=EWOULDBLOCK)) {
+		close(c->fd);
+		c->fd=-1;
+		return;
+	}
+	if (r<0) return;
+	c->len+=r;
+	c->line[c->len]=0;
+	char *nl;
+	while (c->fd>=0 && (nl=strchr(c->line, '\n'))!=NULL) {
+		*nl=0;
+		int used=nl-c->line+1;
+		run_line(c, c->line);
+		memmove(c->line, c->line+used, c->len-used+1);
+		c->len-=used;
+	}
+	if (c->len==LINE_SZ-1) {
+		const char *msg="line too long\nerror\n";
+		send_all(c->fd, msg, strlen(msg));
+		c->len=0;
+	}
+}
+
+void control_poll(int wait_ms) {
+	if (listen_fd<0) return;
+	struct pollfd pfd[MAX_CLIENTS+1];
+	int n=0;
+	pfd[n++]=(struct pollfd){.fd=listen_fd, .events=POLLIN};
+	for (int i=0; i<MAX_CLIENTS; i++) {
+		if (clients[i].fd>=0) pfd[n++]=(struct pollfd){.fd=clients[i].fd, .events=POLLIN};
+	}
+	if (poll(pfd, n, wait_ms)<=0) return;
+	for (int i=1; i<n; i++) {
+		if (!pfd[i].revents) continue;
+		for (int j=0; j<MAX_CLIENTS; j++) {
+			if (clients[j].fd==pfd[i].fd) handle_client(&clients[j]);
+		}
+	}
+	if (pfd[0].revents) {
+		int fd=accept(listen_fd, NULL, NULL);
+		if (fd<0) return;
+		for (int i=0; i<MAX_CLIENTS; i++) {
+			if (clients[i].fd<0) {
+				clients[i].fd=fd;
+				clients[i].len=0;
+				return;
+			}
+		}
+		const char *msg="too many clients\nerror\n";
+		send_all(fd, msg, strlen(msg));
+		close(fd);
+	}
+}
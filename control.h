@@ -0,0 +1,17 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+
+//Called for every command line a client sends, split into words. Output
+//written to out is sent back to the client. Return 0 if the command failed.
+typedef int (*control_handler_t)(int argc, char **argv, FILE *out);
+
+//Listen for control clients on a Unix socket at path. Returns 0 on error.
+int control_init(const char *path, control_handler_t handler);
+
+//Accept new clients and run the commands they sent. Waits up to wait_ms for
+//something to happen; use 0 to only handle what's already there.
+void control_poll(int wait_ms);
+
+#endif
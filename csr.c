@@ -346,4 +346,10 @@ csr_t *csr_new(scsi_t *scsi) {
 	return ret;
 }
 
+void csr_ckpt_save(csr_t *csr, ckpt_t *c) {
+	ckpt_put(c, "csr", csr->reg, sizeof(csr->reg));
+}
 
+int csr_ckpt_load(csr_t *csr, ckpt_t *c) {
+	return ckpt_get(c, "csr", csr->reg, sizeof(csr->reg));
+}
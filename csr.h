@@ -1,4 +1,5 @@
 #include "scsi.h"
+#include "checkpoint.h"
 
 typedef struct csr_t csr_t;
 
@@ -44,3 +45,6 @@ void csr_set_access_error(csr_t *csr, int cpu, int type, int addr, int is_write)
 #define PARITY_ERROR_L 2
 void csr_set_parity_error(csr_t *c, int hl);
 
+//Save or restore the CSR state in a checkpoint.
+void csr_ckpt_save(csr_t *csr, ckpt_t *c);
+int csr_ckpt_load(csr_t *csr, ckpt_t *c);
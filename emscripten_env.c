@@ -6,6 +6,22 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include "emscripten_env.h"
 #include "emscripten.h"
 
+/*
+Syncing the IDBFS filesystem to IndexedDB is expensive and stalls the emulator,
+so we don't do it on every write. Instead, writers mark the filesystem as dirty
+and the sync is done when nothing was written for SYNC_IDLE_MS, or at the latest
+SYNC_MAX_MS after the first unsynced write. Note that the data itself is written
+to the in-memory filesystem immediately; only persisting it to IndexedDB is
+delayed. When the page is hidden or unloaded, we sync immediately.
+*/
+
+#define SYNC_IDLE_MS 1000
+#define SYNC_MAX_MS 5000
+
+static int fs_dirty=0;
+static double first_dirty_ms;
+static double last_dirty_ms;
+
 void emscripten_init() {
 	//We want an IDBFS filesystem on /persist where we can store RTC and COW stuff.
 	EM_ASM(
@@ -14,13 +30,53 @@ void emscripten_init() {
 		FS.syncfs(true, function (err) {
 			assert(!err);
 		});
+		Module.syncfs_busy=false;
+		//Final flush when the user leaves or hides the page. This goes through
+		//emscripten_syncfs() so it never overlaps with a sync in progress.
+		var flush=function() {
+			_rtcram_flush_pending();
+			_emscripten_syncfs();
+		};
+		window.addEventListener("pagehide", flush);
+		document.addEventListener("visibilitychange", function() {
+			if (document.visibilityState==="hidden") flush();
+		});
 	);
 }
 
-void emscripten_syncfs() {
+EMSCRIPTEN_KEEPALIVE void emscripten_syncfs() {
+	fs_dirty=0;
 	EM_ASM(
-		FS.syncfs(false, function (err) {
+		if (Module.syncfs_busy) {
+			//Can't run two syncs at the same time; try again when this one is done.
+			Module.syncfs_again=true;
+			return;
+		}
+		Module.syncfs_busy=true;
+		var done=function (err) {
 			assert(!err);
-		});
+			if (Module.syncfs_again) {
+				Module.syncfs_again=false;
+				FS.syncfs(false, done);
+			} else {
+				Module.syncfs_busy=false;
+			}
+		};
+		FS.syncfs(false, done);
 	);
 }
+
+void emscripten_syncfs_request() {
+	double now=emscripten_get_now();
+	if (!fs_dirty) first_dirty_ms=now;
+	last_dirty_ms=now;
+	fs_dirty=1;
+}
+
+void emscripten_syncfs_poll() {
+	if (!fs_dirty) return;
+	double now=emscripten_get_now();
+	if (now-last_dirty_ms>=SYNC_IDLE_MS || now-first_dirty_ms>=SYNC_MAX_MS) {
+		emscripten_syncfs();
+	}
+}
@@ -2,5 +2,12 @@
 //Initialize emscripten stuff
 void emscripten_init();
 
-//Synchronize writes to idbfs
+//Synchronize writes to idbfs now
 void emscripten_syncfs();
+
+//Mark idbfs as having unsynchronized writes. The actual sync happens
+//later, from emscripten_syncfs_poll().
+void emscripten_syncfs_request();
+
+//Call this periodically (preferably when idle); syncs idbfs if needed.
+void emscripten_syncfs_poll();
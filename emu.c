@@ -15,11 +15,7 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include <stdlib.h>
 #include <time.h>
 #include <signal.h>
-#include <sys/time.h>
 #include <unistd.h>
-#ifdef __EMSCRIPTEN__
-#include "emscripten.h"
-#endif
 #include "Musashi/m68k.h"
 #include "uart.h"
 #include "ramrom.h"
@@ -27,6 +23,7 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include "mapper.h"
 #include "scsi.h"
 #include "scsi_dev_hd.h"
+#include "scsi_dev_ramdisk.h"
 #include "mbus.h"
 #include "rtc.h"
 #include "rtcram.h"
@@ -34,20 +31,23 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include "emu.h"
 #include "int.h"
 #include "sysvr2-strace.h"
-
-//If this is set to 1, you can set the variable do_tracefile to a value
-//of (1<<cpu) to print out one line indicating the PC and other info
-//for each instruction executed to a file called 'trace.txt'.
-#define SUPPORT_TRACEFILE 0
-
-//if running realtime, we'll sleep for a bit every SLEEP_EVERY_US us
-#define SLEEP_EVERY_US 10000 //10ms = 100Hz
+#include "script.h"
+#include "trace.h"
+#include "profile.h"
+#include "sysstat.h"
+#include "stats.h"
+#include "pace.h"
+#include "replay.h"
+#include "clone.h"
+#include "checkpoint.h"
+#include "control.h"
+#include <glob.h>
 
 //We run dma for this long, then job for this long, then service the
 //peripherals.
 #define CPU_RUN_US 10
 
-//CPU speed in Hz
+//Default CPU speed in Hz. P/20s were sold with 10 and 12.5MHz CPUs.
 #define CPU_SPEED_HZ 10000000 //10MHz
 
 
@@ -63,15 +63,36 @@ typedef struct mem_range_t mem_range_t;
 typedef unsigned int (*read_cb)(void *obj, unsigned int addr);
 typedef void (*write_cb)(void *obj, unsigned int addr, unsigned int val);
 
-#if SUPPORT_TRACEFILE
-FILE *tracefile=NULL;
-int do_tracefile=0;
-#endif
+//Binary instruction trace per CPU, or NULL if that CPU isn't traced
+static trace_t *tracer[2]={NULL};
+static char *trace_ram_file=NULL;
 
 //Instruction ID. Increases with every CPU instruction executed. You can use
 //this to correlate a trace file and dump_cpu_state output.
 unsigned int insn_id=0;
 
+//Emulated time since start, in microseconds.
+static uint64_t emu_time_us=0;
+
+//CPU clock. All device timing is in microseconds of emulated time, so this
+//only decides how many cycles the CPUs get per microsecond.
+static int cpu_hz=CPU_SPEED_HZ;
+
+//True while m68k_execute is running
+static int cpu_executing=0;
+//CPU cycles executed in all finished timeslices, both CPUs
+static uint64_t cycles_run=0;
+
+uint64_t emu_get_time_us() {
+	return emu_time_us;
+}
+
+uint64_t emu_get_cycles() {
+	uint64_t c=cycles_run;
+	if (cpu_executing) c+=m68k_cycles_run();
+	return c;
+}
+
 //Currently emulated CPU. 0=dma, 1=job
 int cur_cpu=0;
 //Bits output by the 68000 on the FC pins.
@@ -111,6 +132,7 @@ struct mem_range_t {
 	write_cb write8;		// within the CPU address space.
 	write_cb write16;		//
 	write_cb write32;		//
+	uint64_t *acc;			//Access counters (see memstat_count), or NULL if not collecting
 };
 
 //Flags for mem_range_t->flags
@@ -204,6 +226,98 @@ static mem_range_t *find_range_by_name(const char *name) {
 	return NULL;
 }
 
+/*
+Memory access statistics. When enabled, every range gets counters for every
+access size and direction, per source: the two CPUs and DMA (SCSI and Multibus
+transfers). Optionally, reads and writes are also counted per 4K page of
+physical RAM, for both direct and mapped RAM accesses.
+*/
+enum {
+	MEMSTAT_R8=0, MEMSTAT_R16, MEMSTAT_R32,
+	MEMSTAT_W8, MEMSTAT_W16, MEMSTAT_W32,
+	MEMSTAT_TYPES
+};
+#define MEMSTAT_SRCS 3
+#define HEAT_PAGE_SHIFT 12
+
+static const char *memstat_file=NULL;
+static const char *memheat_file=NULL;
+static int memstat_dma=0;			//True while doing a DMA access
+static uint64_t *ram_heat=NULL;		//[page][2] read and write counts per physical RAM page
+static unsigned int heat_pages=0;	//Pages in ram_heat; RAM's range shrinks to 0 when the mapper is enabled
+static mem_range_t *heat_ram=NULL, *heat_mapram=NULL;
+
+static void memstat_count_heat(mem_range_t *m, unsigned int address, int is_write) {
+	if (m==heat_mapram) {
+		address=mapper_virt_to_phys(mapper, address);
+	} else if (m!=heat_ram) {
+		return;
+	}
+	unsigned int page=address>>HEAT_PAGE_SHIFT;
+	if (page<heat_pages) ram_heat[page*2+is_write]++;
+}
+
+static inline void memstat_count(mem_range_t *m, unsigned int address, int type) {
+	if (__builtin_expect(m->acc==NULL, 1)) return;
+	int src=memstat_dma?2:cur_cpu;
+	m->acc[src*MEMSTAT_TYPES+type]++;
+	if (ram_heat) memstat_count_heat(m, address, type>=MEMSTAT_W8);
+}
+
+static void memstat_init(const char *file, const char *heatfile) {
+	memstat_file=file;
+	memheat_file=heatfile;
+	for (int i=0; memory[i].name!=NULL; i++) {
+		memory[i].acc=calloc(MEMSTAT_SRCS*MEMSTAT_TYPES, sizeof(uint64_t));
+	}
+	if (heatfile) {
+		heat_ram=find_range_by_name("RAM");
+		heat_mapram=find_range_by_name("MAPRAM");
+		heat_pages=heat_ram->size>>HEAT_PAGE_SHIFT;
+		ram_heat=calloc(heat_pages*2, sizeof(uint64_t));
+	}
+}
+
+//Write the access counters as CSV.
+static void memstat_dump_counts() {
+	static const char *src_names[MEMSTAT_SRCS]={"cpu0", "cpu1", "dma"};
+	FILE *f=fopen(memstat_file, "w");
+	if (!f) {
+		perror(memstat_file);
+		return;
+	}
+	fprintf(f, "range,source,read8,read16,read32,write8,write16,write32\n");
+	for (int i=0; memory[i].name!=NULL; i++) {
+		for (int s=0; s<MEMSTAT_SRCS; s++) {
+			uint64_t *c=&memory[i].acc[s*MEMSTAT_TYPES];
+			fprintf(f, "%s,%s", memory[i].name, src_names[s]);
+			for (int t=0; t<MEMSTAT_TYPES; t++) fprintf(f, ",%llu", (unsigned long long)c[t]);
+			fprintf(f, "\n");
+		}
+	}
+	fclose(f);
+}
+
+//Write the RAM heat map as CSV.
+static void memstat_dump_heat() {
+	FILE *f=fopen(memheat_file, "w");
+	if (!f) {
+		perror(memheat_file);
+		return;
+	}
+	fprintf(f, "page,reads,writes\n");
+	for (int p=0; p<heat_pages; p++) {
+		fprintf(f, "0x%06x,%llu,%llu\n", p<<HEAT_PAGE_SHIFT,
+				(unsigned long long)ram_heat[p*2], (unsigned long long)ram_heat[p*2+1]);
+	}
+	fclose(f);
+}
+
+static void memstat_dump() {
+	if (memstat_file) memstat_dump_counts();
+	if (memheat_file) memstat_dump_heat();
+}
+
 //Find a range given an address that falls in that range.
 //There's faster ways to do this. We don't implement them for now.
 static mem_range_t *find_range_by_addr(unsigned int addr) {
@@ -309,9 +423,10 @@ rtc_t *setup_rtc(const char *name) {
 // RTC RAM is physically part of the RTC, but implemented in a different
 // virtual device for simplicity; it is like standard RAM, but persistent
 // over separate emulator runs.
-void setup_rtcram(const char *name, const char *filename) {
+rtcram_t *setup_rtcram(const char *name, const char *filename) {
 	mem_range_t *m=find_range_by_name(name);
-	m->obj=rtcram_new(filename);
+	rtcram_t *r=rtcram_new(filename);
+	m->obj=r;
 	m->write8=rtcram_write8;
 	m->write16=rtcram_write16;
 	m->write32=rtcram_write32;
@@ -319,6 +434,7 @@ void setup_rtcram(const char *name, const char *filename) {
 	m->read16=rtcram_read16;
 	m->read32=rtcram_read32;
 	EMU_LOG_INFO("Set up 0x%X bytes of persistent RAM in section '%s'.\n", m->size, m->name);
+	return r;
 }
 
 //Set up Control/Status Register (CSR) range
@@ -413,6 +529,7 @@ static int check_can_access(mem_range_t *m, unsigned int address) {
 	}
 	if (!ret) {
 		csr_set_access_error(csr, cur_cpu, ACCESS_ERROR_A, address, 0);
+		emu_stats.bus_errors++;
 		m68k_pulse_bus_error(); //note this function longjmp()s and never returns.
 	}
 	return ret;
@@ -438,6 +555,7 @@ static unsigned int read_memory_32(unsigned int address) {
 	}
 
 	if (!check_can_access(m, address)) return 0;
+	memstat_count(m, address - m->offset, MEMSTAT_R32);
 	return m->read32(m->obj, address - m->offset);
 }
 
@@ -454,6 +572,7 @@ static unsigned int read_memory_16(unsigned int address) {
 		return 0xbeef;
 	}
 	if (!check_can_access(m, address)) return 0;
+	memstat_count(m, address - m->offset, MEMSTAT_R16);
 	return m->read16(m->obj, address - m->offset);
 }
 
@@ -470,6 +589,7 @@ static unsigned int read_memory_8(unsigned int address) {
 		return 0x5a;
 	}
 	if (!check_can_access(m, address)) return 0;
+	memstat_count(m, address - m->offset, MEMSTAT_R8);
 	return m->read8(m->obj, address - m->offset);
 }
 
@@ -486,6 +606,7 @@ static void write_memory_8(unsigned int address, unsigned int value) {
 		return;
 	}
 	if (!check_can_access(m, address)) return;
+	memstat_count(m, address - m->offset, MEMSTAT_W8);
 	m->write8(m->obj, address - m->offset, value);
 }
 
@@ -503,6 +624,7 @@ static void write_memory_16(unsigned int address, unsigned int value) {
 		return;
 	}
 	if (!check_can_access(m, address)) return;
+	memstat_count(m, address - m->offset, MEMSTAT_W16);
 	m->write16(m->obj, address - m->offset, value);
 }
 
@@ -520,10 +642,12 @@ static void write_memory_32(unsigned int address, unsigned int value) {
 		return;
 	}
 	if (!check_can_access(m, address)) return;
+	memstat_count(m, address - m->offset, MEMSTAT_W32);
 	m->write32(m->obj, address - m->offset, value);
 }
 
 void emu_set_cur_mapid(uint8_t id) {
+	if (mapper_get_mapid(mapper)!=id) emu_mapping_changed();
 	mapper_set_mapid(mapper, id);
 }
 
@@ -550,6 +674,8 @@ static int check_mem_access(unsigned int address, int flags) {
 			dump_callstack();
 		}
 		csr_set_access_error(csr, cur_cpu, access, address, flags&ACCESS_W);
+		emu_stats.mapper_faults++;
+		emu_stats.bus_errors++;
 
 		//note: THIS FUNCTION WILL NOT RETURN!
 		//(m68k_pulse_bus error calls m68ki_exception_bus_error, which
@@ -561,6 +687,7 @@ static int check_mem_access(unsigned int address, int flags) {
 }
 
 void emu_set_force_a23(int val) {
+	if (force_a23!=val) emu_mapping_changed();
 	force_a23=val;
 }
 
@@ -616,6 +743,8 @@ static void handle_write_parity_error(unsigned int address, int len) {
 				if (!(parity_errors[i]&PARITY_ERR_ACTIVE)) {
 					parity_errors[i]=a|PARITY_ERR_ACTIVE;
 					parity_errors_count++;
+					//Fetches from here now need to raise the parity error.
+					emu_mapping_changed();
 					break;
 				}
 			}
@@ -632,18 +761,55 @@ static void handle_write_parity_error(unsigned int address, int len) {
 	}
 }
 
+/*
+Instruction fetches normally go through the same checks as any other read. As
+that's a lot of work for every instruction word, after a successful fetch we
+tell Musashi where the rest of the 4K page lives in host memory, so it can read
+instruction words from there until something changes the mapping. This is only
+done for RAM and ROM, and not while reads need to be seen one by one: while
+there are parity errors pending or memory accesses are being counted.
+*/
+void emu_mapping_changed() {
+	m68k_invalidate_fetch_pages();
+}
+
+//After an instruction fetch from CPU address cpu_addr (address after forcing A23)
+//set up the fast path for the rest of its page.
+static void set_fetch_page(unsigned int cpu_addr, unsigned int address) {
+	if (parity_errors_count) return;
+	unsigned int page=address&~(RAM_PAGE_SIZE-1);
+	mem_range_t *m=find_range_by_addr(page);
+	if (!m || m->acc || (m->offset&(RAM_PAGE_SIZE-1)) || page+RAM_PAGE_SIZE>m->offset+m->size) return;
+	uint8_t *p=NULL;
+	if (m->read16==ram_read16) {
+		//RAM wraps around if the range is bigger than the memory.
+		ram_t *r=m->obj;
+		int pg=((page-m->offset)>>RAM_PAGE_SHIFT)%ram_page_count(r);
+		if (ram_page_len(r, pg)==RAM_PAGE_SIZE) p=ram_page_data(r, pg);
+	} else if (m->read16==mapper_ram_read16) {
+		p=mapper_page_data(mapper, page-m->offset);
+	}
+	if (p) m68k_set_fetch_page(cpu_addr&~(RAM_PAGE_SIZE-1), RAM_PAGE_SIZE, p);
+}
+
 unsigned int m68k_read_memory_32(unsigned int address) {
+	unsigned int cpu_addr=address;
 	if (force_a23 & (1<<cur_cpu)) address|=0x800000;
 	if (!check_mem_access(address, ACCESS_R)) return 0;
 	check_parity_error(address, 4);
-	return read_memory_32(address);
+	unsigned int ret=read_memory_32(address);
+	if ((fc_bits&3)==2) set_fetch_page(cpu_addr, address);
+	return ret;
 }
 
 unsigned int m68k_read_memory_16(unsigned int address) {
+	unsigned int cpu_addr=address;
 	if (force_a23 & (1<<cur_cpu)) address|=0x800000;
 	if (!check_mem_access(address, ACCESS_R)) return 0;
 	check_parity_error(address, 2);
-	return read_memory_16(address);
+	unsigned int ret=read_memory_16(address);
+	if ((fc_bits&3)==2) set_fetch_page(cpu_addr, address);
+	return ret;
 }
 
 
@@ -682,14 +848,19 @@ int emu_read_byte(int addr) {
 	if (mapper_access_allowed(mapper, addr, access_flags)!=ACCESS_ERROR_OK) {
 		return -1;
 	}
-	return read_memory_8(addr);
+	memstat_dma=1;
+	int r=read_memory_8(addr);
+	memstat_dma=0;
+	return r;
 }
 
 //Used for SCSI DMA transfers as well as mbus transfers.
 int emu_write_byte(int addr, int val) {
 	int access_flags=ACCESS_W|ACCESS_SYSTEM;
 	if (mapper_access_allowed(mapper, addr, access_flags)!=ACCESS_ERROR_OK) return -1;
+	memstat_dma=1;
 	write_memory_8(addr, val);
+	memstat_dma=0;
 	return 0;
 }
 
@@ -726,6 +897,7 @@ int emu_try_mbus_held() {
  turned on/off, the non-zero and zero sizes are swapped.
 */
 void emu_enable_mapper(int do_enable) {
+	if (mapper_enabled!=do_enable) emu_mapping_changed();
 	mapper_enabled=do_enable;
 	mem_range_t *r=find_range_by_name("RAM");
 	mem_range_t *mr=find_range_by_name("MAPRAM");
@@ -744,9 +916,26 @@ void emu_enable_mapper(int do_enable) {
 	}
 }
 
+//Syscall statistics and tracing
+static int sysstat_on=0;
+static int trace_syscalls=0;
+static int job_cpu_super=1;
+
 void m68k_fc_cb(unsigned int fc) {
 	fc_bits=fc;
 	mapper_set_sysmode(mapper, fc&4);
+	if (sysstat_on && cur_cpu==1) {
+		//Going back to user mode finishes a pending syscall. Look at the S bit
+		//rather than the function code, as a MOVES from supervisor mode also
+		//accesses user space.
+		int super=(m68k_get_reg(NULL, M68K_REG_SR)&0x2000)?1:0;
+		if (job_cpu_super && !super) {
+			//Carry flag indicates an error.
+			int error=m68k_get_reg(NULL, M68K_REG_SR)&1;
+			sysstat_return(mapper_get_mapid(mapper), emu_get_cycles(), m68k_get_reg(NULL, M68K_REG_D0), error);
+		}
+		job_cpu_super=super;
+	}
 }
 
 uint32_t stget32(void *ctx, uint32_t addr)
@@ -759,14 +948,17 @@ uint8_t stget8(void *ctx, uint32_t addr)
 	return read_memory_8(addr);
 }
 
-//note: only invoked if cfg->tracesyscalls is true
+//note: only invoked if syscall tracing or statistics are enabled
 void m68k_trap_cb(unsigned int vector) {
 	if (cur_cpu != 1 || vector != 32) {
 		return;
 	}
 	unsigned int d0 = m68k_get_reg(NULL, M68K_REG_D0);
-	unsigned int sp = m68k_get_reg(NULL, M68K_REG_A7);
-	log_printf(LOG_SRC_STRACE, LOG_INFO, "strace: %s\n", m68k_strace(NULL, d0, sp));
+	if (sysstat_on) sysstat_enter(mapper_get_mapid(mapper), d0, emu_get_cycles());
+	if (trace_syscalls) {
+		unsigned int sp = m68k_get_reg(NULL, M68K_REG_A7);
+		log_printf(LOG_SRC_STRACE, LOG_INFO, "strace: %s\n", m68k_strace(NULL, d0, sp));
+	}
 }
 
 //has a level if triggered, otherwise 0
@@ -799,6 +991,7 @@ int m68k_int_cb(int level) {
 		//we clear it here, that seems to work.
 		vectors[cur_cpu][r]=0;
 	}
+	emu_stats.int_acked[r]++;
 	raise_highest_int();
 	//we ignore the clock ints when printing debug messages because it spams
 	//the console too much.
@@ -817,6 +1010,7 @@ void emu_raise_int(uint8_t vector, uint8_t level, int cpu) {
 			EMU_LOG_DEBUG("Interrupt %s: %x\n", level?"raised":"cleared", vector);
 		}
 		vectors[cpu][vector]=level;
+		if (level) emu_stats.int_raised[vector]++;
 		need_raise_highest_int[cpu]=1;
 		//cut timeslice short because we possibly need to handle peripherals or the
 		//other CPU.
@@ -849,6 +1043,7 @@ void handle_callstack_ovf_udf(int cpu) {
 void m68k_trace_cb(unsigned int pc) {
 	static unsigned int prev_pc=0;
 	insn_id++;
+	emu_stats.insns[cur_cpu]++;
 #if 0
 	//Example of how to set the equivalent of a breakpoint (dump CPU state 
 	//when a certain PC is reached)
@@ -871,10 +1066,7 @@ void m68k_trace_cb(unsigned int pc) {
 
 	prev_pc=pc;
 
-#if SUPPORT_TRACEFILE
-	unsigned int sr=m68k_get_reg(NULL, M68K_REG_SR);
-	if (do_tracefile&(1<<cur_cpu)) fprintf(tracefile, "%d %d %06x %x\n", insn_id, cur_cpu, pc, sr);
-#endif
+	if (tracer[cur_cpu]) trace_insn(tracer[cur_cpu], insn_id, pc, m68k_get_reg(NULL, M68K_REG_SR), ir);
 	if (trace_enabled) {
 		dump_cpu_state();
 	}
@@ -903,11 +1095,12 @@ int emu_get_cur_cpu() {
 void emu_bus_error() {
 	EMU_LOG_INFO("Bus error on CPU %d\n", cur_cpu);
 	dump_cpu_state();
+	emu_stats.bus_errors++;
 	m68k_pulse_bus_error(); //note this function longjmp()s and never returns
 }
 
 void emu_schedule_int_us(int us) {
-	int cycles=us*10; //cpu is 10MHz
+	int cycles=(int64_t)us*cpu_hz/1000000;
 	int rem=m68k_cycles_remaining();
 	if (rem>cycles) {
 		m68k_modify_timeslice(cycles);
@@ -916,36 +1109,497 @@ void emu_schedule_int_us(int us) {
 
 int dump_status=0;
 
+static void trace_finish() {
+	for (int i=0; i<2; i++) {
+		if (tracer[i]) trace_close(tracer[i]);
+		tracer[i]=NULL;
+	}
+	//Snapshot of RAM, so the decoder can show the operands of code running from RAM.
+	ram_save(find_range_by_name("RAM")->obj, trace_ram_file);
+}
+
+static void setup_trace(emu_cfg_t *cfg) {
+	int len=strlen(cfg->trace_prefix);
+	char name[len+16];
+	for (int i=0; i<2; i++) {
+		if (!(cfg->trace_cpus&(1<<i))) continue;
+		sprintf(name, "%s.cpu%d%s", cfg->trace_prefix, i, cfg->trace_compress?".gz":"");
+		tracer[i]=trace_open(name, i, cfg->trace_compress);
+		if (!tracer[i]) exit(1);
+	}
+	trace_ram_file=malloc(len+8);
+	sprintf(trace_ram_file, "%s.ram", cfg->trace_prefix);
+	atexit(trace_finish);
+}
+
 //Signal handler for ctrl+\.
 static void sig_hdl(int sig) {
 	dump_status=1;
-	m68k_modify_timeslice(0);
+	//Cutting the timeslice short changes what the guest sees, so when
+	//recording or replaying, the dump waits until the end of the loop.
+	if (!replay_recording() && !replay_playing()) m68k_modify_timeslice(0);
+}
+
+//The machine's devices and CPU state, kept here so checkpoints can get at them.
+static uart_t *uart[4];
+static rtc_t *rtc;
+static rtcram_t *rtcram;
+static scsi_t *scsi;
+static scsi_dev_t *hd1;
+static ram_t *ramdisk_ram=NULL;		//Contents of the RAM disk, if any
+static void *cpuctx[2];
+static int cpu_in_reset[2]={0};
+static int cycles_remaining[2]={0};
+
+//Start recording or replaying. Both store or check the initial state the machine
+//gets from the host.
+static void setup_replay(emu_cfg_t *cfg, rtcram_t *rtcram, scsi_dev_t *hd) {
+	if (cfg->unlimited) {
+		printf("Record/replay doesn't work in unlimited mode, as that depends on host timing.\n");
+		exit(1);
+	}
+	if (cfg->record_file && !replay_record(cfg->record_file)) exit(1);
+	if (cfg->replay_file) {
+		if (!replay_play(cfg->replay_file)) exit(1);
+		if (cfg->replay_fast) cfg->realtime=0;
+	}
+	uint8_t nvram[RTCRAM_SIZE];
+	rtcram_get_contents(rtcram, nvram);
+	replay_blob("rtcram", nvram, RTCRAM_SIZE);
+	rtcram_set_contents(rtcram, nvram);
+	replay_check("hd0", scsi_dev_hd_hash(hd));
 }
 
+static int control_cmd(int argc, char **argv, FILE *out);
+
+//Turn this process into clone n. It gets its own writable disk layer, NVRAM
+//file and its console on a Unix socket, all named after the COW directory.
+static void become_clone(emu_cfg_t *cfg, int n, scsi_dev_t *hd, uart_t *console) {
+	char name[strlen(cfg->cow_dir)+32];
+	sprintf(name, "%s-clone%d", cfg->cow_dir, n);
+	if (!scsi_dev_hd_clone(hd, name)) exit(1);
+	sprintf(name, "%s-clone%d.nvram", cfg->cow_dir, n);
+	rtcram_set_filename(rtcram, name);
+	sprintf(name, "unix:%s-clone%d.sock", cfg->cow_dir, n);
+	serport_t *p=serport_new(name);
+	if (!p) exit(1);
+	uart_set_port(console, 1, p);
+	printf("Clone %d: console on %s\n", n, serport_name(p));
+	if (cfg->control_path) {
+		sprintf(name, "%s-clone%d.ctl", cfg->cow_dir, n);
+		if (!control_init(name, control_cmd)) exit(1);
+	}
+}
 
-void emu_start(emu_cfg_t *cfg) {
-#if SUPPORT_TRACEFILE
-	tracefile=fopen("trace.txt","w");
-#endif
-//Note: this is a bitmask for which CPU gets logged. (1<<0) for dma, (1<<1) for job cpu.
-//	do_tracefile=(1<<1);
+//Hash of the CPU state, recorded every emulated second to detect replay divergence.
+static uint64_t cpu_state_hash(void **cpuctx) {
+	uint64_t h=REPLAY_HASH_INIT;
+	for (int i=0; i<2; i++) {
+		h=replay_hash(h, &emu_stats.insns[i], sizeof(emu_stats.insns[i]));
+		for (int r=M68K_REG_D0; r<=M68K_REG_SR; r++) {
+			uint32_t v=m68k_get_reg(cpuctx[i], r);
+			h=replay_hash(h, &v, sizeof(v));
+		}
+	}
+	return h;
+}
+
+//Install our Musashi callbacks in the current CPU context.
+static void set_cpu_callbacks() {
+	m68k_set_int_ack_callback(m68k_int_cb);
+	m68k_set_instr_hook_callback(m68k_trace_cb);
+	m68k_set_fc_callback(m68k_fc_cb);
+	if (trace_syscalls || sysstat_on) m68k_set_trap_instr_callback(m68k_trap_cb);
+}
+
+/*
+Checkpoints are written as prefix.n, n counting up. Every CKPT_FULL_EVERY
+checkpoints, a full one is written and the ones before it are removed; the
+others only have the RAM pages written since the previous checkpoint. The hard
+disk contents are not part of a checkpoint, only the command it is handling;
+a RAM disk is saved the same way as RAM.
+*/
+#define CKPT_FULL_EVERY 32
+
+//Emulator state that goes into a checkpoint, next to the CPU contexts and devices.
+typedef struct {
+	uint64_t emu_time_us;
+	uint64_t cycles_run;
+	unsigned int insn_id;
+	unsigned int fc_bits;
+	int mapper_enabled;
+	int force_a23;
+	int parity_force_error;
+	int mbus_diag_en;
+	unsigned int parity_errors[PARITY_ERR_BUF_SZ];
+	unsigned int parity_errors_count;
+	uint8_t vectors[2][256];
+	int need_raise_highest_int[2];
+	int cpu_in_reset[2];
+	int cycles_remaining[2];
+	int job_cpu_super;
+	int32_t callstack[2][CALLSTACK_SZ];
+	int callstack_ptr[2];
+} emu_state_t;
+
+static int ckpt_seq=0;			//Number of the next checkpoint
+static int ckpt_need_full=1;	//If true, the next checkpoint must be a full one
+
+static void ckpt_name(char *buf, const char *prefix, int n) {
+	sprintf(buf, "%s.%d", prefix, n);
+}
+
+//Write the machine state to a file. Doesn't touch the RAM dirty state.
+static int write_ckpt_file(const char *name, int full) {
+	ckpt_t *c=ckpt_create(name, full);
+	if (!c) return 0;
+
+	emu_state_t *st=calloc(sizeof(emu_state_t), 1);
+	st->emu_time_us=emu_time_us;
+	st->cycles_run=cycles_run;
+	st->insn_id=insn_id;
+	st->fc_bits=fc_bits;
+	st->mapper_enabled=mapper_enabled;
+	st->force_a23=force_a23;
+	st->parity_force_error=parity_force_error;
+	st->mbus_diag_en=mbus_diag_en;
+	memcpy(st->parity_errors, parity_errors, sizeof(parity_errors));
+	st->parity_errors_count=parity_errors_count;
+	memcpy(st->vectors, vectors, sizeof(vectors));
+	memcpy(st->need_raise_highest_int, need_raise_highest_int, sizeof(need_raise_highest_int));
+	memcpy(st->cpu_in_reset, cpu_in_reset, sizeof(cpu_in_reset));
+	memcpy(st->cycles_remaining, cycles_remaining, sizeof(cycles_remaining));
+	st->job_cpu_super=job_cpu_super;
+	memcpy(st->callstack, callstack, sizeof(callstack));
+	memcpy(st->callstack_ptr, callstack_ptr, sizeof(callstack_ptr));
+	ckpt_put(c, "emu", st, sizeof(emu_state_t));
+	free(st);
+
+	ckpt_put(c, "cpu0", cpuctx[0], m68k_context_size());
+	ckpt_put(c, "cpu1", cpuctx[1], m68k_context_size());
+	ckpt_put_ram(c, "RAM", find_range_by_name("RAM")->obj);
+	ckpt_put_ram(c, "SRAM", find_range_by_name("SRAM")->obj);
+	if (ramdisk_ram) ckpt_put_ram(c, "ramdisk", ramdisk_ram);
+	uint8_t nvram[RTCRAM_SIZE];
+	rtcram_get_contents(rtcram, nvram);
+	ckpt_put(c, "rtcram", nvram, sizeof(nvram));
+	mapper_ckpt_save(mapper, c);
+	csr_ckpt_save(csr, c);
+	scsi_ckpt_save(scsi, c);
+	rtc_ckpt_save(rtc, c);
+	for (int i=0; i<4; i++) uart_ckpt_save(uart[i], c);
+	return ckpt_close(c);
+}
+
+//Write the next checkpoint in the series with the given prefix.
+static void write_checkpoint(const char *prefix) {
+	char name[strlen(prefix)+16];
+	int full=ckpt_need_full || (ckpt_seq%CKPT_FULL_EVERY)==0;
+	ckpt_name(name, prefix, ckpt_seq);
+	int ok=write_ckpt_file(name, full);
+	ram_clear_dirty(find_range_by_name("RAM")->obj);
+	ram_clear_dirty(find_range_by_name("SRAM")->obj);
+	if (ramdisk_ram) ram_clear_dirty(ramdisk_ram);
+	if (!ok) {
+		//The dirty pages are lost, so the next one needs to have everything.
+		ckpt_need_full=1;
+		return;
+	}
+	ckpt_need_full=0;
+	if (full) {
+		//Older checkpoints aren't needed anymore.
+		for (int i=ckpt_seq-1; i>=0 && i>=ckpt_seq-CKPT_FULL_EVERY; i--) {
+			ckpt_name(name, prefix, i);
+			unlink(name);
+		}
+	}
+	ckpt_seq++;
+}
+
+//Restore the device state from a checkpoint.
+static int load_devices(ckpt_t *c) {
+	emu_state_t *st=calloc(sizeof(emu_state_t), 1);
+	int ok=ckpt_get(c, "emu", st, sizeof(emu_state_t));
+	if (ok) {
+		emu_time_us=st->emu_time_us;
+		cycles_run=st->cycles_run;
+		insn_id=st->insn_id;
+		fc_bits=st->fc_bits;
+		emu_enable_mapper(st->mapper_enabled);
+		force_a23=st->force_a23;
+		parity_force_error=st->parity_force_error;
+		mbus_diag_en=st->mbus_diag_en;
+		memcpy(parity_errors, st->parity_errors, sizeof(parity_errors));
+		parity_errors_count=st->parity_errors_count;
+		memcpy(vectors, st->vectors, sizeof(vectors));
+		memcpy(need_raise_highest_int, st->need_raise_highest_int, sizeof(need_raise_highest_int));
+		memcpy(cpu_in_reset, st->cpu_in_reset, sizeof(cpu_in_reset));
+		memcpy(cycles_remaining, st->cycles_remaining, sizeof(cycles_remaining));
+		job_cpu_super=st->job_cpu_super;
+		memcpy(callstack, st->callstack, sizeof(callstack));
+		memcpy(callstack_ptr, st->callstack_ptr, sizeof(callstack_ptr));
+	}
+	free(st);
+	for (int i=0; i<2 && ok; i++) {
+		ok=ckpt_get(c, i?"cpu1":"cpu0", cpuctx[i], m68k_context_size());
+		//The context has pointers to tables and callbacks; set those again.
+		m68k_set_context(cpuctx[i]);
+		m68k_set_cpu_type(M68K_CPU_TYPE_68010);
+		m68k_init();
+		set_cpu_callbacks();
+		m68k_set_fetch_page(0, 0, NULL); //the saved pointer is from another process
+		m68k_get_context(cpuctx[i]);
+	}
+	uint8_t nvram[RTCRAM_SIZE];
+	if (ok) ok=ckpt_get(c, "rtcram", nvram, sizeof(nvram));
+	if (ok) rtcram_set_contents(rtcram, nvram);
+	if (ok) ok=mapper_ckpt_load(mapper, c);
+	if (ok) ok=csr_ckpt_load(csr, c);
+	if (ok) ok=scsi_ckpt_load(scsi, c);
+	if (ok) ok=rtc_ckpt_load(rtc, c);
+	for (int i=0; i<4 && ok; i++) ok=uart_ckpt_load(uart[i], c);
+	return ok;
+}
+
+//Restore the machine from the newest checkpoint with the given prefix.
+static int restore_checkpoint(const char *prefix) {
+	char pattern[strlen(prefix)+8];
+	sprintf(pattern, "%s.*", prefix);
+	glob_t g;
+	int last=-1;
+	if (glob(pattern, 0, NULL, &g)==0) {
+		for (int i=0; i<g.gl_pathc; i++) {
+			const char *num=g.gl_pathv[i]+strlen(prefix)+1;
+			char *end;
+			long n=strtol(num, &end, 10);
+			if (*end==0 && end!=num && n>last) last=n;
+		}
+		globfree(&g);
+	}
+	if (last<0) {
+		printf("No checkpoints found for %s, starting from scratch.\n", prefix);
+		return 1;
+	}
+	//Find the full checkpoint the newest one is based on.
+	char name[strlen(prefix)+16];
+	int first;
+	for (first=last; first>=0; first--) {
+		ckpt_name(name, prefix, first);
+		ckpt_t *c=ckpt_open(name);
+		if (!c) continue;
+		int full=ckpt_is_full(c);
+		ckpt_free(c);
+		if (full) break;
+	}
+	if (first<0) {
+		printf("%s: no full checkpoint found\n", prefix);
+		return 0;
+	}
+	ram_t *ram=find_range_by_name("RAM")->obj;
+	ram_t *sram=find_range_by_name("SRAM")->obj;
+	for (int n=first; n<=last; n++) {
+		ckpt_name(name, prefix, n);
+		ckpt_t *c=ckpt_open(name);
+		if (!c) {
+			printf("%s: missing, can't restore\n", name);
+			return 0;
+		}
+		ckpt_get_ram(c, "RAM", ram);
+		ckpt_get_ram(c, "SRAM", sram);
+		if (ramdisk_ram) ckpt_get_ram(c, "ramdisk", ramdisk_ram);
+		//Device state is complete in every checkpoint; only the newest counts.
+		if (n==last && !load_devices(c)) {
+			ckpt_free(c);
+			return 0;
+		}
+		ckpt_free(c);
+	}
+	ram_clear_dirty(ram);
+	ram_clear_dirty(sram);
+	if (ramdisk_ram) ram_clear_dirty(ramdisk_ram);
+	ckpt_seq=last+1;
+	ckpt_need_full=0;
+	printf("Restored checkpoint %s.%d (%d deltas), at %.3f emulated s\n", prefix, last, last-first,
+			emu_time_us/1e6);
+	return 1;
+}
+
+static FILE *stats_file=NULL;
+
+//Rate state of the -stats file; ad-hoc reports don't touch it.
+static stats_window_t stats_file_window;
+
+//Print the runtime statistics, including the per-channel UART counters.
+static void report_stats(FILE *f, stats_window_t *w) {
+	stats_report(f, w, emu_time_us);
+	uart_report_stats(f);
+	fflush(f);
+}
+
+#define CONTROL_POLL_US 1000
+static int emu_paused=0;
+static int quit_req=0;
+static const char *ckpt_prefix=NULL;
+
+int emu_flush() {
+	fflush(stdout);
+	return scsi_dev_hd_flush(hd1);
+}
+
+//Handle a command from the control socket.
+static int control_cmd(int argc, char **argv, FILE *out) {
+	if (strcmp(argv[0], "help")==0) {
+		fprintf(out, "stats - print runtime statistics\n");
+		fprintf(out, "pause, resume - stop and continue emulation\n");
+		fprintf(out, "snapshot [prefix] - write a checkpoint, or a full one to prefix.0\n");
+		fprintf(out, "loglevel [src=]level - change log levels, like -log\n");
+		fprintf(out, "trace on|off - print CPU state for every instruction\n");
+		fprintf(out, "flush - write disk data to stable storage\n");
+		fprintf(out, "quit - exit the emulator\n");
+	} else if (strcmp(argv[0], "stats")==0) {
+		report_stats(out, NULL);
+	} else if (strcmp(argv[0], "pause")==0) {
+		emu_paused=1;
+	} else if (strcmp(argv[0], "resume")==0) {
+		emu_paused=0;
+	} else if (strcmp(argv[0], "snapshot")==0) {
+		if (argc>1) {
+			char name[strlen(argv[1])+16];
+			ckpt_name(name, argv[1], 0);
+			if (!write_ckpt_file(name, 1)) return 0;
+			fprintf(out, "%s\n", name);
+		} else if (ckpt_prefix) {
+			write_checkpoint(ckpt_prefix);
+			if (ckpt_need_full) return 0;
+			fprintf(out, "%s.%d\n", ckpt_prefix, ckpt_seq-1);
+		} else {
+			fprintf(out, "no -ckpt prefix given\n");
+			return 0;
+		}
+	} else if (strcmp(argv[0], "loglevel")==0 && argc>1) {
+		if (parse_loglvl_str(argv[1])) return 0;
+	} else if (strcmp(argv[0], "trace")==0 && argc>1) {
+		trace_enabled=(strcmp(argv[1], "on")==0);
+	} else if (strcmp(argv[0], "flush")==0) {
+		return emu_flush();
+	} else if (strcmp(argv[0], "quit")==0) {
+		quit_req=1;
+	} else {
+		fprintf(out, "unknown command, try help\n");
+		return 0;
+	}
+	return 1;
+}
+
+static void stats_final() {
+	report_stats(stats_file, &stats_file_window);
+}
+
+//Set by SIGUSR1 to write out the profile.
+static volatile sig_atomic_t prof_dump_req=0;
+
+static void prof_sig_hdl(int sig) {
+	prof_dump_req=1;
+}
+
+//Set by SIGUSR2 to write out the syscall statistics.
+static volatile sig_atomic_t sysstat_dump_req=0;
+
+static void sysstat_sig_hdl(int sig) {
+	sysstat_dump_req=1;
+}
+
+
+//State of the main loop, kept between calls to emu_run_slice().
+static emu_cfg_t *run_cfg;
+static int replay_on;
+static uint64_t next_ckpt_us;
+static uint64_t next_stats_us;
+static int control_us;
+static int prof_cycles[2];
+static int slice_cycles;
+//In unlimited mode, the CPUs run as fast as the host allows and the
+//devices are ticked with the host time that passed instead.
+static int tick_us=CPU_RUN_US;
+static uint64_t host_last_ns;
+static uint64_t host_rem_ns;
+
+void emu_init(emu_cfg_t *cfg) {
+	uart_console_init();
+	if (cfg->commit_img) {
+		//Only flatten the disk image, don't run anything.
+		scsi_dev_t *hd=scsi_dev_hd_new(cfg->hd0img, cfg->cow_dir, cfg->cow_lower);
+		if (!hd) exit(1);
+		exit(scsi_dev_hd_commit(hd, cfg->commit_img)?0:1);
+	}
+	if (cfg->script && !script_load(cfg->script)) exit(1);
 	setup_ram("RAM", cfg->mem_size_bytes);
 	setup_ram("SRAM", -1);
-	setup_rtcram("RTC_RAM", cfg->rtcram);
+	rtcram=setup_rtcram("RTC_RAM", cfg->rtcram);
 	setup_rom("U15", cfg->u15_rom); //used to be U17
 	setup_rom("U17", cfg->u17_rom); //used to be U19
-	uart_t *uart[4];
+	uart_set_paced(cfg->serial_paced);
 	uart[0]=setup_uart("UART_A", 1);
 	uart[1]=setup_uart("UART_B", 0);
 	uart[2]=setup_uart("UART_C", 0);
 	uart[3]=setup_uart("UART_D", 0);
-	scsi_t *scsi=setup_scsi("SCSIBUF");
-	scsi_dev_t *hd1=scsi_dev_hd_new(cfg->hd0img, cfg->cow_dir);
+	for (int i=0; i<8; i++) {
+		if (!cfg->serport[i]) continue;
+		serport_t *p=serport_new(cfg->serport[i]);
+		if (!p) exit(1);
+		//Serial port n is channel n%2 (A or B) of UART n/2.
+		uart_set_port(uart[i/2], i%2, p);
+		printf("Serial port %d on %s\n", i, serport_name(p));
+	}
+	scsi=setup_scsi("SCSIBUF");
+	hd1=scsi_dev_hd_new(cfg->hd0img, cfg->cow_dir, cfg->cow_lower);
 	scsi_add_dev(scsi, hd1, 0);
+	if (cfg->ramdisk_img || cfg->ramdisk_size_bytes) {
+		scsi_dev_t *rd=scsi_dev_ramdisk_new(cfg->ramdisk_img, cfg->ramdisk_size_bytes, cfg->ramdisk_persist);
+		if (!rd) exit(1);
+		scsi_add_dev(scsi, rd, cfg->ramdisk_id);
+		ramdisk_ram=scsi_dev_ramdisk_ram(rd);
+	}
 	csr=setup_csr("CSR", "MMIO_WR", "SCSIBUF");
+	if (cfg->clones) {
+		if (!cfg->cow_dir || !cfg->cow_dir[0]) {
+			printf("Cloning needs a COW directory (-c).\n");
+			exit(1);
+		}
+		clone_init(cfg->clones, cfg->clone_marker);
+	}
+	replay_on=(cfg->record_file || cfg->replay_file);
+	if (replay_on) setup_replay(cfg, rtcram, hd1);
+	if (cfg->trace_prefix) setup_trace(cfg);
+	if (cfg->prof_prefix) {
+		if (!prof_init(cfg->prof_prefix, cfg->prof_symfile, cfg->prof_stacks)) exit(1);
+		atexit(prof_dump);
+		signal(SIGUSR1, prof_sig_hdl);
+	}
+	trace_syscalls=cfg->tracesyscalls;
+	if (cfg->sysstat_file) {
+		sysstat_init(cfg->sysstat_file);
+		sysstat_on=1;
+		atexit(sysstat_dump);
+		signal(SIGUSR2, sysstat_sig_hdl);
+	}
+	if (cfg->memstat_file || cfg->memheat_file) {
+		memstat_init(cfg->memstat_file, cfg->memheat_file);
+		atexit(memstat_dump);
+	}
+	if (cfg->stats_file) {
+		stats_file=fopen(cfg->stats_file, "w");
+		if (!stats_file) {
+			perror(cfg->stats_file);
+			exit(1);
+		}
+		stats_timing=1;
+		atexit(stats_final);
+	}
+	stats_start();
 	mapper=setup_mapper("MAPPER", "MAPRAM", "RAM", !cfg->noyolo);
 	setup_mbus("MBUSMEM", "MBUSIO");
-	rtc_t *rtc=setup_rtc("RTC");
+	rtc=setup_rtc("RTC");
 
 	//Note: if you get these messages, are you sure you downloaded the ROMs via the *RAW* link in Github and
 	//not just threw the URL from your browser into wget or curl?
@@ -957,7 +1611,6 @@ void emu_start(emu_cfg_t *cfg) {
 		exit(1);
 	}
 
-	void *cpuctx[2];
 	cpuctx[0]=calloc(m68k_context_size(), 1); //dma cpu
 	cpuctx[1]=calloc(m68k_context_size(), 1); //job cpu
 
@@ -966,92 +1619,158 @@ void emu_start(emu_cfg_t *cfg) {
 		m68k_set_cpu_type(M68K_CPU_TYPE_68010);
 		m68k_init();
 		//note: cbs should happen after init
-		m68k_set_int_ack_callback(m68k_int_cb);
-		m68k_set_instr_hook_callback(m68k_trace_cb);
-		m68k_set_fc_callback(m68k_fc_cb);
-		if (cfg->tracesyscalls) m68k_set_trap_instr_callback(m68k_trap_cb);
+		set_cpu_callbacks();
 		m68k_pulse_reset();
 		m68k_set_irq(0);
 		m68k_get_context(cpuctx[i]);
 	}
 	signal(SIGQUIT, sig_hdl); // ctrl+\ to dump status
+	if (cfg->ckpt_prefix && cfg->ckpt_restore && !restore_checkpoint(cfg->ckpt_prefix)) exit(1);
+	next_ckpt_us=emu_time_us+cfg->ckpt_interval_s*1000000ULL;
+	next_stats_us=emu_time_us+cfg->stats_interval_s*1000000ULL;
+	ckpt_prefix=cfg->ckpt_prefix;
+	if (cfg->control_path && !control_init(cfg->control_path, control_cmd)) exit(1);
+
+	if (cfg->cpu_hz) cpu_hz=cfg->cpu_hz;
+	slice_cycles=(int64_t)cpu_hz*CPU_RUN_US/1000000;
+	host_last_ns=stats_now_ns();
+
+	if (cfg->realtime && !cfg->unlimited) pace_init(cfg->realtime_speed, cfg->realtime_max_lag_ms*1000);
+	run_cfg=cfg;
+}
 
-	int cpu_in_reset[2]={0};
-	int cycles_remaining[2]={0};
-
-	struct timeval last_delay_at;
-	int emulated_us_since_last_delay=0;
-	gettimeofday(&last_delay_at, NULL);
-
-	while(1) {
-		for (int i=0; i<2; i++) {
-			m68k_set_context(cpuctx[i]);
-			cur_cpu=i;
-			if (need_raise_highest_int[i]) {
-				raise_highest_int();
-				need_raise_highest_int[i]=0;
+int emu_run_slice() {
+	emu_cfg_t *cfg=run_cfg;
+	uint64_t t_ns=0;
+	if (clone_requested()) {
+		//Both CPUs are between timeslices here, so this is a clean point to fork.
+		//Files the clones would all write at exit are written once, now.
+		rtcram_flush(rtcram);
+		scsi_dev_ramdisk_persist_now();
+		become_clone(cfg, clone_fork(), hd1, uart[0]);
+	}
+	if (cfg->unlimited) {
+		uint64_t now=stats_now_ns();
+		host_rem_ns+=now-host_last_ns;
+		host_last_ns=now;
+		tick_us=host_rem_ns/1000;
+		//Don't let devices jump ahead too far if we were stopped.
+		if (tick_us>10000) tick_us=10000;
+		host_rem_ns%=1000;
+	}
+	for (int i=0; i<2; i++) {
+		m68k_set_context(cpuctx[i]);
+		cur_cpu=i;
+		if (need_raise_highest_int[i]) {
+			raise_highest_int();
+			need_raise_highest_int[i]=0;
+		}
+		if (csr_cpu_is_reset(csr, i)) {
+			//Mark CPU as in reset and don't execute code on it.
+			cpu_in_reset[i]=1;
+		} else {
+			if (cpu_in_reset[i]) {
+				//CPU went from reset to enabled. Pulse reset and start executing.
+				m68k_pulse_reset();
+				cpu_in_reset[i]=0; //it's running now
 			}
-			if (csr_cpu_is_reset(csr, i)) {
-				//Mark CPU as in reset and don't execute code on it.
-				cpu_in_reset[i]=1;
-			} else {
-				if (cpu_in_reset[i]) {
-					//CPU went from reset to enabled. Pulse reset and start executing.
-					m68k_pulse_reset();
-					cpu_in_reset[i]=0; //it's running now
+			//Go execute some m68k code.
+			cpu_executing=1;
+			if (stats_timing) t_ns=stats_now_ns();
+			int used=m68k_execute(slice_cycles + cycles_remaining[i]);
+			if (stats_timing) emu_stats.host_ns_cpu[i]+=stats_now_ns()-t_ns;
+			cpu_executing=0;
+			cycles_run+=used;
+			emu_stats.cycles[i]+=used;
+			emu_stats.slices[i]++;
+			cycles_remaining[i]=m68k_cycles_remaining();
+			if (cfg->prof_prefix) {
+				//Samples can only be taken at the end of a slice, so take at most
+				//one per slice and keep the part of an interval that's left over.
+				//An interval shorter than a slice effectively becomes one slice.
+				prof_cycles[i]+=used;
+				if (prof_cycles[i]>=cfg->prof_interval) {
+					prof_cycles[i]%=cfg->prof_interval;
+					int super=(m68k_get_reg(NULL, M68K_REG_SR)&0x2000)?1:0;
+					prof_sample(i, mapper_get_mapid(mapper), super, m68k_get_reg(NULL, M68K_REG_PC),
+							callstack[i], callstack_ptr[i]);
 				}
-				//Go execute some m68k code.
-				m68k_execute(CPU_SPEED_HZ/(1000000/CPU_RUN_US) + cycles_remaining[i]);
-				cycles_remaining[i]=m68k_cycles_remaining();
 			}
+		}
 
-			if (cur_cpu==0) {
-				//handle DMA CPU ints
-				for (int i=0; i<4; i++) uart_tick(uart[i], CPU_RUN_US);
-				rtc_tick(rtc, CPU_RUN_US);
-				scsi_tick(scsi, CPU_RUN_US);
+		if (cur_cpu==0) {
+			//handle DMA CPU ints
+			if (stats_timing) {
+				//Same as below, but measure how long every device takes.
+				uint64_t t[STATS_TICK_MAX+1];
+				t[0]=stats_now_ns();
+				for (int i=0; i<4; i++) uart_tick(uart[i], tick_us);
+				t[1]=stats_now_ns();
+				rtc_tick(rtc, tick_us);
+				t[2]=stats_now_ns();
+				rtcram_tick(rtcram, tick_us);
+				t[3]=stats_now_ns();
+				scsi_tick(scsi, tick_us);
+				t[4]=stats_now_ns();
+				for (int i=0; i<STATS_TICK_MAX; i++) emu_stats.host_ns_tick[i]+=t[i+1]-t[i];
+			} else {
+				for (int i=0; i<4; i++) uart_tick(uart[i], tick_us);
+				rtc_tick(rtc, tick_us);
+				rtcram_tick(rtcram, tick_us);
+				scsi_tick(scsi, tick_us);
 			}
+			script_tick();
+		}
 
+		m68k_get_context(cpuctx[i]);
+		if (dump_status && !replay_on) break;
+	}
+	emu_time_us+=tick_us;
+	if (replay_on) {
+		if (emu_time_us%1000000==0) replay_check("cpu", cpu_state_hash(cpuctx));
+		replay_tick();
+	}
+	if (prof_dump_req) {
+		prof_dump_req=0;
+		prof_dump();
+	}
+	if (sysstat_dump_req) {
+		sysstat_dump_req=0;
+		sysstat_dump();
+	}
+	control_us+=tick_us;
+	if (cfg->control_path && control_us>=CONTROL_POLL_US) {
+		control_us=0;
+		control_poll(0);
+		while (emu_paused && !quit_req) control_poll(100);
+		if (quit_req) return 0;
+	}
+	if (cfg->ckpt_prefix && emu_time_us>=next_ckpt_us) {
+		write_checkpoint(cfg->ckpt_prefix);
+		next_ckpt_us+=cfg->ckpt_interval_s*1000000ULL;
+	}
+	if (stats_file && emu_time_us>=next_stats_us) {
+		report_stats(stats_file, &stats_file_window);
+		next_stats_us+=cfg->stats_interval_s*1000000ULL;
+	}
+	if (dump_status) {
+		//ctrl+\ pressed
+		dump_status=0;
+		printf("\n");
+		printf("Current machine status:\n");
+		for (int i=0; i<2; i++) {
+			m68k_set_context(cpuctx[i]);
+			cur_cpu=i;
+			printf("CPU %d\n", i);
+			dump_cpu_state_all();
+			dump_callstack();
 			m68k_get_context(cpuctx[i]);
-			if (dump_status) break;
-		}
-		if (dump_status) {
-			//ctrl+\ pressed
-			dump_status=0;
-			printf("\n");
-			printf("Current machine status:\n");
-			for (int i=0; i<2; i++) {
-				m68k_set_context(cpuctx[i]);
-				cur_cpu=i;
-				printf("CPU %d\n", i);
-				dump_cpu_state_all();
-				dump_callstack();
-				m68k_get_context(cpuctx[i]);
-			}
-		}
-		if (cfg->realtime) {
-			emulated_us_since_last_delay+=CPU_RUN_US;
-
-			//Find out how long we ran in real time
-			struct timeval time_since_last_delay;
-			struct timeval now;
-			gettimeofday(&now, NULL);
-			timersub(&now, &last_delay_at, &time_since_last_delay);
-			//If this was shorter than the time the virtual CPU spent emulating, we need
-			//to wait to make up the difference.
-			if (time_since_last_delay.tv_sec!=0 || time_since_last_delay.tv_usec>=SLEEP_EVERY_US) {
-				int wait_us=emulated_us_since_last_delay-time_since_last_delay.tv_usec;
-				if (wait_us<1000) wait_us=1000; //sleep at least a ms
-#ifdef __EMSCRIPTEN__
-				emscripten_sleep(wait_us/1000);
-#else
-				usleep(wait_us);
-#endif
-				gettimeofday(&last_delay_at, NULL);
-				emulated_us_since_last_delay=0;
-			}
 		}
+		report_stats(stdout, NULL);
+		memstat_dump();
 	}
+	if (cfg->realtime && !cfg->unlimited) pace_advance(CPU_RUN_US);
+	return 1;
 }
 
 
@@ -1,3 +1,4 @@
+#pragma once
 #include <stdint.h>
 #include "mapper.h" //for access flags
 
@@ -29,6 +30,8 @@ int emu_try_mbus_held();
 //Triggers a bus error on the current CPU. Note: may not return
 //as the bus error code involves a longjmp().
 void emu_bus_error();
+//Called when the mapping of CPU addresses to memory or its permissions change.
+void emu_mapping_changed();
 //Set the current map ID for the mapper.
 void emu_set_cur_mapid(uint8_t mapid);
 //Set the 'force a23 high' bit for the CPUs. val=bitmask: bit0=dma, bit1=job
@@ -47,14 +50,64 @@ typedef struct {
 	const char *hd0img;		//Filename for hard disk image
 	const char *rtcram;		//Filename for RTC NVRAM storage file
 	int realtime;			//If true, we sleep() to make performance equal to that of a real machine
+	int cpu_hz;				//CPU clock in Hz, or 0 for the default of 10MHz
+	int unlimited;			//If true, run the CPUs as fast as possible and drive device timing from host time
+	const char *record_file;	//If set, record all input from the host to this file
+	const char *replay_file;	//If set, replay a recording instead of taking input from the host
+	int replay_fast;		//When replaying, run as fast as possible even if realtime is set
+	const char *ckpt_prefix;	//If set, write checkpoints to files starting with this
+	int ckpt_interval_s;	//Emulated seconds between checkpoints
+	int ckpt_restore;		//If true, start from the newest checkpoint with ckpt_prefix
+	const char *control_path;	//If set, serve a control socket here
+	int clones;				//If nonzero, fork into this many clones on SIGHUP or clone_marker
+	const char *clone_marker;	//Console output that starts cloning, or NULL
+	double realtime_speed;	//In realtime mode, run at this multiple of the speed of a real machine
+	int realtime_max_lag_ms;	//In realtime mode, how far we may fall behind before giving up catching up; -1 = always catch up
 	const char *cow_dir;	//Directory path for COW files, or "" or NULL for no COW
+	const char **cow_lower;	//NULL-terminated list of read-only COW layers below cow_dir, or NULL
+	const char *commit_img;	//If set, write the disk with all COW layers flattened to this file and exit
 	int mem_size_bytes;		//Main RAM memory size
 	int noyolo;				//True to disable YOLO hack
 	int tracesyscalls;		//True if syscall traps need to be printed out
+	const char *sysstat_file;	//If set, collect syscall statistics and write them to this file
+	const char *stats_file;	//If set, write emulator statistics to this file periodically and on exit
+	int stats_interval_s;	//Emulated seconds between reports to stats_file
+	const char *memstat_file;	//If set, count accesses per memory range and write them to this CSV file
+	const char *memheat_file;	//If set, count accesses per 4K page of RAM and write them to this CSV file
+	const char *ramdisk_img;	//Template image for the RAM disk, or NULL
+	int ramdisk_size_bytes;	//Minimum RAM disk size. RAM disk is only attached if this or ramdisk_img is set.
+	int ramdisk_id;			//SCSI ID for the RAM disk
+	int ramdisk_persist;	//True to write the RAM disk back to its template image on exit
+	int serial_paced;		//True to run the serial ports at the baud rate set by the guest
+	const char *serport[8];	//Host port spec ("pty" or "unix:/path") per serial channel, or NULL
+	const char *script;		//Console script to run, or NULL
+	const char *trace_prefix;	//If set, write a binary instruction trace to files starting with this
+	int trace_cpus;			//Bitmask of CPUs to trace: (1<<0) for dma, (1<<1) for job cpu
+	int trace_compress;		//True to gzip the trace
+	const char *prof_prefix;	//If set, run the sampling profiler and write results to files starting with this
+	const char *prof_symfile;	//COFF executable or nm output to resolve kernel addresses, or NULL
+	int prof_interval;		//Profiler sample interval in CPU cycles; rounded up to a CPU slice (10us)
+	int prof_stacks;		//True to record the call stack with each sample
 } emu_cfg_t;
 
-//Start emu with given parameters
-void emu_start(emu_cfg_t *cfg);
+//Returns the amount of emulated time since the emulator started.
+uint64_t emu_get_time_us();
+
+//Returns the amount of CPU cycles executed since start, summed over both CPUs.
+//Unlike emu_get_time_us(), this doesn't follow the host clock in -unlimited
+//mode, and it includes the cycles in the current time slice.
+uint64_t emu_get_cycles();
+
+//Set up the machine with the given parameters. See machine.h for the
+//interface to run it.
+void emu_init(emu_cfg_t *cfg);
+
+//Run both CPUs for one timeslice and tick the devices. Returns 0 if a quit
+//was requested over the control socket.
+int emu_run_slice();
+
+//Write disk data to stable storage. Returns 0 on error.
+int emu_flush();
 
 //Tells the emulator an interrupt is going to happen in x uS. Emulator will adjust
 //CPU execution schedule to make sure an interrupt check happens at that time.
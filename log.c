@@ -11,6 +11,7 @@ Copyright (c) 2024 Ewen McNeill <ewen@naos.co.nz>
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <string.h>
 
 // Default log levels for log sources
 #define LOG_UART_DEFAULT_LEVEL   LOG_WARNING
@@ -53,26 +54,90 @@ const char *log_level_colour[] = {
 	ANSI_COLOUR_GREY     // LOG_DEBUG   (4)
 };
 
-void log_set_level(enum log_source source, enum log_level msg_level) {
-	log_channel_verbose_level[source]=msg_level;
+//Strings defining the various log modules
+const char *log_str[]={
+	[LOG_SRC_UART]="uart",
+	[LOG_SRC_CSR]="csr",
+	[LOG_SRC_MBUS]="mbus",
+	[LOG_SRC_MAPPER]="mapper",
+	[LOG_SRC_SCSI]="scsi",
+	[LOG_SRC_RAMROM]="ramrom",
+	[LOG_SRC_RTC]="rtc",
+	[LOG_SRC_EMU]="emu",
+	[LOG_SRC_STRACE]="strace",
+};
+
+//Strings defining the various log levels.
+const char *level_str[]={
+	"err", "warn", "notice", "info", "debug"
+};
+
+//Returns the log level id for a given string in level_str
+int loglevel_for(const char *str) {
+	for (int i=0; i<LOG_LVL_MAX; i++) {
+		if (strcmp(str, level_str[i])==0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//parses either e.g. 'notice' to set all srcs to that,
+//or e.g. 'rtc=notice' to only set that source to the level.
+//return 1 on error, 0 on ok
+int parse_loglvl_str(char *str) {
+	static_assert(sizeof(log_str)/sizeof(log_str[0])==LOG_SRC_MAX,
+					"log_str array out of sync");
+	static_assert(sizeof(level_str)/sizeof(level_str[0])==LOG_LVL_MAX,
+					"level_str array out of sync");
+	char *s=strchr(str, '=');
+	if (!s) s=strchr(str, ':'); //cause I keep mistyping emu:debug instead of emu=debug
+	if (!s) {
+		int lvl=loglevel_for(str);
+		if (lvl==-1) return 1;
+		if (lvl>LOG_COMPILE_LEVEL) printf("Note: log levels above %s are compiled out\n", level_str[LOG_COMPILE_LEVEL]);
+		for (int i=0; i<LOG_SRC_MAX; i++) {
+			log_set_level(i, lvl);
+		}
+		return 0;
+	} else {
+		int lvl=loglevel_for(s+1);
+		if (lvl==-1) return 1;
+		if (lvl>LOG_COMPILE_LEVEL) printf("Note: log levels above %s are compiled out\n", level_str[LOG_COMPILE_LEVEL]);
+		for (int i=0; i<LOG_SRC_MAX; i++) {
+			if (strlen(log_str[i])==(s-str) && strncmp(str, log_str[i], s-str)==0) {
+				log_set_level(i, lvl);
+				return 0;
+			}
+		}
+	}
+	return 1;
 }
 
-int log_level_active(enum log_source source, enum log_level msg_level) {
-	return log_channel_verbose_level[source] >= msg_level;
+void log_set_level(enum log_source source, enum log_level msg_level) {
+	log_channel_verbose_level[source]=msg_level;
 }
 
-int log_printf(enum log_source source, enum log_level msg_level, const char *format, ...) {
+int log_do_printf(enum log_source source, enum log_level msg_level, const char *format, ...) {
 	static_assert(sizeof(log_channel_verbose_level)/sizeof(log_channel_verbose_level[0])==LOG_SRC_MAX, 
 				"log_channel_verbose_level missing an entry");
 	va_list ap;
 	int printed = 0;
 
 	if (log_channel_verbose_level[source] >= msg_level) {
+		if (log_async_active) {
+			va_start(ap, format);
+			log_async_record(source, msg_level, format, ap);
+			va_end(ap);
+			return 0;
+		}
 		printf("%s", log_level_colour[msg_level]);
 		va_start(ap, format);
 		printed = vprintf(format, ap);
 		va_end(ap);
 		printf("%s", ANSI_COLOUR_NORMAL);
+		//stdout is fully buffered for console performance; make sure logs show up immediately.
+		fflush(stdout);
 	}
 	return printed;
 }
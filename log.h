@@ -1,6 +1,9 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdint.h>
+#include <stdarg.h>
+
 // Log sources (should be numbered sequentially from 0)
 // If you change the order log_channel_verbose_level in log.c needs updating too
 enum log_source {
@@ -27,8 +30,47 @@ enum log_level {
 	LOG_LVL_MAX //end sentinel, leave at end of enum
 };
 
+// Messages more verbose than this are compiled out entirely, including the
+// evaluation of their arguments. Set with e.g. 'make LOG_COMPILE_LEVEL=LOG_NOTICE'.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+extern int log_channel_verbose_level[];
+
 void log_set_level(enum log_source source, enum log_level msg_level);
-int log_printf(enum log_source source, enum log_level msg_level, const char *format, ...);
-int log_level_active(enum log_source source, enum log_level msg_level);
+// Names of the log sources and levels, as used on the command line
+extern const char *log_str[];
+extern const char *level_str[];
+// ANSI colour escape sequence for each level
+extern const char *log_level_colour[];
+// Parse e.g. 'notice' to set all sources to that level, or 'rtc=notice' to set
+// only that source. Returns 1 on error, 0 on ok.
+int parse_loglvl_str(char *str);
+int log_do_printf(enum log_source source, enum log_level msg_level, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+// Asynchronous logging (see log_async.c). If binfile is NULL, messages are
+// formatted to stdout by a background thread, otherwise raw records are
+// written to binfile for later decoding with log_decode(). Returns 0 on error.
+int log_start_async(const char *binfile);
+// Print a binary log file. Needs to be called from the binary that wrote it.
+int log_decode(const char *binfile);
+// Set the function that returns the timestamp for async log records.
+void log_set_timestamp_cb(uint64_t (*cb)());
+// Internal to the logging code
+extern int log_async_active;
+void log_async_record(enum log_source source, enum log_level msg_level, const char *format, va_list ap);
+
+// Inline so the (usually false) check is done at the call site and disabled
+// messages don't cost a function call.
+static inline int log_level_active(enum log_source source, enum log_level msg_level) {
+	if (msg_level>LOG_COMPILE_LEVEL) return 0;
+	return __builtin_expect(log_channel_verbose_level[source] >= msg_level, 0);
+}
+
+// Arguments are only evaluated if the message will actually be printed.
+#define log_printf(source, msg_level, format_and_args...) \
+	(log_level_active(source, msg_level) ? log_do_printf(source, msg_level, format_and_args) : 0)
 
 #endif
@@ -0,0 +1,450 @@
+/*
+ Asynchronous binary logging
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include "log.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <signal.h>
+#ifndef __EMSCRIPTEN__
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+/*
+Formatting a log message with printf is slow enough that enabling debug logging
+changes the timing behaviour of the emulator. In async mode, log_do_printf
+doesn't format anything: it stores a record with the timestamp, source, level,
+the *pointer* to the format string and the raw argument values in a lock-free
+single-producer/single-consumer ring. A background thread picks up the records
+and either formats them to stdout, or writes them as-is to a binary file.
+
+A binary log can later be decoded with 'emu -logdecode file'. As the records
+contain format string pointers, this must be done with the very same emu binary
+that wrote the log; the file header contains the address of a reference string
+so address space randomization doesn't matter.
+
+Arguments are stored as 64-bit values; strings (%s) are copied into the record.
+Conversions we can't capture this way (e.g. '*' widths) make the message be
+formatted into the record directly, which is slower but still asynchronous.
+If the ring is full, the message is dropped and counted, as blocking would
+defeat the purpose.
+*/
+
+#define RING_SZ (4*1024*1024)	//needs to be a power of two
+#define MAX_PAYLOAD 512
+#define BIN_MAGIC "PLXLOG1"
+
+typedef struct {
+	uint64_t ts;		//emulated cycles
+	uint64_t fmt;		//format string pointer, or 0 if payload is a preformatted string
+	uint16_t len;		//payload length
+	uint8_t src;
+	uint8_t lvl;
+	uint32_t pad;
+} rec_hdr_t;
+
+typedef struct {
+	char magic[8];
+	uint64_t ref;		//address of ref_str in the writing binary
+} bin_hdr_t;
+
+static const char ref_str[]="log reference";
+
+#define ANSI_COLOUR_NORMAL "\033[0m"
+
+enum {
+	ARG_END=0,
+	ARG_NONE,	//literal text or %%
+	ARG_SINT,
+	ARG_UINT,
+	ARG_CHAR,
+	ARG_DOUBLE,
+	ARG_STR,
+	ARG_PTR,
+	ARG_BAD
+};
+
+//Parses the next piece of a format string: either literal text or one conversion.
+//Returns the argument type; *end is set to the end of the piece. For conversions,
+//spec gets the conversion with the length modifier replaced by 'll', so it can be
+//printed from a 64-bit value. *lenmod gets the original length modifier.
+static int next_piece(const char *p, const char **end, char *spec, char *lenmod) {
+	if (*p==0) return ARG_END;
+	if (*p!='%') {
+		while (*p && *p!='%') p++;
+		*end=p;
+		return ARG_NONE;
+	}
+	const char *start=p++;
+	if (*p=='%') {
+		*end=p+1;
+		return ARG_NONE;
+	}
+	while (*p && strchr("-+ #0'", *p)) p++;
+	while (*p>='0' && *p<='9') p++;
+	if (*p=='.') {
+		p++;
+		while (*p>='0' && *p<='9') p++;
+	}
+	int flagslen=p-start;
+	if (flagslen>16) return ARG_BAD;
+	memcpy(spec, start, flagslen);
+	int l=0;
+	while (*p && strchr("hlzjt", *p) && l<2) lenmod[l++]=*p++;
+	lenmod[l]=0;
+	char conv=*p;
+	if (conv==0) return ARG_BAD;
+	*end=p+1;
+	int type;
+	if (strchr("di", conv)) {
+		type=ARG_SINT;
+	} else if (strchr("uxXo", conv)) {
+		type=ARG_UINT;
+	} else if (conv=='c' && l==0) {
+		type=ARG_CHAR;
+	} else if (strchr("feEgGaA", conv) && l==0) {
+		type=ARG_DOUBLE;
+	} else if (conv=='s' && l==0) {
+		type=ARG_STR;
+	} else if (conv=='p') {
+		type=ARG_PTR;
+	} else {
+		return ARG_BAD; //'*' widths, %n, long doubles, wide chars...
+	}
+	int n=flagslen;
+	if (type==ARG_SINT || type==ARG_UINT) {
+		spec[n++]='l';
+		spec[n++]='l';
+	}
+	spec[n++]=conv;
+	spec[n]=0;
+	return type;
+}
+
+//Reads an integer argument with the given length modifier
+static uint64_t get_int_arg(va_list *ap, const char *lenmod, int is_signed) {
+	if (strcmp(lenmod, "ll")==0) return va_arg(*ap, long long);
+	if (strcmp(lenmod, "l")==0) return is_signed?(int64_t)va_arg(*ap, long):(uint64_t)va_arg(*ap, unsigned long);
+	if (strcmp(lenmod, "z")==0) return va_arg(*ap, size_t);
+	if (strcmp(lenmod, "j")==0) return va_arg(*ap, intmax_t);
+	if (strcmp(lenmod, "t")==0) return va_arg(*ap, ptrdiff_t);
+	int v=va_arg(*ap, int);
+	if (strcmp(lenmod, "hh")==0) return is_signed?(int64_t)(signed char)v:(uint64_t)(unsigned char)v;
+	if (strcmp(lenmod, "h")==0) return is_signed?(int64_t)(short)v:(uint64_t)(unsigned short)v;
+	return is_signed?(int64_t)v:(uint64_t)(unsigned int)v;
+}
+
+//Captures the arguments of a format string into buf. Returns the length, or -1
+//if the format can't be captured.
+static int capture_args(const char *fmt, va_list ap, uint8_t *buf) {
+	va_list aq;
+	va_copy(aq, ap);
+	int len=0;
+	const char *p=fmt;
+	int type;
+	char spec[24], lenmod[3];
+	while ((type=next_piece(p, &p, spec, lenmod))!=ARG_END) {
+		if (type==ARG_NONE) continue;
+		if (type==ARG_BAD || len+8>MAX_PAYLOAD) {
+			len=-1;
+			break;
+		}
+		if (type==ARG_STR) {
+			const char *s=va_arg(aq, const char*);
+			if (!s) s="(null)";
+			int sl=strlen(s);
+			if (sl>MAX_PAYLOAD-len-1) sl=MAX_PAYLOAD-len-1;
+			memcpy(&buf[len], s, sl);
+			buf[len+sl]=0;
+			len+=sl+1;
+			continue;
+		}
+		uint64_t v;
+		if (type==ARG_DOUBLE) {
+			double d=va_arg(aq, double);
+			memcpy(&v, &d, 8);
+		} else if (type==ARG_PTR) {
+			v=(uintptr_t)va_arg(aq, void*);
+		} else if (type==ARG_CHAR) {
+			v=va_arg(aq, int);
+		} else {
+			v=get_int_arg(&aq, lenmod, type==ARG_SINT);
+		}
+		memcpy(&buf[len], &v, 8);
+		len+=8;
+	}
+	va_end(aq);
+	return len;
+}
+
+//Prints a captured record.
+static void print_record(FILE *f, const rec_hdr_t *h, const char *fmt, const uint8_t *payload, int with_src) {
+	fprintf(f, "%s@%llu ", log_level_colour[h->lvl], (unsigned long long)h->ts);
+	if (with_src) fprintf(f, "%s/%s: ", log_str[h->src], level_str[h->lvl]);
+	if (!fmt) {
+		fwrite(payload, h->len, 1, f);
+	} else {
+		const char *p=fmt;
+		int pos=0;
+		int type;
+		char spec[24], lenmod[3];
+		const char *start=p;
+		while ((type=next_piece(p, &p, spec, lenmod))!=ARG_END) {
+			if (type==ARG_NONE) {
+				if (p-start==2 && start[0]=='%') {
+					fputc('%', f);
+				} else {
+					fwrite(start, p-start, 1, f);
+				}
+			} else if (type==ARG_STR) {
+				fprintf(f, spec, (const char*)&payload[pos]);
+				pos+=strlen((const char*)&payload[pos])+1;
+			} else {
+				uint64_t v;
+				memcpy(&v, &payload[pos], 8);
+				pos+=8;
+				if (type==ARG_DOUBLE) {
+					double d;
+					memcpy(&d, &v, 8);
+					fprintf(f, spec, d);
+				} else if (type==ARG_PTR) {
+					fprintf(f, spec, (void*)(uintptr_t)v);
+				} else if (type==ARG_CHAR) {
+					fprintf(f, spec, (int)v);
+				} else {
+					fprintf(f, spec, (long long)v);
+				}
+			}
+			start=p;
+		}
+	}
+	fputs(ANSI_COLOUR_NORMAL, f);
+}
+
+static uint64_t (*timestamp_cb)()=NULL;
+
+void log_set_timestamp_cb(uint64_t (*cb)()) {
+	timestamp_cb=cb;
+}
+
+#ifndef __EMSCRIPTEN__
+
+static uint8_t *ring;
+static atomic_uint ring_wr=0; //only written by the emulator thread
+static atomic_uint ring_rd=0; //only written by the log thread
+static atomic_int stop_thread=0;
+static pthread_t log_thread;
+static FILE *binfile=NULL;
+static char *binfilename_saved=NULL;
+static unsigned long dropped=0;
+int log_async_active=0;
+
+static void ring_put(unsigned int pos, const void *data, int len) {
+	unsigned int start=pos&(RING_SZ-1);
+	int first=len;
+	if (start+first>RING_SZ) first=RING_SZ-start;
+	memcpy(&ring[start], data, first);
+	memcpy(&ring[0], (const uint8_t*)data+first, len-first);
+}
+
+static void ring_get(unsigned int pos, void *data, int len) {
+	unsigned int start=pos&(RING_SZ-1);
+	int first=len;
+	if (start+first>RING_SZ) first=RING_SZ-start;
+	memcpy(data, &ring[start], first);
+	memcpy((uint8_t*)data+first, &ring[0], len-first);
+}
+
+void log_async_record(enum log_source source, enum log_level msg_level, const char *format, va_list ap) {
+	uint8_t payload[MAX_PAYLOAD];
+	rec_hdr_t h={
+		.ts=timestamp_cb?timestamp_cb():0,
+		.fmt=(uintptr_t)format,
+		.src=source,
+		.lvl=msg_level
+	};
+	int len=capture_args(format, ap, payload);
+	if (len<0) {
+		//Can't capture this; format it right now.
+		len=vsnprintf((char*)payload, MAX_PAYLOAD, format, ap);
+		if (len>=MAX_PAYLOAD) len=MAX_PAYLOAD-1;
+		h.fmt=0;
+	}
+	h.len=len;
+	unsigned int wr=atomic_load_explicit(&ring_wr, memory_order_relaxed);
+	unsigned int rd=atomic_load_explicit(&ring_rd, memory_order_acquire);
+	if (RING_SZ-(wr-rd)<sizeof(h)+len) {
+		dropped++;
+		return;
+	}
+	ring_put(wr, &h, sizeof(h));
+	ring_put(wr+sizeof(h), payload, len);
+	atomic_store_explicit(&ring_wr, wr+sizeof(h)+len, memory_order_release);
+}
+
+//Handles all records in the ring. Returns the number of records handled.
+static int drain_ring() {
+	int n=0;
+	unsigned int rd=atomic_load_explicit(&ring_rd, memory_order_relaxed);
+	unsigned int wr=atomic_load_explicit(&ring_wr, memory_order_acquire);
+	while (rd!=wr) {
+		rec_hdr_t h;
+		uint8_t payload[MAX_PAYLOAD];
+		ring_get(rd, &h, sizeof(h));
+		ring_get(rd+sizeof(h), payload, h.len);
+		if (binfile) {
+			fwrite(&h, sizeof(h), 1, binfile);
+			fwrite(payload, h.len, 1, binfile);
+		} else {
+			print_record(stdout, &h, (const char*)(uintptr_t)h.fmt, payload, 0);
+		}
+		rd+=sizeof(h)+h.len;
+		n++;
+	}
+	atomic_store_explicit(&ring_rd, rd, memory_order_release);
+	if (n) fflush(binfile?binfile:stdout);
+	return n;
+}
+
+static void *log_thread_fn(void *arg) {
+	while (!atomic_load(&stop_thread)) {
+		if (drain_ring()==0) usleep(1000);
+	}
+	return NULL;
+}
+
+static int start_thread() {
+	atomic_store(&stop_thread, 0);
+	//Signals should be handled by the emulator thread, so block them here.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int r=pthread_create(&log_thread, NULL, log_thread_fn, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return r==0;
+}
+
+static void write_bin_hdr() {
+	bin_hdr_t bh={.magic=BIN_MAGIC, .ref=(uintptr_t)ref_str};
+	fwrite(&bh, sizeof(bh), 1, binfile);
+}
+
+/*
+fork() only copies the calling thread, so the log thread is stopped and the
+ring emptied before forking, and started again on both sides afterwards. A
+child writes its binary log to a file of its own, named after its pid, rather
+than interleaving with its parent's.
+*/
+static void fork_prepare() {
+	if (!log_async_active) return;
+	atomic_store(&stop_thread, 1);
+	pthread_join(log_thread, NULL);
+	drain_ring();
+}
+
+static void fork_parent() {
+	if (!log_async_active) return;
+	if (!start_thread()) printf("Could not restart log thread\n");
+}
+
+static void fork_child() {
+	if (!log_async_active) return;
+	if (binfile) {
+		fclose(binfile);
+		char name[strlen(binfilename_saved)+16];
+		sprintf(name, "%s.%d", binfilename_saved, (int)getpid());
+		binfile=fopen(name, "wb");
+		if (!binfile) {
+			perror(name);
+			log_async_active=0;
+			return;
+		}
+		write_bin_hdr();
+	}
+	if (!start_thread()) {
+		printf("Could not restart log thread\n");
+		log_async_active=0;
+	}
+}
+
+static void log_async_stop() {
+	if (!log_async_active) return;
+	atomic_store(&stop_thread, 1);
+	pthread_join(log_thread, NULL);
+	log_async_active=0;
+	drain_ring();
+	if (binfile) fclose(binfile);
+	if (dropped) printf("Log: dropped %lu messages because the log buffer was full\n", dropped);
+}
+
+int log_start_async(const char *binfilename) {
+	if (binfilename) {
+		binfile=fopen(binfilename, "wb");
+		if (!binfile) {
+			perror(binfilename);
+			return 0;
+		}
+		binfilename_saved=strdup(binfilename);
+		write_bin_hdr();
+	}
+	ring=malloc(RING_SZ);
+	if (!start_thread()) {
+		printf("Could not start log thread\n");
+		return 0;
+	}
+	log_async_active=1;
+	atexit(log_async_stop);
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+	return 1;
+}
+
+#else
+
+int log_async_active=0;
+
+void log_async_record(enum log_source source, enum log_level msg_level, const char *format, va_list ap) {
+}
+
+int log_start_async(const char *binfilename) {
+	printf("Async logging is not supported in the browser\n");
+	return 0;
+}
+
+#endif
+
+int log_decode(const char *binfilename) {
+	FILE *f=fopen(binfilename, "rb");
+	if (!f) {
+		perror(binfilename);
+		return 0;
+	}
+	bin_hdr_t bh;
+	if (fread(&bh, sizeof(bh), 1, f)!=1 || strcmp(bh.magic, BIN_MAGIC)!=0) {
+		printf("%s: not a binary log file\n", binfilename);
+		fclose(f);
+		return 0;
+	}
+	//Format strings moved by the same amount as our reference string.
+	intptr_t slide=(uintptr_t)ref_str-bh.ref;
+	rec_hdr_t h;
+	uint8_t payload[MAX_PAYLOAD];
+	while (fread(&h, sizeof(h), 1, f)==1) {
+		if (h.len>MAX_PAYLOAD || fread(payload, h.len, 1, f)!=(h.len?1:0)) break;
+		if (h.src>=LOG_SRC_MAX || h.lvl>=LOG_LVL_MAX) break;
+		const char *fmt=h.fmt?(const char*)(uintptr_t)(h.fmt+slide):NULL;
+		print_record(stdout, &h, fmt, payload, 1);
+	}
+	fclose(f);
+	return 1;
+}
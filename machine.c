@@ -0,0 +1,120 @@
+/*
+ Library interface to the emulator: lets a harness create the machine and
+ step it in-process.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine.h"
+#include "uart.h"
+
+struct machine_t {
+	emu_cfg_t *cfg;
+	machine_console_t console;
+	const char *want;	//console string being waited for, or NULL
+	int want_len;
+	int matched;
+	uart_match_t match;
+};
+
+static machine_t *machine=NULL;
+static int machine_used=0;
+
+static void console_out(void *opaque, char c) {
+	machine_t *m=opaque;
+	m->console.out(m->console.opaque, c);
+}
+
+static int console_in(void *opaque) {
+	machine_t *m=opaque;
+	if (!m->console.in) return -1;
+	return m->console.in(m->console.opaque);
+}
+
+static void machine_console_out(char c) {
+	machine_t *m=machine;
+	if (!m || !m->want || m->matched) return;
+	if (uart_match_add(&m->match, c, m->want, m->want_len)) m->matched=1;
+}
+
+machine_t *machine_create(emu_cfg_t *cfg, const machine_console_t *console) {
+	if (machine_used) {
+		printf("machine_create: only one machine per process\n");
+		return NULL;
+	}
+	machine_t *m=calloc(sizeof(machine_t), 1);
+	m->cfg=cfg;
+	if (console) {
+		m->console=*console;
+		uart_console_set_cb(console->out?console_out:NULL, console_in, m);
+	}
+	machine=m;
+	machine_used=1;
+	uart_console_add_hook(machine_console_out);
+	emu_init(cfg);
+	return m;
+}
+
+uint64_t machine_run_for(machine_t *m, uint64_t cycles) {
+	//A zero max_cycles would mean no limit.
+	if (cycles==0) return 0;
+	machine_until_t until={.max_cycles=cycles};
+	uint64_t start=emu_get_cycles();
+	machine_run_until(m, &until);
+	return emu_get_cycles()-start;
+}
+
+machine_stop_t machine_run_until(machine_t *m, const machine_until_t *until) {
+	uint64_t start=emu_get_cycles();
+	m->want=until?until->console:NULL;
+	if (m->want && strlen(m->want)>UART_MATCH_MAX) {
+		printf("machine_run_until: console string too long\n");
+		m->want=NULL;
+	}
+	if (m->want) m->want_len=strlen(m->want);
+	m->matched=0;
+	uart_match_clear(&m->match);
+	machine_stop_t ret;
+	while (1) {
+		if (!emu_run_slice()) {
+			ret=MACHINE_STOP_QUIT;
+			break;
+		}
+		if (!until) continue;
+		//The guest can print a bit more in the same timeslice after the match.
+		if (m->matched) {
+			ret=MACHINE_STOP_CONSOLE;
+			break;
+		}
+		if (until->time_us && emu_get_time_us()>=until->time_us) {
+			ret=MACHINE_STOP_TIME;
+			break;
+		}
+		if (until->max_cycles && emu_get_cycles()-start>=until->max_cycles) {
+			ret=MACHINE_STOP_CYCLES;
+			break;
+		}
+	}
+	m->want=NULL;
+	return ret;
+}
+
+uint64_t machine_get_stats(machine_t *m, emu_stats_t *stats) {
+	if (stats) memcpy(stats, &emu_stats, sizeof(emu_stats_t));
+	return emu_get_time_us();
+}
+
+void machine_destroy(machine_t *m) {
+	emu_flush();
+	fflush(stdout);
+	uart_console_set_cb(NULL, NULL, NULL);
+	machine=NULL;
+	free(m);
+}
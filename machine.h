@@ -0,0 +1,60 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+/*
+Interface to run the emulator from another program: create the machine, run
+it for a while or until something happens, look at the statistics. Link
+against libplexus.a. As the emulator keeps its state in globals, there can
+only be one machine per process.
+*/
+
+#include <stdint.h>
+#include "emu.h"
+#include "stats.h"
+
+typedef struct machine_t machine_t;
+
+//Console callbacks. out gets every character the guest prints on the console;
+//in is polled for input and returns -1 if there is none.
+typedef struct {
+	void (*out)(void *opaque, char c);
+	int (*in)(void *opaque);
+	void *opaque;
+} machine_console_t;
+
+//What to run until. Fields that are zero or NULL are ignored.
+typedef struct {
+	uint64_t max_cycles;	//stop after this many CPU cycles (see emu_get_cycles())
+	uint64_t time_us;		//stop when the emulated time reaches this
+	const char *console;	//stop when the guest printed this on the console
+} machine_until_t;
+
+//Why machine_run_until() returned
+typedef enum {
+	MACHINE_STOP_CYCLES=0,
+	MACHINE_STOP_TIME,
+	MACHINE_STOP_CONSOLE,
+	MACHINE_STOP_QUIT		//a quit was requested over the control socket
+} machine_stop_t;
+
+//Set up the machine. If console is NULL, the console is on stdin/stdout.
+//cfg must stay valid until machine_destroy(). Returns NULL if a machine
+//already exists; other setup errors exit the process.
+machine_t *machine_create(emu_cfg_t *cfg, const machine_console_t *console);
+
+//Run for at least the given amount of CPU cycles. The machine runs in whole
+//timeslices, so it can overshoot by up to one timeslice. Returns the amount of
+//cycles actually run; 0 if cycles is 0.
+uint64_t machine_run_for(machine_t *m, uint64_t cycles);
+
+//Run until one of the conditions in until is met. With until NULL, runs
+//until a quit is requested.
+machine_stop_t machine_run_until(machine_t *m, const machine_until_t *until);
+
+//Copy the runtime statistics and return the emulated time in us.
+uint64_t machine_get_stats(machine_t *m, emu_stats_t *stats);
+
+//Flush the disk and stop. The emulator memory is only freed when the process exits.
+void machine_destroy(machine_t *m);
+
+#endif
@@ -12,68 +12,14 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include <assert.h>
 #include <string.h>
 #include "emu.h"
+#include "machine.h"
 #include "log.h"
 #include "emscripten_env.h"
 
-//Strings defining the various log modules
-const char *log_str[]={
-	[LOG_SRC_UART]="uart",
-	[LOG_SRC_CSR]="csr",
-	[LOG_SRC_MBUS]="mbus",
-	[LOG_SRC_MAPPER]="mapper",
-	[LOG_SRC_SCSI]="scsi",
-	[LOG_SRC_RAMROM]="ramrom",
-	[LOG_SRC_RTC]="rtc",
-	[LOG_SRC_EMU]="emu",
-	[LOG_SRC_STRACE]="strace",
-};
-
-//Strings defining the various log levels.
-const char *level_str[]={
-	"err", "warn", "notice", "info", "debug"
-};
-
-//Returns the log level id for a given string in level_str
-int loglevel_for(const char *str) {
-	for (int i=0; i<LOG_LVL_MAX; i++) {
-		if (strcmp(str, level_str[i])==0) {
-			return i;
-		}
-	}
-	return -1;
-}
-
-//parses either e.g. 'notice' to set all srcs to that,
-//or e.g. 'rtc=notice' to only set that source to the level.
-//return 1 on error, 0 on ok
-int parse_loglvl_str(char *str) {
-	char *s=strchr(str, '=');
-	if (!s) s=strchr(str, ':'); //cause I keep mistyping emu:debug instead of emu=debug
-	if (!s) {
-		int lvl=loglevel_for(str);
-		if (lvl==-1) return 1;
-		for (int i=0; i<LOG_SRC_MAX; i++) {
-			log_set_level(i, lvl);
-		}
-		return 0;
-	} else {
-		int lvl=loglevel_for(s+1);
-		if (lvl==-1) return 1;
-		for (int i=0; i<LOG_SRC_MAX; i++) {
-			if (strlen(log_str[i])==(s-str) && strncmp(str, log_str[i], s-str)==0) {
-				log_set_level(i, lvl);
-				return 0;
-			}
-		}
-	}
-	return 1;
-}
+//Max amount of read-only COW layers that can be given on the command line
+#define MAX_COW_LOWER 32
 
 int main(int argc, char **argv) {
-	static_assert(sizeof(log_str)/sizeof(log_str[0])==LOG_SRC_MAX,
-					"log_str array out of sync");
-	static_assert(sizeof(level_str)/sizeof(level_str[0])==LOG_LVL_MAX,
-					"level_str array out of sync");
 	emu_cfg_t cfg={
 		.u15_rom="U15-MERGED.BIN",
 		.u17_rom="U17-MERGED.BIN",
@@ -85,13 +31,25 @@ int main(int argc, char **argv) {
 		.rtcram="rtcram.bin",
 #endif
 		.hd0img="plexus-sanitized.img",
-		.mem_size_bytes=2*1024*1024
+		.mem_size_bytes=2*1024*1024,
+		.ramdisk_id=1,
+		.trace_cpus=3,
+		.prof_interval=1000,
+		.realtime_speed=1.0,
+		.realtime_max_lag_ms=100,
+		.stats_interval_s=10,
+		.ckpt_interval_s=5
 	};
 #ifdef __EMSCRIPTEN__
 	emscripten_init();
 #endif
+	const char *cow_lower[MAX_COW_LOWER+1]={NULL};
+	int n_cow_lower=0;
+	cfg.cow_lower=cow_lower;
 	//Parse commandline args
 	int error=0;
+	int log_async=0;
+	const char *log_binfile=NULL;
 	for (int i=1; i<argc; i++) {
 		if (strcmp(argv[i], "-u15")==0 && i+1<argc) {
 			i++;
@@ -104,19 +62,156 @@ int main(int argc, char **argv) {
 			cfg.hd0img=argv[i];
 		} else if (strcmp(argv[i], "-r")==0) {
 			cfg.realtime=1;
+		} else if (strcmp(argv[i], "-speed")==0 && i+1<argc) {
+			i++;
+			cfg.realtime=1;
+			cfg.realtime_speed=atof(argv[i]);
+			if (cfg.realtime_speed<=0) error=1;
+		} else if (strcmp(argv[i], "-mhz")==0 && i+1<argc) {
+			i++;
+			cfg.cpu_hz=atof(argv[i])*1000000;
+			if (cfg.cpu_hz<1000000) error=1;
+		} else if (strcmp(argv[i], "-unlimited")==0) {
+			cfg.unlimited=1;
+		} else if (strcmp(argv[i], "-record")==0 && i+1<argc) {
+			i++;
+			cfg.record_file=argv[i];
+		} else if (strcmp(argv[i], "-replay")==0 && i+1<argc) {
+			i++;
+			cfg.replay_file=argv[i];
+		} else if (strcmp(argv[i], "-replayfast")==0) {
+			cfg.replay_fast=1;
+		} else if (strcmp(argv[i], "-ckpt")==0 && i+1<argc) {
+			i++;
+			cfg.ckpt_prefix=argv[i];
+		} else if (strcmp(argv[i], "-ckptint")==0 && i+1<argc) {
+			i++;
+			cfg.ckpt_interval_s=atoi(argv[i]);
+			if (cfg.ckpt_interval_s<=0) error=1;
+		} else if (strcmp(argv[i], "-restore")==0) {
+			cfg.ckpt_restore=1;
+		} else if (strcmp(argv[i], "-control")==0 && i+1<argc) {
+			i++;
+			cfg.control_path=argv[i];
+		} else if (strcmp(argv[i], "-clone")==0 && i+1<argc) {
+			i++;
+			cfg.clones=atoi(argv[i]);
+			if (cfg.clones<=0) error=1;
+		} else if (strcmp(argv[i], "-clonemark")==0 && i+1<argc) {
+			i++;
+			cfg.clone_marker=argv[i];
+		} else if (strcmp(argv[i], "-maxlag")==0 && i+1<argc) {
+			i++;
+			cfg.realtime_max_lag_ms=atoi(argv[i]);
 		} else if (strcmp(argv[i], "-y")==0) {
 			cfg.noyolo=1;
 		} else if (strcmp(argv[i], "-t")==0) {
 			cfg.tracesyscalls=1;
+			//Syscalls are logged at info level.
+			if (LOG_INFO>LOG_COMPILE_LEVEL) {
+				printf("Note: -t prints nothing, as log level %s is compiled out of this build\n", level_str[LOG_INFO]);
+			}
+		} else if (strcmp(argv[i], "-T")==0 && i+1<argc) {
+			i++;
+			cfg.sysstat_file=argv[i];
+		} else if (strcmp(argv[i], "-stats")==0 && i+1<argc) {
+			i++;
+			cfg.stats_file=argv[i];
+		} else if (strcmp(argv[i], "-statsint")==0 && i+1<argc) {
+			i++;
+			cfg.stats_interval_s=atoi(argv[i]);
+			if (cfg.stats_interval_s<=0) error=1;
+		} else if (strcmp(argv[i], "-memstat")==0 && i+1<argc) {
+			i++;
+			cfg.memstat_file=argv[i];
+		} else if (strcmp(argv[i], "-memheat")==0 && i+1<argc) {
+			i++;
+			cfg.memheat_file=argv[i];
 		} else if (strcmp(argv[i], "-l")==0 && i+1<argc) {
 			i++;
 			error=parse_loglvl_str(argv[i]);
+		} else if (strcmp(argv[i], "-logasync")==0) {
+			log_async=1;
+		} else if (strcmp(argv[i], "-logbin")==0 && i+1<argc) {
+			i++;
+			log_binfile=argv[i];
+		} else if (strcmp(argv[i], "-logdecode")==0 && i+1<argc) {
+			i++;
+			exit(log_decode(argv[i])?0:1);
 		} else if (strcmp(argv[i], "-c")==0 && i+1<argc) {
 			i++;
 			cfg.cow_dir=argv[i];
+		} else if (strcmp(argv[i], "-L")==0 && i+1<argc) {
+			i++;
+			if (n_cow_lower==MAX_COW_LOWER) {
+				printf("Too many COW layers\n");
+				error=1;
+			} else {
+				cow_lower[n_cow_lower++]=argv[i];
+			}
+		} else if (strcmp(argv[i], "-commit")==0 && i+1<argc) {
+			i++;
+			cfg.commit_img=argv[i];
 		} else if (strcmp(argv[i], "-m")==0 && i+1<argc) {
 			i++;
 			cfg.mem_size_bytes=atoi(argv[i])*1024*1024;
+		} else if (strcmp(argv[i], "-rd")==0 && i+1<argc) {
+			i++;
+			cfg.ramdisk_img=argv[i];
+		} else if (strcmp(argv[i], "-rdsize")==0 && i+1<argc) {
+			i++;
+			int mb=atoi(argv[i]);
+			//The disk is addressed with an int, so it has to stay below 2GiB.
+			if (mb<1 || mb>2047) {
+				printf("RAM disk size needs to be 1-2047 MiB (%s given)\n", argv[i]);
+				error=1;
+			} else {
+				cfg.ramdisk_size_bytes=mb*1024*1024;
+			}
+		} else if (strcmp(argv[i], "-rdid")==0 && i+1<argc) {
+			i++;
+			cfg.ramdisk_id=atoi(argv[i]);
+		} else if (strcmp(argv[i], "-rdkeep")==0) {
+			cfg.ramdisk_persist=1;
+		} else if (strcmp(argv[i], "-script")==0 && i+1<argc) {
+			i++;
+			cfg.script=argv[i];
+		} else if (strcmp(argv[i], "-trace")==0 && i+1<argc) {
+			i++;
+			cfg.trace_prefix=argv[i];
+		} else if (strcmp(argv[i], "-tracecpu")==0 && i+1<argc) {
+			i++;
+			if (strcmp(argv[i], "0")==0 || strcmp(argv[i], "1")==0) {
+				cfg.trace_cpus=1<<atoi(argv[i]);
+			} else {
+				printf("Trace CPU needs to be 0 or 1 (%s given)\n", argv[i]);
+				error=1;
+			}
+		} else if (strcmp(argv[i], "-tracez")==0) {
+			cfg.trace_compress=1;
+		} else if (strcmp(argv[i], "-prof")==0 && i+1<argc) {
+			i++;
+			cfg.prof_prefix=argv[i];
+		} else if (strcmp(argv[i], "-profsym")==0 && i+1<argc) {
+			i++;
+			cfg.prof_symfile=argv[i];
+		} else if (strcmp(argv[i], "-profint")==0 && i+1<argc) {
+			i++;
+			cfg.prof_interval=atoi(argv[i]);
+			if (cfg.prof_interval<1) error=1;
+		} else if (strcmp(argv[i], "-profstack")==0) {
+			cfg.prof_stacks=1;
+		} else if (strcmp(argv[i], "-b")==0) {
+			cfg.serial_paced=1;
+		} else if (strcmp(argv[i], "-s")==0 && i+1<argc) {
+			i++;
+			int n=argv[i][0]-'0';
+			if (n<0 || n>7 || argv[i][1]!='=') {
+				printf("Serial port needs to be given as n=spec with n 0-7 (%s given)\n", argv[i]);
+				error=1;
+			} else {
+				cfg.serport[n]=&argv[i][2];
+			}
 		} else {
 			printf("Unknown argument %s\n", argv[i]);
 			error=1;
@@ -129,18 +224,66 @@ int main(int argc, char **argv) {
 		printf("Note 1 and 8 MB may not be supported by the OS\n");
 		error=1;
 	}
+	if (cfg.ramdisk_id<0 || cfg.ramdisk_id>7 || cfg.ramdisk_id==0 || cfg.ramdisk_id==3) {
+		printf("RAM disk SCSI ID needs to be 1, 2 or 4-7 (%d given)\n", cfg.ramdisk_id);
+		error=1;
+	}
+	if (cfg.ramdisk_persist && !cfg.ramdisk_img) {
+		printf("-rdkeep needs a RAM disk template image (-rd)\n");
+		error=1;
+	}
 	if (error) {
 		printf("Plexus-20 emulator\n");
 		printf("Usage: %s [args]\n", argv[0]);
 		printf(" -u15 Path to U15 rom file\n");
 		printf(" -u17 Path to U17 rom file\n");
 		printf(" -hd Path to hdimage file\n");
+		printf(" -c dir - Write changes to the hdimage to this copy-on-write directory\n");
+		printf(" -L dir - Add a read-only COW layer below the -c directory (can be given multiple times, bottom first)\n");
+		printf(" -commit file - Write the hdimage with all COW layers applied to a raw image file and exit\n");
 		printf(" -r Try to run at realtime speed\n");
+		printf(" -speed x - Run at x times realtime speed (implies -r)\n");
+		printf(" -mhz f - Set the CPU clock to f MHz (default 10; the P/20 also came with 12.5)\n");
+		printf(" -unlimited Run the CPUs as fast as possible; devices and clocks follow host time\n");
+		printf(" -record file - Record console and serial input so the session can be replayed exactly\n");
+		printf(" -replay file - Replay a recorded session (use the same ROMs, disk and options)\n");
+		printf(" -replayfast Replay as fast as possible, even if realtime speed is set\n");
+		printf(" -ckpt prefix - Write a checkpoint of the machine (not the disk) to prefix.n regularly\n");
+		printf(" -ckptint n - Write a checkpoint every n emulated seconds (default 5)\n");
+		printf(" -restore Start from the newest checkpoint written with -ckpt\n");
+		printf(" -control path - Accept commands on a Unix socket at path; send 'help' for a list\n");
+		printf(" -clone n - On SIGHUP, fork into n clones, each with its own COW layer and console socket\n");
+		printf(" -clonemark str - Also clone when the guest prints str on the console\n");
+		printf(" -maxlag ms - In realtime mode, catch up on at most this much lag (default 100, -1 for no limit)\n");
 		printf(" -m n Set the amount of memory to n megabytes\n");
 		printf(" -l module=level - set logging level of module to specified level\n");
 		printf(" -l level - Set overal log level to specified level\n");
+		printf(" -logasync Format log messages in a background thread\n");
+		printf(" -logbin file - Write log messages to a binary file in a background thread\n");
+		printf(" -logdecode file - Print a binary log file written by this emu binary and exit\n");
 		printf(" -y Disable 'yolo-hack' making the first 8 bytes of ram writable in sys mode\n");
 		printf(" -t Use traps to trace SysV syscalls\n");
+		printf(" -T file - Write syscall counts and latency histograms to file on exit or SIGUSR2\n");
+		printf(" -stats file - Write emulator statistics to file periodically and on exit (ctrl+\\ prints them too)\n");
+		printf(" -statsint n - Write statistics every n emulated seconds (default 10)\n");
+		printf(" -memstat file - Count accesses per memory range and CPU; written as CSV on exit or ctrl+\\\n");
+		printf(" -memheat file - Count accesses per 4K page of physical RAM; written as CSV on exit or ctrl+\\\n");
+		printf(" -rd file - Attach a RAM disk preloaded from the given template image\n");
+		printf(" -rdsize n - Make the RAM disk at least n megabytes\n");
+		printf(" -rdid n - SCSI ID for the RAM disk (default 1)\n");
+		printf(" -rdkeep Write the RAM disk back to its template image on exit\n");
+		printf(" -script file - Run an expect-style script on the console; see script.c\n");
+		printf(" -trace prefix - Write a binary instruction trace to prefix.cpu0/prefix.cpu1; decode with tracedec\n");
+		printf(" -tracecpu n - Only trace cpu n (0=dma, 1=job)\n");
+		printf(" -tracez Compress the trace with gzip\n");
+		printf(" -prof prefix - Profile guest code; writes prefix.flat and prefix.folded on exit or SIGUSR1\n");
+		printf(" -profsym file - Resolve kernel addresses using this COFF executable (e.g. /unix) or nm output\n");
+		printf(" -profint n - Take a profiler sample every n CPU cycles (default 1000); at most one per 10us slice\n");
+		printf(" -profstack Record the call stack with each sample for the folded output\n");
+		printf(" -b Run serial ports at the baud rate set by the guest (default: as fast as possible)\n");
+		printf(" -s n=pty - Connect serial port n (0-7) to a new host pseudo-terminal\n");
+		printf(" -s n=unix:path - Connect serial port n (0-7) to a Unix socket at path\n");
+		printf("    Port 0/1 are channel A/B of UART_A; port 1 is the console. 2/3 are UART_B etc.\n");
 		printf("Modules: ");
 		for (int i=0; i<LOG_SRC_MAX; i++) printf("%s ", log_str[i]);
 		printf("\n");
@@ -149,5 +292,10 @@ int main(int argc, char **argv) {
 		printf("\n");
 		exit(0);
 	}
-	emu_start(&cfg);
+	log_set_timestamp_cb(emu_get_cycles);
+	if ((log_async || log_binfile) && !log_start_async(log_binfile)) exit(1);
+	machine_t *mach=machine_create(&cfg, NULL);
+	machine_run_until(mach, NULL);
+	machine_destroy(mach);
+	exit(0);
 }
@@ -74,6 +74,10 @@ void mapper_set_mapid(mapper_t *m, uint8_t id) {
 	m->cur_id=id;
 }
 
+int mapper_get_mapid(mapper_t *m) {
+	return m->cur_id;
+}
+
 //returns fault indicator, or 0 if allowed
 static int access_allowed_page(mapper_t *m, unsigned int page, int access_flags) {
 	assert(page<4096);
@@ -141,11 +145,9 @@ void mapper_write16(void *obj, unsigned int a, unsigned int val) {
 
 	mapper_t *m=(mapper_t*)obj;
 	a=a/2; //word addr
-	if (a&1) {
-		m->desc[a/2].w1=val;
-	} else {
-		m->desc[a/2].w0=val;
-	}
+	uint16_t *w=(a&1)?&m->desc[a/2].w1:&m->desc[a/2].w0;
+	if (*w!=(uint16_t)val) emu_mapping_changed();
+	*w=val;
 }
 
 void mapper_write32(void *obj, unsigned int a, unsigned int val) {
@@ -210,6 +212,21 @@ int do_map(mapper_t *m, unsigned int a, unsigned int is_write) {
 	return phys;
 }
 
+//Same as do_map, but without touching the referenced/altered bits.
+int mapper_virt_to_phys(mapper_t *m, unsigned int a) {
+	int p=a>>12;
+	if (m->sysmode) p+=SYS_ENTRY_START;
+	int phys_p=m->desc[p].w1&W1_PAGE_MASK;
+	return ((a&0xFFF)|(phys_p<<12))&((8*1024*1024)-1);
+}
+
+uint8_t *mapper_page_data(mapper_t *m, unsigned int a) {
+	//Physical RAM wraps around like in ram_read*.
+	int p=(mapper_virt_to_phys(m, a)>>RAM_PAGE_SHIFT)%ram_page_count(m->physram);
+	if (ram_page_len(m->physram, p)!=RAM_PAGE_SIZE) return NULL;
+	return ram_page_data(m->physram, p);
+}
+
 void mapper_ram_write8(void *obj, unsigned int a, unsigned int val) {
 	mapper_t *m=(mapper_t*)obj;
 	a=do_map(m, a, 1);
@@ -255,4 +272,17 @@ mapper_t *mapper_new(ram_t *physram, int size, int yolo) {
 	return ret;
 }
 
+void mapper_ckpt_save(mapper_t *m, ckpt_t *c) {
+	ckpt_put(c, "mapper", m->desc, sizeof(m->desc));
+	int st[2]={m->sysmode, m->cur_id};
+	ckpt_put(c, "mapper_st", st, sizeof(st));
+}
 
+int mapper_ckpt_load(mapper_t *m, ckpt_t *c) {
+	int st[2];
+	if (!ckpt_get(c, "mapper", m->desc, sizeof(m->desc))) return 0;
+	if (!ckpt_get(c, "mapper_st", st, sizeof(st))) return 0;
+	m->sysmode=st[0];
+	m->cur_id=st[1];
+	return 1;
+}
@@ -1,4 +1,5 @@
 #include "ramrom.h"
+#include "checkpoint.h"
 
 
 typedef struct mapper_t mapper_t;
@@ -25,6 +26,13 @@ unsigned int mapper_ram_read32(void *obj, unsigned int a);
 void mapper_set_sysmode(mapper_t *m, int cpu_in_sysmode);
 //Set the active map ID.
 void mapper_set_mapid(mapper_t *m, uint8_t id);
+//Get the active map ID.
+int mapper_get_mapid(mapper_t *m);
+//Return the physical address a virtual address in the current map maps to.
+int mapper_virt_to_phys(mapper_t *m, unsigned int a);
+//Return the host memory of the physical page a virtual address maps to, or
+//NULL if that isn't a whole page. Does not check access rights.
+uint8_t *mapper_page_data(mapper_t *m, unsigned int a);
 
 //note RWX flags match page tables
 #define ACCESS_SYSTEM 0x1
@@ -36,4 +44,6 @@ void mapper_set_mapid(mapper_t *m, uint8_t id);
 //Returns one of ACCESS_ERROR_x.
 int mapper_access_allowed(mapper_t *m, unsigned int a, int access_flags);
 
-
+//Save or restore the page tables and mapper state in a checkpoint.
+void mapper_ckpt_save(mapper_t *m, ckpt_t *c);
+int mapper_ckpt_load(mapper_t *m, ckpt_t *c);
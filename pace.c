@@ -0,0 +1,98 @@
+/*
+ Pacing of emulated time to host time, for running at (a multiple of) the
+ speed of a real machine.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include "pace.h"
+#include "stats.h"
+#include "log.h"
+#ifdef __EMSCRIPTEN__
+#include "emscripten.h"
+#include "emscripten_env.h"
+#endif
+
+#define PACE_LOG(msg_level, format_and_args...) \
+	log_printf(LOG_SRC_EMU, msg_level, format_and_args)
+#define PACE_LOG_DEBUG(format_and_args...) PACE_LOG(LOG_DEBUG, format_and_args)
+
+/*
+Emulated time since the start maps onto an absolute host deadline:
+base + emu_us/speed. The host clock is only read every CHECK_US of emulated
+time; if we're ahead, we sleep until the deadline with an absolute timeout so
+oversleeping doesn't add up over time. If we're more than max_lag_us behind
+(e.g. because the host was busy, or the process was stopped), the base is
+moved so the lag is forgotten rather than running flat out to catch up.
+*/
+
+#ifdef __EMSCRIPTEN__
+//The browser needs us to yield regularly, and sleeps have ms resolution.
+#define CHECK_US 10000
+#else
+#define CHECK_US 1000
+#endif
+
+static double pace_speed;
+static int pace_max_lag_us;
+static uint64_t base_ns;		//host time corresponding to emu_us==0
+static uint64_t emu_us;			//emulated time since base_ns
+static int since_check_us;
+
+void pace_init(double speed, int max_lag_us) {
+	pace_speed=speed;
+	pace_max_lag_us=max_lag_us;
+	base_ns=stats_now_ns();
+	emu_us=0;
+	since_check_us=0;
+}
+
+static void sleep_until(uint64_t deadline_ns, uint64_t now_ns) {
+#ifdef __EMSCRIPTEN__
+	//We're idle anyway, so this is a good moment to persist disk writes.
+	emscripten_syncfs_poll();
+	emscripten_sleep((deadline_ns-now_ns)/1000000);
+#else
+	struct timespec ts={
+		.tv_sec=deadline_ns/1000000000ULL,
+		.tv_nsec=deadline_ns%1000000000ULL
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)==EINTR) ;
+#endif
+}
+
+void pace_advance(int us) {
+	emu_us+=us;
+	since_check_us+=us;
+	if (since_check_us<CHECK_US) return;
+	since_check_us=0;
+
+	uint64_t deadline=base_ns+(uint64_t)(emu_us*1000.0/pace_speed);
+	uint64_t now=stats_now_ns();
+	if (now<deadline) {
+		sleep_until(deadline, now);
+		emu_stats.pace_sleeps++;
+		uint64_t woke=stats_now_ns();
+		if (woke>deadline) emu_stats.pace_oversleep_ns+=woke-deadline;
+		return;
+	}
+	uint64_t lag_us=(now-deadline)/1000;
+	if (lag_us>emu_stats.pace_max_lag_us) emu_stats.pace_max_lag_us=lag_us;
+	if (pace_max_lag_us>=0 && lag_us>pace_max_lag_us) {
+		PACE_LOG_DEBUG("Pacer: %llu us behind, dropping lag\n", (unsigned long long)lag_us);
+		emu_stats.pace_dropped_us+=lag_us;
+		base_ns+=lag_us*1000;
+	}
+#ifdef __EMSCRIPTEN__
+	//Still yield to the browser.
+	emscripten_syncfs_poll();
+	emscripten_sleep(0);
+#endif
+}
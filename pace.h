@@ -0,0 +1,16 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdint.h>
+
+//Start pacing emulation to host time. speed is the multiple of realtime to
+//run at (1.0 is as fast as a real machine). max_lag_us is how far emulation
+//may fall behind the host before the pacer gives up on catching up and
+//drops the lag; use -1 to always catch up.
+void pace_init(double speed, int max_lag_us);
+
+//Call after every slice with the amount of emulated time it took. Sleeps
+//as needed to keep emulated time in step with host time.
+void pace_advance(int emu_us);
+
+#endif
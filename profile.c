@@ -0,0 +1,386 @@
+/*
+ Sampling profiler for guest code.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "profile.h"
+
+/*
+The emulator calls prof_sample() every so many emulated cycles with the
+current CPU, map ID, supervisor flag and PC, and optionally the shadow call
+stack the trace callback keeps. Identical samples are counted in a hash table.
+
+On dump, this writes two files:
+- prefix.flat: samples per function, most-sampled first.
+- prefix.folded: one line per unique stack, as 'frame;frame;frame count'.
+  This can be fed to flamegraph.pl and similar tools.
+
+Supervisor addresses are resolved using the symbol file, if given. This can be
+a COFF executable (like /unix from the SysV disk image) or the output of 'nm'.
+User addresses are shown as map ID plus address, as every process has its own
+address space and we don't know what runs there.
+*/
+
+//Max stack frames recorded per sample (innermost ones are kept)
+#define MAX_DEPTH 64
+
+typedef struct {
+	uint32_t hash;
+	uint8_t cpu;
+	uint8_t super;
+	uint8_t mapid;
+	uint8_t depth;
+	uint32_t pc;
+	uint32_t *stack;
+	uint64_t count;
+} sample_t;
+
+typedef struct {
+	uint32_t addr;
+	char *name;
+} sym_t;
+
+typedef struct {
+	char *prefix;
+	int stacks;
+	sample_t *tab;		//open-addressing hash table
+	int tab_size;		//power of two
+	int n_used;
+	uint64_t total;
+	sym_t *sym;			//sorted by address
+	int n_sym;
+} prof_t;
+
+static prof_t *prof=NULL;
+
+static void add_sym(prof_t *p, uint32_t addr, const char *name, int len) {
+	p->sym=realloc(p->sym, sizeof(sym_t)*(p->n_sym+1));
+	p->sym[p->n_sym].addr=addr;
+	p->sym[p->n_sym].name=strndup(name, len);
+	p->n_sym++;
+}
+
+static uint32_t be32(const uint8_t *b) {
+	return (b[0]<<24)|(b[1]<<16)|(b[2]<<8)|b[3];
+}
+
+static uint16_t be16(const uint8_t *b) {
+	return (b[0]<<8)|b[1];
+}
+
+//COFF file header and symbol table entry sizes
+#define COFF_FHDR_SZ 20
+#define COFF_SYMENT_SZ 18
+#define COFF_C_EXT 2
+#define COFF_C_STAT 3
+
+//Load function symbols from a COFF executable. Returns 0 if it's not COFF.
+static int load_coff(prof_t *p, const uint8_t *f, long size) {
+	if (size<COFF_FHDR_SZ) return 0;
+	int magic=be16(&f[0]);
+	if (magic<0x150 || magic>0x152) return 0; //MC68MAGIC and friends
+	uint32_t symptr=be32(&f[8]);
+	uint32_t nsyms=be32(&f[12]);
+	if (symptr+(uint64_t)nsyms*COFF_SYMENT_SZ>size) return 0;
+	//The string table follows the symbols and starts with its own size, which
+	//offsets include. Bound it by the file size as well.
+	const uint8_t *strtab=&f[symptr+nsyms*COFF_SYMENT_SZ];
+	long strtab_sz=size-(strtab-f);
+	if (strtab_sz>=4 && be32(strtab)<strtab_sz) strtab_sz=be32(strtab);
+	if (strtab_sz<4) strtab_sz=0;
+	for (uint32_t i=0; i<nsyms; i++) {
+		const uint8_t *e=&f[symptr+i*COFF_SYMENT_SZ];
+		int scnum=(int16_t)be16(&e[12]);
+		int sclass=e[16];
+		int numaux=e[17];
+		if (scnum>0 && (sclass==COFF_C_EXT || sclass==COFF_C_STAT)) {
+			if (be32(&e[0])==0) {
+				//Long name in string table
+				uint32_t off=be32(&e[4]);
+				if (off>=4 && off<strtab_sz) add_sym(p, be32(&e[8]), (const char*)&strtab[off], strnlen((const char*)&strtab[off], strtab_sz-off));
+			} else {
+				add_sym(p, be32(&e[8]), (const char*)e, strnlen((const char*)e, 8));
+			}
+		}
+		i+=numaux;
+	}
+	return 1;
+}
+
+//Load symbols from 'nm' output: lines like '0001234 T _name'
+static void load_nm(prof_t *p, const char *f, long size) {
+	const char *end=f+size;
+	while (f<end) {
+		const char *eol=memchr(f, '\n', end-f);
+		if (!eol) eol=end;
+		char *a_end;
+		uint32_t addr=strtoul(f, &a_end, 16);
+		const char *t=a_end;
+		while (t<eol && *t==' ') t++;
+		if (a_end!=f && t+2<eol && strchr("TtWw", *t) && t[1]==' ') {
+			const char *n=t+2;
+			int len=eol-n;
+			while (len>0 && isspace(n[len-1])) len--;
+			add_sym(p, addr, n, len);
+		}
+		f=eol+1;
+	}
+}
+
+static int cmp_sym(const void *a, const void *b) {
+	const sym_t *sa=a, *sb=b;
+	if (sa->addr<sb->addr) return -1;
+	if (sa->addr>sb->addr) return 1;
+	return 0;
+}
+
+static int load_syms(prof_t *p, const char *filename) {
+	FILE *f=fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	long size=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size<=0) {
+		printf("%s: no symbols found\n", filename);
+		fclose(f);
+		return 0;
+	}
+	uint8_t *buf=malloc(size);
+	if (fread(buf, 1, size, f)!=size) {
+		perror(filename);
+		fclose(f);
+		free(buf);
+		return 0;
+	}
+	fclose(f);
+	if (!load_coff(p, buf, size)) load_nm(p, (const char*)buf, size);
+	free(buf);
+	if (p->n_sym==0) {
+		printf("%s: no symbols found\n", filename);
+		return 0;
+	}
+	qsort(p->sym, p->n_sym, sizeof(sym_t), cmp_sym);
+	return 1;
+}
+
+static void prof_free(prof_t *p) {
+	for (int i=0; i<p->n_sym; i++) free(p->sym[i].name);
+	free(p->sym);
+	free(p->tab);
+	free(p->prefix);
+	free(p);
+}
+
+int prof_init(const char *prefix, const char *symfile, int stacks) {
+	prof_t *p=calloc(sizeof(prof_t), 1);
+	p->prefix=strdup(prefix);
+	p->stacks=stacks;
+	p->tab_size=4096;
+	p->tab=calloc(sizeof(sample_t), p->tab_size);
+	if (symfile && !load_syms(p, symfile)) {
+		prof_free(p);
+		return 0;
+	}
+	prof=p;
+	return 1;
+}
+
+static uint32_t hash_sample(int cpu, int mapid, int super, uint32_t pc, const uint32_t *stack, int depth) {
+	//FNV-1a
+	uint32_t h=2166136261u;
+	h=(h^((cpu<<16)|(super<<8)|mapid))*16777619u;
+	h=(h^pc)*16777619u;
+	for (int i=0; i<depth; i++) h=(h^stack[i])*16777619u;
+	return h;
+}
+
+static sample_t *find_slot(sample_t *tab, int tab_size, uint32_t hash, int cpu, int mapid, int super,
+				uint32_t pc, const uint32_t *stack, int depth) {
+	int i=hash&(tab_size-1);
+	while (1) {
+		sample_t *s=&tab[i];
+		if (s->count==0) return s;
+		if (s->hash==hash && s->pc==pc && s->cpu==cpu && s->mapid==mapid && s->super==super &&
+				s->depth==depth && memcmp(s->stack, stack, depth*sizeof(uint32_t))==0) return s;
+		i=(i+1)&(tab_size-1);
+	}
+}
+
+static void grow(prof_t *p) {
+	int new_size=p->tab_size*2;
+	sample_t *n=calloc(sizeof(sample_t), new_size);
+	for (int i=0; i<p->tab_size; i++) {
+		sample_t *s=&p->tab[i];
+		if (s->count==0) continue;
+		*find_slot(n, new_size, s->hash, s->cpu, s->mapid, s->super, s->pc, s->stack, s->depth)=*s;
+	}
+	free(p->tab);
+	p->tab=n;
+	p->tab_size=new_size;
+}
+
+void prof_sample(int cpu, int mapid, int super, uint32_t pc, const int32_t *stack, int depth) {
+	prof_t *p=prof;
+	if (!p) return;
+	uint32_t st[MAX_DEPTH];
+	if (!p->stacks) depth=0;
+	if (depth>MAX_DEPTH) {
+		stack+=depth-MAX_DEPTH;
+		depth=MAX_DEPTH;
+	}
+	for (int i=0; i<depth; i++) st[i]=stack[i]&0xffffff;
+	pc&=0xffffff;
+	uint32_t h=hash_sample(cpu, mapid, super, pc, st, depth);
+	sample_t *s=find_slot(p->tab, p->tab_size, h, cpu, mapid, super, pc, st, depth);
+	if (s->count==0) {
+		s->hash=h;
+		s->cpu=cpu;
+		s->mapid=mapid;
+		s->super=super;
+		s->pc=pc;
+		s->depth=depth;
+		s->stack=NULL;
+		if (depth) {
+			s->stack=malloc(depth*sizeof(uint32_t));
+			memcpy(s->stack, st, depth*sizeof(uint32_t));
+		}
+		p->n_used++;
+	}
+	s->count++;
+	p->total++;
+	//Keep the load factor under 50%
+	if (p->n_used*2>p->tab_size) grow(p);
+}
+
+//Writes a readable name for an address to buf.
+static void addr_name(prof_t *p, int super, int mapid, uint32_t addr, char *buf, int len) {
+	if (!super) {
+		snprintf(buf, len, "map%d:0x%06x", mapid, addr);
+		return;
+	}
+	//Binary search for the last symbol <= addr
+	int lo=0, hi=p->n_sym-1, found=-1;
+	while (lo<=hi) {
+		int mid=(lo+hi)/2;
+		if (p->sym[mid].addr<=addr) {
+			found=mid;
+			lo=mid+1;
+		} else {
+			hi=mid-1;
+		}
+	}
+	if (found>=0) {
+		snprintf(buf, len, "%s", p->sym[found].name);
+	} else {
+		snprintf(buf, len, "0x%06x", addr);
+	}
+}
+
+typedef struct {
+	char *key;
+	uint64_t count;
+} line_t;
+
+static int cmp_line_key(const void *a, const void *b) {
+	return strcmp(((const line_t*)a)->key, ((const line_t*)b)->key);
+}
+
+static int cmp_line_count(const void *a, const void *b) {
+	const line_t *la=a, *lb=b;
+	if (la->count>lb->count) return -1;
+	if (la->count<lb->count) return 1;
+	return strcmp(la->key, lb->key);
+}
+
+//Sorts lines by key and merges the counts of identical keys. Returns new count.
+static int merge_lines(line_t *l, int n) {
+	qsort(l, n, sizeof(line_t), cmp_line_key);
+	int o=0;
+	for (int i=0; i<n; i++) {
+		if (o>0 && strcmp(l[o-1].key, l[i].key)==0) {
+			l[o-1].count+=l[i].count;
+			free(l[i].key);
+		} else {
+			l[o++]=l[i];
+		}
+	}
+	return o;
+}
+
+void prof_dump() {
+	prof_t *p=prof;
+	if (!p || p->total==0) return;
+	line_t *flat=malloc(sizeof(line_t)*p->n_used);
+	line_t *folded=malloc(sizeof(line_t)*p->n_used);
+	int n=0;
+	for (int i=0; i<p->tab_size; i++) {
+		sample_t *s=&p->tab[i];
+		if (s->count==0) continue;
+		char name[256];
+		addr_name(p, s->super, s->mapid, s->pc, name, sizeof(name));
+		char buf[300];
+		snprintf(buf, sizeof(buf), "%d %s %s", s->cpu, s->super?"sys ":"user", name);
+		flat[n].key=strdup(buf);
+		flat[n].count=s->count;
+		//Folded stack: cpu, mode, callers, leaf
+		int fl_len=64+(s->depth+1)*256;
+		char *fl=malloc(fl_len);
+		int pos=snprintf(fl, fl_len, "cpu%d;%s", s->cpu, s->super?"sys":"user");
+		for (int j=0; j<s->depth; j++) {
+			addr_name(p, s->super, s->mapid, s->stack[j], name, sizeof(name));
+			pos+=snprintf(fl+pos, fl_len-pos, ";%s", name);
+		}
+		addr_name(p, s->super, s->mapid, s->pc, name, sizeof(name));
+		snprintf(fl+pos, fl_len-pos, ";%s", name);
+		folded[n].key=fl;
+		folded[n].count=s->count;
+		n++;
+	}
+
+	char fname[strlen(p->prefix)+16];
+	sprintf(fname, "%s.flat", p->prefix);
+	FILE *f=fopen(fname, "w");
+	int nf=n;
+	if (f) {
+		nf=merge_lines(flat, n);
+		qsort(flat, nf, sizeof(line_t), cmp_line_count);
+		fprintf(f, "# %llu samples\n", (unsigned long long)p->total);
+		fprintf(f, "# samples      %%  cpu mode location\n");
+		for (int i=0; i<nf; i++) {
+			fprintf(f, "%9llu %6.2f%%  %s\n", (unsigned long long)flat[i].count, flat[i].count*100.0/p->total, flat[i].key);
+		}
+		fclose(f);
+	} else {
+		perror(fname);
+	}
+	for (int i=0; i<nf; i++) free(flat[i].key);
+	sprintf(fname, "%s.folded", p->prefix);
+	f=fopen(fname, "w");
+	nf=n;
+	if (f) {
+		nf=merge_lines(folded, n);
+		for (int i=0; i<nf; i++) {
+			fprintf(f, "%s %llu\n", folded[i].key, (unsigned long long)folded[i].count);
+		}
+		fclose(f);
+	} else {
+		perror(fname);
+	}
+	for (int i=0; i<nf; i++) free(folded[i].key);
+	free(flat);
+	free(folded);
+	printf("Profile with %llu samples written to %s.flat and %s.folded\n",
+		(unsigned long long)p->total, p->prefix, p->prefix);
+}
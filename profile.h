@@ -0,0 +1,18 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+//Start the profiler. Results are written to prefix.flat and prefix.folded.
+//symfile is a COFF executable or 'nm' output to resolve kernel addresses, or NULL.
+//If stacks is true, the shadow call stack is recorded with every sample.
+//Returns 0 on error.
+int prof_init(const char *prefix, const char *symfile, int stacks);
+
+//Record a sample. stack[0] is the outermost caller.
+void prof_sample(int cpu, int mapid, int super, uint32_t pc, const int32_t *stack, int depth);
+
+//Write the profile files.
+void prof_dump();
+
+#endif
@@ -10,6 +10,11 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "log.h"
 #include "ramrom.h"
 
@@ -17,6 +22,7 @@ struct ram_t {
 	int size_bytes;
 	int amask;		//if we AND an address with this, it will always fall into size_bytes
 	uint8_t *buffer;	//main memory storage
+	uint8_t *dirty;		//per RAM_PAGE_SIZE page: nonzero if written since ram_clear_dirty()
 };
 
 // Debug logging
@@ -29,6 +35,7 @@ void ram_write8(void *obj, unsigned int a, unsigned int val) {
 	ram_t *ram=(ram_t*)obj;
 	a=a&ram->amask;
 	ram->buffer[a]=val;
+	ram->dirty[a>>RAM_PAGE_SHIFT]=1;
 }
 
 void ram_write16(void *obj, unsigned int a, unsigned int val) {
@@ -36,6 +43,7 @@ void ram_write16(void *obj, unsigned int a, unsigned int val) {
 	a=a&ram->amask;
 	ram->buffer[a]=(val>>8);
 	ram->buffer[a+1]=val;
+	ram->dirty[a>>RAM_PAGE_SHIFT]=1;
 }
 
 void ram_write32(void *obj, unsigned int a, unsigned int val) {
@@ -45,6 +53,10 @@ void ram_write32(void *obj, unsigned int a, unsigned int val) {
 	ram->buffer[a+1]=(val>>16);
 	ram->buffer[a+2]=(val>>8);
 	ram->buffer[a+3]=val;
+	//The 68010 allows long accesses at any even address, so this can end in
+	//the next page.
+	ram->dirty[a>>RAM_PAGE_SHIFT]=1;
+	ram->dirty[((a+3)&ram->amask)>>RAM_PAGE_SHIFT]=1;
 }
 
 unsigned int ram_read8(void *obj, unsigned int a) {
@@ -65,15 +77,50 @@ unsigned int ram_read32(void *obj, unsigned int a) {
 	return ram->buffer[a+3]+(ram->buffer[a+2]<<8)+(ram->buffer[a+1]<<16)+(ram->buffer[a]<<24);
 }
 
+//Check if size is power of two, so addresses can be masked into the memory.
+static void check_size(int size_bytes) {
+	if (size_bytes & (size_bytes-1)) {
+		printf("ram_new: size should be power of two\n");
+		exit(0);
+	}
+}
+
+static ram_t *ram_alloc(int size_bytes, uint8_t *buffer) {
+	ram_t *ram=calloc(sizeof(ram_t), 1);
+	ram->size_bytes=size_bytes;
+	ram->amask=(size_bytes-1); //works if size_bytes is power of two, which we checked above
+	ram->buffer=buffer;
+	ram->dirty=calloc(ram_page_count(ram), 1);
+	return ram;
+}
+
+//ROMs are mapped read-only from their file, so all emulator instances on a
+//host share one copy in the page cache. Note that this means the ROM range
+//must never be written to. A file that is too small to fill the ROM can't be
+//mapped, as the part past its end would fault; that is read into memory.
 ram_t *rom_new(const char *filename, int size_bytes) {
-	FILE *f=fopen(filename, "rb");
-	if (!f) {
+	check_size(size_bytes);
+	int fd=open(filename, O_RDONLY);
+	if (fd<0) {
 		perror(filename);
 		exit(1);
 	}
+	struct stat st;
+	if (fstat(fd, &st)==0 && st.st_size>=size_bytes) {
+		void *p=mmap(NULL, size_bytes, PROT_READ, MAP_SHARED, fd, 0);
+		if (p!=MAP_FAILED) {
+			close(fd);
+			return ram_alloc(size_bytes, p);
+		}
+	}
 	ram_t *rom=ram_new(size_bytes);
-	int r=fread(rom->buffer, 1, size_bytes, f);
-	fclose(f);
+	int r=0;
+	while (r<size_bytes) {
+		int n=read(fd, rom->buffer+r, size_bytes-r);
+		if (n<=0) break;
+		r+=n;
+	}
+	close(fd);
 	if (r!=size_bytes) {
 		RAMROM_LOG_WARNING("%s: short read: %d bytes for rom region of %d bytes\n", filename, r, size_bytes);
 	}
@@ -81,15 +128,58 @@ ram_t *rom_new(const char *filename, int size_bytes) {
 }
 
 ram_t *ram_new(int size_bytes) {
-	//check if size is power of two
-	if (size_bytes & (size_bytes-1)) {
-		printf("ram_new: size should be power of two\n");
-		exit(0);
-	}
-	ram_t *ram=calloc(sizeof(ram_t), 1);
-	ram->size_bytes=size_bytes;
-	ram->amask=(size_bytes-1); //works if size_bytes is power of two, which we checked above
-	ram->buffer=calloc(size_bytes, 1);
-	return ram;
+	check_size(size_bytes);
+	return ram_alloc(size_bytes, calloc(size_bytes, 1));
 }
 
+ram_t *ram_new_buffer(int size_bytes) {
+	return ram_alloc(size_bytes, calloc(size_bytes, 1));
+}
+
+void ram_free_buffer(ram_t *ram) {
+	free(ram->buffer);
+	free(ram->dirty);
+	free(ram);
+}
+
+uint8_t *ram_buffer(ram_t *ram) {
+	return ram->buffer;
+}
+
+void ram_mark_dirty(ram_t *ram, int offset, int len) {
+	if (len<=0) return;
+	memset(&ram->dirty[offset>>RAM_PAGE_SHIFT], 1, ((offset+len-1)>>RAM_PAGE_SHIFT)-(offset>>RAM_PAGE_SHIFT)+1);
+}
+
+
+int ram_page_count(ram_t *ram) {
+	return (ram->size_bytes+RAM_PAGE_SIZE-1)/RAM_PAGE_SIZE;
+}
+
+int ram_page_dirty(ram_t *ram, int page) {
+	return ram->dirty[page];
+}
+
+uint8_t *ram_page_data(ram_t *ram, int page) {
+	return &ram->buffer[page*RAM_PAGE_SIZE];
+}
+
+int ram_page_len(ram_t *ram, int page) {
+	int len=ram->size_bytes-page*RAM_PAGE_SIZE;
+	return (len>RAM_PAGE_SIZE)?RAM_PAGE_SIZE:len;
+}
+
+void ram_clear_dirty(ram_t *ram) {
+	memset(ram->dirty, 0, ram_page_count(ram));
+}
+
+int ram_save(ram_t *ram, const char *filename) {
+	FILE *f=fopen(filename, "wb");
+	if (!f) {
+		perror(filename);
+		return 0;
+	}
+	int r=fwrite(ram->buffer, ram->size_bytes, 1, f);
+	fclose(f);
+	return r==1;
+}
@@ -1,3 +1,4 @@
+#include <stdint.h>
 
 typedef struct ram_t ram_t;
 
@@ -10,6 +11,30 @@ unsigned int ram_read16(void *obj, unsigned int a);
 unsigned int ram_read32(void *obj, unsigned int a);
 
 
+//Load a ROM from a file. The file is mapped read-only where possible, so the
+//ROM must never be written.
 ram_t *rom_new(const char *filename, int size);
 ram_t *ram_new(int size);
+//Memory that is only accessed through ram_buffer(), e.g. the contents of a
+//RAM disk. It can have any size, but can't be used with the access handlers.
+ram_t *ram_new_buffer(int size);
+void ram_free_buffer(ram_t *ram);
+uint8_t *ram_buffer(ram_t *ram);
+
+//Writes are tracked per page, for incremental checkpoints.
+#define RAM_PAGE_SHIFT 12
+#define RAM_PAGE_SIZE (1<<RAM_PAGE_SHIFT)
+int ram_page_count(ram_t *ram);
+//Returns true if the page was written since the last ram_clear_dirty().
+int ram_page_dirty(ram_t *ram, int page);
+//Returns the contents and size of a page. Only the last page of a memory
+//smaller than a page can be shorter than RAM_PAGE_SIZE.
+uint8_t *ram_page_data(ram_t *ram, int page);
+int ram_page_len(ram_t *ram, int page);
+void ram_clear_dirty(ram_t *ram);
+//Mark a range as written, for writes that don't go through the access handlers.
+void ram_mark_dirty(ram_t *ram, int offset, int len);
+
+//Write the contents of the memory to a file. Returns 0 on error.
+int ram_save(ram_t *ram, const char *filename);
 
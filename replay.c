@@ -0,0 +1,218 @@
+/*
+ Deterministic record and replay of emulator sessions.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+#include "emu.h"
+
+/*
+Given the same ROMs, disk and NVRAM, the emulated machine is deterministic:
+device timing is in emulated time and the RTC starts from its reset values.
+What is left is input from the host: characters typed on the console (or sent
+by a script) and received on host serial ports. When recording, every such
+character is written to the file together with the emulated cycle count and
+the port it arrived on. When replaying, the host side isn't looked at at all;
+instead a character is handed to the guest at the exact cycle it was received
+when recording.
+
+The file also has the NVRAM contents (restored when replaying), hashes of the
+disk contents and, every emulated second, a hash of the CPU state. Those are
+checked while replaying so a divergence is noticed when it happens rather than
+as a weird difference much later.
+
+File format: "PLXREP1\n" followed by records of a rec_hdr_t plus len bytes of
+payload. The payload is the character for REC_INPUT, a name plus a 64-bit value
+for REC_CHECK, a name plus the data for REC_BLOB, and nothing for REC_END.
+Names are zero-terminated. All values are in host byte order.
+*/
+
+#define REPLAY_MAGIC "PLXREP1\n"
+
+enum {
+	REC_INPUT=0,
+	REC_CHECK,
+	REC_BLOB,
+	REC_END
+};
+
+typedef struct {
+	uint64_t cycles;
+	uint8_t type;
+	uint8_t port;
+	uint16_t len;
+} rec_hdr_t;
+
+#define MAX_PAYLOAD 1024
+
+static FILE *recf=NULL;
+static FILE *playf=NULL;
+//Next record when replaying. head_valid is false when the file has ended.
+static rec_hdr_t head;
+static uint8_t head_data[MAX_PAYLOAD];
+static int head_valid=0;
+static int diverged=0;
+
+static void write_rec(int type, int port, const void *data, int len) {
+	rec_hdr_t h={
+		.cycles=emu_get_cycles(),
+		.type=type,
+		.port=port,
+		.len=len
+	};
+	fwrite(&h, sizeof(h), 1, recf);
+	if (len) fwrite(data, len, 1, recf);
+}
+
+static void record_end() {
+	write_rec(REC_END, 0, NULL, 0);
+	fclose(recf);
+	recf=NULL;
+}
+
+int replay_record(const char *filename) {
+	recf=fopen(filename, "wb");
+	if (!recf) {
+		perror(filename);
+		return 0;
+	}
+	fwrite(REPLAY_MAGIC, 8, 1, recf);
+	atexit(record_end);
+	return 1;
+}
+
+static void next_rec() {
+	head_valid=0;
+	if (fread(&head, sizeof(head), 1, playf)!=1) return;
+	if (head.len>MAX_PAYLOAD || (head.len && fread(head_data, head.len, 1, playf)!=1)) {
+		printf("Replay: record file is corrupt\n");
+		return;
+	}
+	head_valid=1;
+}
+
+int replay_play(const char *filename) {
+	playf=fopen(filename, "rb");
+	if (!playf) {
+		perror(filename);
+		return 0;
+	}
+	char magic[8];
+	if (fread(magic, 8, 1, playf)!=1 || memcmp(magic, REPLAY_MAGIC, 8)!=0) {
+		printf("%s: not a record file\n", filename);
+		fclose(playf);
+		playf=NULL;
+		return 0;
+	}
+	next_rec();
+	return 1;
+}
+
+int replay_recording() {
+	return recf!=NULL;
+}
+
+int replay_playing() {
+	return playf!=NULL;
+}
+
+static void report_divergence(const char *what) {
+	if (diverged) return;
+	diverged=1;
+	printf("\nReplay: diverged from the recording at cycle %llu (%s)\n",
+			(unsigned long long)emu_get_cycles(), what);
+}
+
+int replay_input(int port, int c) {
+	if (recf) {
+		if (c>=0) {
+			uint8_t b=c;
+			write_rec(REC_INPUT, port, &b, 1);
+		}
+		return c;
+	}
+	if (!playf) return c;
+	if (!head_valid || head.type!=REC_INPUT || head.port!=port) return -1;
+	uint64_t now=emu_get_cycles();
+	if (head.cycles>now) return -1;
+	if (head.cycles<now) report_divergence("late input");
+	int r=head_data[0];
+	next_rec();
+	return r;
+}
+
+//Build a name-plus-data payload.
+static int make_payload(uint8_t *buf, const char *name, const void *data, int len) {
+	int nlen=strlen(name)+1;
+	if (nlen+len>MAX_PAYLOAD) {
+		printf("Replay: %s too large to record\n", name);
+		exit(1);
+	}
+	memcpy(buf, name, nlen);
+	memcpy(buf+nlen, data, len);
+	return nlen+len;
+}
+
+//Returns true if the head record has the given type and name.
+static int head_is(int type, const char *name) {
+	return head_valid && head.type==type && strcmp((char*)head_data, name)==0;
+}
+
+void replay_blob(const char *name, uint8_t *buf, int len) {
+	uint8_t p[MAX_PAYLOAD];
+	if (recf) {
+		write_rec(REC_BLOB, 0, p, make_payload(p, name, buf, len));
+	} else if (playf) {
+		int nlen=strlen(name)+1;
+		if (!head_is(REC_BLOB, name) || head.len!=nlen+len) {
+			report_divergence(name);
+			return;
+		}
+		memcpy(buf, head_data+nlen, len);
+		next_rec();
+	}
+}
+
+void replay_check(const char *name, uint64_t val) {
+	uint8_t p[MAX_PAYLOAD];
+	if (recf) {
+		write_rec(REC_CHECK, 0, p, make_payload(p, name, &val, sizeof(val)));
+		fflush(recf);
+	} else if (playf) {
+		if (!head_is(REC_CHECK, name)) {
+			report_divergence(name);
+			return;
+		}
+		uint64_t rval;
+		memcpy(&rval, head_data+strlen(name)+1, sizeof(rval));
+		if (rval!=val) report_divergence(name);
+		next_rec();
+	}
+}
+
+//If a record is this many cycles overdue, the replay has diverged so much that
+//the guest won't ever get to it.
+#define STALE_CYCLES 100000000ULL
+
+void replay_tick() {
+	if (!playf) return;
+	if (head_valid && head.type!=REC_END) {
+		if (head.cycles+STALE_CYCLES<emu_get_cycles()) {
+			report_divergence("input not taken");
+			next_rec();
+		}
+		return;
+	}
+	if (head_valid && emu_get_cycles()<head.cycles) return;
+	printf("\nReplay: end of recording reached at cycle %llu%s\n",
+			(unsigned long long)emu_get_cycles(), diverged?", but the replay diverged":"");
+	exit(diverged?1:0);
+}
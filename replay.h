@@ -0,0 +1,45 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+//Start recording all external inputs to a file. Returns 0 on error.
+int replay_record(const char *filename);
+
+//Start replaying the inputs recorded in a file. Returns 0 on error.
+int replay_play(const char *filename);
+
+//Returns true if recording or replaying, respectively.
+int replay_recording();
+int replay_playing();
+
+//Host side input for serial port 'port' (numbered like the -s option). When
+//recording, records c if it is a character. When replaying, returns the
+//recorded character for this moment, or -1.
+int replay_input(int port, int c);
+
+//Initial state the emulator gets from the host, e.g. NVRAM contents. When
+//recording, this is stored; when replaying, buf is overwritten with the
+//stored contents.
+void replay_blob(const char *name, uint8_t *buf, int len);
+
+//A value that must be the same when replaying, e.g. a hash of the disk contents
+//or of the CPU state. When replaying, a mismatch is reported.
+void replay_check(const char *name, uint64_t val);
+
+//Call regularly from the main loop. Ends a replay when it reaches the point
+//where the recording ended.
+void replay_tick();
+
+//FNV-1a, for hashing state that goes into replay_check.
+#define REPLAY_HASH_INIT 0xcbf29ce484222325ULL
+static inline uint64_t replay_hash(uint64_t h, const void *data, int len) {
+	const uint8_t *p=(const uint8_t*)data;
+	for (int i=0; i<len; i++) {
+		h^=p[i];
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+#endif
@@ -210,3 +210,10 @@ void rtc_tick(rtc_t *r, int ticklen_us) {
 	}
 }
 
+void rtc_ckpt_save(rtc_t *r, ckpt_t *c) {
+	ckpt_put(c, "rtc", r, sizeof(rtc_t));
+}
+
+int rtc_ckpt_load(rtc_t *r, ckpt_t *c) {
+	return ckpt_get(c, "rtc", r, sizeof(rtc_t));
+}
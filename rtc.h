@@ -1,4 +1,6 @@
 
+#include "checkpoint.h"
+
 typedef struct rtc_t rtc_t;
 
 //Memory range access handlers
@@ -12,3 +14,7 @@ rtc_t *rtc_new();
 
 //Call this periodically to make the RTC tick.
 void rtc_tick(rtc_t *r, int ticklen_us);
+
+//Save or restore the RTC state in a checkpoint.
+void rtc_ckpt_save(rtc_t *r, ckpt_t *c);
+int rtc_ckpt_load(rtc_t *r, ckpt_t *c);
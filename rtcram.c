@@ -17,6 +17,9 @@ Copyright (c) 2024 Ewen McNeill <ewen@naos.co.nz>
 #include "log.h"
 #include "rtcram.h"
 #include "emscripten_env.h"
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
 
 // Debug logging (shared with the RTC clock portion)
 #define RTC_LOG(msg_level, format_and_args...) \
@@ -37,21 +40,27 @@ unsigned char rtcram_default_contents[] = {
   0x00, 0x00, 0x00, 0x00
 };
 
+// The guest tends to write the NVRAM a byte at a time. Rather than rewriting the
+// file for every byte, we persist it once writes have stopped for this long
+// (in emulated time).
+#define RTCRAM_FLUSH_DELAY_US 100000
+
 struct rtcram_t {
-	uint8_t reg[64];
+	uint8_t reg[RTCRAM_SIZE];
 	const char *filename;
+	int dirty;			// True if reg has changes that are not in the file yet
+	int us_since_write;	// Emulated time since the last write
 };
 
-void rtcram_write8(void *obj, unsigned int a, unsigned int val) {
-	rtcram_t *r=(rtcram_t*)obj;
+// Only one NVRAM, so we can keep it around for the atexit handler.
+static rtcram_t *rtcram_inst=NULL;
+
+void rtcram_flush(rtcram_t *r) {
 	FILE *rtcramfile = NULL;
 	size_t written = 0;
 
-	a=a/2; //rtc is on odd addresses
-	assert(a < sizeof(r->reg));
-
-	r->reg[a]=val;
-	RTC_LOG_DEBUG("RTC: wrote 0x%02x to RAM position 0x%02x\n", val, a);
+	if (!r->dirty) return;
+	r->dirty = 0;
 
 	if ((rtcramfile = fopen(r->filename, "wb"))) {
 		written = fwrite(r->reg, sizeof(r->reg), 1, rtcramfile);
@@ -64,8 +73,45 @@ void rtcram_write8(void *obj, unsigned int a, unsigned int val) {
 		RTC_LOG_WARNING("RTC: Failed to persist RTC RAM to %s\n", r->filename);
 	}
 #ifdef __EMSCRIPTEN__
-	emscripten_syncfs();
+	emscripten_syncfs_request();
+#endif
+}
+
+void rtcram_set_filename(rtcram_t *r, const char *filename) {
+	free((char*)r->filename);
+	r->filename=strdup(filename);
+	r->dirty=1;
+	r->us_since_write=0;
+}
+
+static void rtcram_flush_at_exit() {
+	rtcram_flush(rtcram_inst);
+}
+
+#ifdef __EMSCRIPTEN__
+// Called when the page is hidden or unloaded, as the flush delay may not
+// run out anymore.
+EMSCRIPTEN_KEEPALIVE void rtcram_flush_pending() {
+	if (rtcram_inst) rtcram_flush(rtcram_inst);
+}
 #endif
+
+void rtcram_write8(void *obj, unsigned int a, unsigned int val) {
+	rtcram_t *r=(rtcram_t*)obj;
+
+	a=a/2; //rtc is on odd addresses
+	assert(a < sizeof(r->reg));
+
+	r->reg[a]=val;
+	r->dirty=1;
+	r->us_since_write=0;
+	RTC_LOG_DEBUG("RTC: wrote 0x%02x to RAM position 0x%02x\n", val, a);
+}
+
+void rtcram_tick(rtcram_t *r, int ticklen_us) {
+	if (!r->dirty) return;
+	r->us_since_write+=ticklen_us;
+	if (r->us_since_write>=RTCRAM_FLUSH_DELAY_US) rtcram_flush(r);
 }
 
 void rtcram_write16(void *obj, unsigned int a, unsigned int val) {
@@ -102,6 +148,14 @@ unsigned int rtcram_read32(void *obj, unsigned int a) {
 	        ((rtcram_read8(obj, a+3) & 0xFFFF)));
 }
 
+void rtcram_get_contents(rtcram_t *r, uint8_t *buf) {
+	memcpy(buf, r->reg, sizeof(r->reg));
+}
+
+void rtcram_set_contents(rtcram_t *r, const uint8_t *buf) {
+	memcpy(r->reg, buf, sizeof(r->reg));
+}
+
 rtcram_t *rtcram_new(const char *filename) {
 	rtcram_t *r=calloc(sizeof(rtcram_t), 1);
 	r->filename=strdup(filename);
@@ -122,5 +176,7 @@ rtcram_t *rtcram_new(const char *filename) {
 				r->filename);
 	}
 
+	rtcram_inst=r;
+	atexit(rtcram_flush_at_exit);
 	return r;
 }
@@ -1,6 +1,8 @@
 #ifndef RTCRAM_H
 #define RTCRAM_H
 
+#include <stdint.h>
+
 typedef struct rtcram_t rtcram_t;
 
 //Memory range access handlers
@@ -13,4 +15,17 @@ unsigned int rtcram_read32(void *obj, unsigned int a);
 
 rtcram_t *rtcram_new(const char *filename);
 
+//Call this periodically; persists the NVRAM after it has been written to.
+void rtcram_tick(rtcram_t *r, int ticklen_us);
+//Write pending changes to the NVRAM file now.
+void rtcram_flush(rtcram_t *r);
+//Persist the NVRAM to a different file from now on, starting with the current contents.
+void rtcram_set_filename(rtcram_t *r, const char *filename);
+
+//Size of the NVRAM, in bytes.
+#define RTCRAM_SIZE 64
+//Get or replace the NVRAM contents. Replacing them does not write the file.
+void rtcram_get_contents(rtcram_t *r, uint8_t *buf);
+void rtcram_set_contents(rtcram_t *r, const uint8_t *buf);
+
 #endif
@@ -0,0 +1,269 @@
+/*
+ Expect-style scripting of the console, for unattended runs.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "script.h"
+#include "emu.h"
+#include "uart.h"
+
+/*
+A script is a text file with one command per line. Empty lines and lines
+starting with '#' are ignored. Strings are given in double quotes and can use
+\r, \n, \t, \e, \\, \" and \xNN escapes. Commands:
+
+expect "str"	Wait until the guest has printed str. Matching is done against all
+				console output since the previous match, so output printed before
+				the expect is reached isn't missed.
+send "str"		Type str into the console.
+delay ms		Wait for the given amount of emulated time.
+timeout s		Fail an expect if it isn't matched within s seconds of emulated
+				time. 0 (the default) waits forever.
+mark name		Print the emulated and host time since start and since the previous
+				mark to stderr.
+exit n			Exit the emulator with status n. Reaching the end of the script is
+				the same as 'exit 0'. A timed out expect exits with status 2.
+
+All timing is done in emulated time, so scripts behave the same regardless of
+the speed of the host.
+*/
+
+enum {
+	CMD_EXPECT=0,
+	CMD_SEND,
+	CMD_DELAY,
+	CMD_TIMEOUT,
+	CMD_MARK,
+	CMD_EXIT
+};
+
+typedef struct {
+	int type;
+	char *str;		//expect/send string, mark name
+	int len;		//length of str (can contain zeroes)
+	int val;		//delay/timeout/exit value
+	int line;
+} cmd_t;
+
+typedef struct {
+	cmd_t *cmd;
+	int n_cmd;
+	int pc;				//current command
+	int started;		//true if the current command has started executing
+	uint64_t cmd_start_us;	//emulated time the current command started
+	uint64_t timeout_us;
+	const char *send_str;	//string being typed
+	int send_left;
+	uart_match_t match;		//console output not yet matched by an expect
+	int matched;		//set when the current expect is matched
+	uint64_t mark_emu_us;	//emulated and host time at the previous mark
+	double mark_host_s;
+	double start_host_s;
+} script_t;
+
+static script_t *script=NULL;
+
+static void script_console_out(char c);
+
+static double host_time_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int hexval(char c) {
+	if (c>='0' && c<='9') return c-'0';
+	if (c>='a' && c<='f') return c-'a'+10;
+	if (c>='A' && c<='F') return c-'A'+10;
+	return -1;
+}
+
+//Parse a quoted string with escapes. Returns length or -1 on error.
+static int parse_string(const char *p, char **out) {
+	while (isspace(*p)) p++;
+	if (*p!='"') return -1;
+	p++;
+	char *buf=malloc(strlen(p)+1);
+	int len=0;
+	while (*p && *p!='"') {
+		if (*p=='\\') {
+			p++;
+			if (*p=='r') buf[len++]='\r';
+			else if (*p=='n') buf[len++]='\n';
+			else if (*p=='t') buf[len++]='\t';
+			else if (*p=='e') buf[len++]=0x1b;
+			else if (*p=='x' && hexval(p[1])>=0 && hexval(p[2])>=0) {
+				buf[len++]=hexval(p[1])*16+hexval(p[2]);
+				p+=2;
+			} else if (*p) buf[len++]=*p;
+			else break;
+			p++;
+		} else {
+			buf[len++]=*p++;
+		}
+	}
+	if (*p!='"' || len==0) {
+		free(buf);
+		return -1;
+	}
+	*out=buf;
+	return len;
+}
+
+int script_load(const char *filename) {
+	FILE *f=fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return 0;
+	}
+	script_t *s=calloc(sizeof(script_t), 1);
+	char line[1024];
+	int lineno=0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char *p=line;
+		while (isspace(*p)) p++;
+		if (*p==0 || *p=='#') continue;
+		char *arg=p;
+		while (*arg && !isspace(*arg)) arg++;
+		int kwlen=arg-p;
+		while (isspace(*arg)) arg++;
+		//strip trailing whitespace
+		char *e=arg+strlen(arg);
+		while (e>arg && isspace(e[-1])) *--e=0;
+
+		cmd_t c={.line=lineno};
+		int ok=1;
+		if (kwlen==6 && strncmp(p, "expect", 6)==0) {
+			c.type=CMD_EXPECT;
+			c.len=parse_string(arg, &c.str);
+			ok=(c.len>0 && c.len<=UART_MATCH_MAX);
+		} else if (kwlen==4 && strncmp(p, "send", 4)==0) {
+			c.type=CMD_SEND;
+			c.len=parse_string(arg, &c.str);
+			ok=(c.len>0);
+		} else if (kwlen==5 && strncmp(p, "delay", 5)==0) {
+			c.type=CMD_DELAY;
+			c.val=atoi(arg);
+			ok=isdigit(*arg);
+		} else if (kwlen==7 && strncmp(p, "timeout", 7)==0) {
+			c.type=CMD_TIMEOUT;
+			c.val=atoi(arg);
+			ok=isdigit(*arg);
+		} else if (kwlen==4 && strncmp(p, "mark", 4)==0) {
+			c.type=CMD_MARK;
+			c.str=strdup(arg);
+			ok=(*arg!=0);
+		} else if (kwlen==4 && strncmp(p, "exit", 4)==0) {
+			c.type=CMD_EXIT;
+			c.val=atoi(arg);
+		} else {
+			ok=0;
+		}
+		if (!ok) {
+			printf("%s:%d: syntax error\n", filename, lineno);
+			fclose(f);
+			return 0;
+		}
+		s->cmd=realloc(s->cmd, sizeof(cmd_t)*(s->n_cmd+1));
+		s->cmd[s->n_cmd++]=c;
+	}
+	fclose(f);
+	s->start_host_s=host_time_s();
+	s->mark_host_s=s->start_host_s;
+	script=s;
+	uart_console_add_hook(script_console_out);
+	return 1;
+}
+
+int script_active() {
+	return script!=NULL;
+}
+
+static void script_console_out(char c) {
+	script_t *s=script;
+	cmd_t *cmd=NULL;
+	if (!s->matched && s->pc<s->n_cmd && s->started && s->cmd[s->pc].type==CMD_EXPECT) {
+		cmd=&s->cmd[s->pc];
+	}
+	//Only need to check the tail, as the rest was checked when the expect started.
+	if (uart_match_add(&s->match, c, cmd?cmd->str:NULL, cmd?cmd->len:0)) {
+		s->matched=1;
+		uart_match_clear(&s->match);
+	}
+}
+
+int script_getc() {
+	script_t *s=script;
+	if (!s || s->send_left==0) return -1;
+	s->send_left--;
+	return (uint8_t)*s->send_str++;
+}
+
+//Starts an expect: checks if the output we already have matches.
+//Whatever came after the match is kept for the next expect.
+static void start_expect(script_t *s, cmd_t *cmd) {
+	s->matched=uart_match_find(&s->match, cmd->str, cmd->len);
+}
+
+static void do_exit(int code) {
+	fflush(stdout);
+	fprintf(stderr, "\nscript: exit %d after %.3f s emulated, %.3f s host\n", code,
+		emu_get_time_us()/1e6, host_time_s()-script->start_host_s);
+	exit(code);
+}
+
+void script_tick() {
+	script_t *s=script;
+	if (!s) return;
+	uint64_t now=emu_get_time_us();
+	while (1) {
+		if (s->pc>=s->n_cmd) do_exit(0);
+		cmd_t *cmd=&s->cmd[s->pc];
+		if (!s->started) {
+			s->started=1;
+			s->cmd_start_us=now;
+			if (cmd->type==CMD_EXPECT) start_expect(s, cmd);
+		}
+		if (cmd->type==CMD_EXPECT) {
+			if (!s->matched) {
+				if (s->timeout_us && now-s->cmd_start_us>=s->timeout_us) {
+					fprintf(stderr, "\nscript: line %d: timeout waiting for \"%.*s\"\n", cmd->line, cmd->len, cmd->str);
+					do_exit(2);
+				}
+				return;
+			}
+		} else if (cmd->type==CMD_SEND) {
+			//Wait until the previous send has been typed.
+			if (s->send_left) return;
+			s->send_str=cmd->str;
+			s->send_left=cmd->len;
+		} else if (cmd->type==CMD_DELAY) {
+			if (now-s->cmd_start_us<(uint64_t)cmd->val*1000) return;
+		} else if (cmd->type==CMD_TIMEOUT) {
+			s->timeout_us=(uint64_t)cmd->val*1000000;
+		} else if (cmd->type==CMD_MARK) {
+			double host=host_time_s();
+			fflush(stdout);
+			fprintf(stderr, "\nscript: mark %s: emulated %.3f s (+%.3f s), host %.3f s (+%.3f s)\n",
+				cmd->str, now/1e6, (now-s->mark_emu_us)/1e6,
+				host-s->start_host_s, host-s->mark_host_s);
+			s->mark_emu_us=now;
+			s->mark_host_s=host;
+		} else if (cmd->type==CMD_EXIT) {
+			do_exit(cmd->val);
+		}
+		s->pc++;
+		s->started=0;
+	}
+}
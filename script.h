@@ -0,0 +1,16 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+//Load an expect-style console script. Returns 0 on error.
+int script_load(const char *filename);
+
+//Returns true if a script is running.
+int script_active();
+
+//Returns the next character the script wants to type into the console, or -1.
+int script_getc();
+
+//Call periodically to handle delays, timeouts and advancing the script.
+void script_tick();
+
+#endif
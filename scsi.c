@@ -13,10 +13,12 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stddef.h>
 #include "scsi.h"
 #include "emu.h"
 #include "log.h"
 #include "int.h"
+#include "stats.h"
 
 // Debug logging
 #define SCSI_LOG(msg_level, format_and_args...) \
@@ -186,7 +188,7 @@ static void scsi_pointer_int(int flags, int ena) {
 //enough to make the diags happy (diags run with O_SCSIRST asserted, so we can
 //detect that), the other implements actual SCSI transactions.
 void scsi_set_scsireg(scsi_t *s, unsigned int val) {
-	if (val!=s->reg) {
+	if (val!=s->reg && log_level_active(LOG_SRC_SCSI, LOG_DEBUG)) {
 		SCSI_LOG_DEBUG("SCSI w: reg ");
 		for (int i=0; i<16; i++) {
 			if (val&(1<<(15-i))) SCSI_LOG_DEBUG("%s ", bit_str[i]);
@@ -334,6 +336,7 @@ void scsi_set_scsireg(scsi_t *s, unsigned int val) {
 		int dir=0;
 		if (s->dev[s->selected]) {
 			dir=s->dev[s->selected]->handle_cmd(s->dev[s->selected], s->cmd, s->bytecount);
+			emu_stats.scsi_cmds++;
 		}
 		//put id of selected device on bus so resel works
 		s->buf[2]=0; s->buf[3]=(1<<s->selected)|(1<<3);
@@ -363,6 +366,7 @@ void scsi_set_scsireg(scsi_t *s, unsigned int val) {
 		int len=0;
 		if (s->dev[s->selected]) {
 			len=s->dev[s->selected]->handle_data_in(s->dev[s->selected], s->databuf, s->bytecount);
+			emu_stats.scsi_bytes_in+=len;
 		}
 		SCSI_LOG_DEBUG("SCSI: Data from dev: ");
 		for (int i=0; i<len; i++) {
@@ -399,6 +403,7 @@ void scsi_set_scsireg(scsi_t *s, unsigned int val) {
 		SCSI_LOG_DEBUG("\n");
 		if (s->dev[s->selected]) {
 			s->dev[s->selected]->handle_data_out(s->dev[s->selected], s->databuf, len);
+			emu_stats.scsi_bytes_out+=len;
 		}
 		//next state sets us up for status
 		val|=O_SCSICD|O_SCSIIO|O_CDPTR|O_SRAM;
@@ -469,11 +474,13 @@ unsigned int scsi_get_scsireg(scsi_t *s) {
 	ret=s->reg;
 
 //	dump_cpu_state();
-	SCSI_LOG_DEBUG("SCSI r: reg ");
-	for (int i=0; i<16; i++) {
-		if (ret&(1<<(15-i))) SCSI_LOG_DEBUG("%s ", bit_str[i]);
+	if (log_level_active(LOG_SRC_SCSI, LOG_DEBUG)) {
+		SCSI_LOG_DEBUG("SCSI r: reg ");
+		for (int i=0; i<16; i++) {
+			if (ret&(1<<(15-i))) SCSI_LOG_DEBUG("%s ", bit_str[i]);
+		}
+		SCSI_LOG_DEBUG("\n");
 	}
-	SCSI_LOG_DEBUG("\n");
 
 	return ret;
 }
@@ -529,3 +536,27 @@ void scsi_add_dev(scsi_t *sc, scsi_dev_t *dev, int id) {
 	sc->dev[id]=dev;
 }
 
+//Everything from buf up to databuf is plain state.
+#define SCSI_STATE_START offsetof(scsi_t, buf)
+#define SCSI_STATE_LEN (offsetof(scsi_t, databuf)-SCSI_STATE_START)
+
+void scsi_ckpt_save(scsi_t *s, ckpt_t *c) {
+	ckpt_put(c, "scsi", (uint8_t*)s+SCSI_STATE_START, SCSI_STATE_LEN);
+	for (int i=0; i<8; i++) {
+		if (!s->dev[i] || !s->dev[i]->ckpt_save) continue;
+		char name[16];
+		sprintf(name, "scsidev%d", i);
+		s->dev[i]->ckpt_save(s->dev[i], c, name);
+	}
+}
+
+int scsi_ckpt_load(scsi_t *s, ckpt_t *c) {
+	if (!ckpt_get(c, "scsi", (uint8_t*)s+SCSI_STATE_START, SCSI_STATE_LEN)) return 0;
+	for (int i=0; i<8; i++) {
+		if (!s->dev[i] || !s->dev[i]->ckpt_load) continue;
+		char name[16];
+		sprintf(name, "scsidev%d", i);
+		if (!s->dev[i]->ckpt_load(s->dev[i], c, name)) return 0;
+	}
+	return 1;
+}
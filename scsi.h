@@ -1,5 +1,7 @@
 #pragma once
 
+#include "checkpoint.h"
+
 typedef struct scsi_t scsi_t;
 
 typedef struct scsi_dev_t scsi_dev_t;
@@ -15,6 +17,10 @@ struct scsi_dev_t {
 	int (*handle_data_in)(scsi_dev_t *dev, uint8_t *msg, int buflen);
 	void (*handle_data_out)(scsi_dev_t *dev, uint8_t *msg, int len);
 	int (*handle_status)(scsi_dev_t *dev);
+	//Optional: save or restore the command in progress in a checkpoint section
+	//with the given name. ckpt_load returns 0 on error.
+	void (*ckpt_save)(scsi_dev_t *dev, ckpt_t *c, const char *name);
+	int (*ckpt_load)(scsi_dev_t *dev, ckpt_t *c, const char *name);
 };
 
 //Memory range access handlers for the SCSI buffer.
@@ -45,3 +51,8 @@ void scsi_tick(scsi_t *r, int ticklen_us);
 #define SCSI_DIAG_PARITY 0x2
 void scsi_set_diag(scsi_t *s, int flags);
 
+//Save or restore the SCSI controller state in a checkpoint, including the
+//command state of the devices. Transfers finish immediately, so the data buffer
+//doesn't need to be saved.
+void scsi_ckpt_save(scsi_t *s, ckpt_t *c);
+int scsi_ckpt_load(scsi_t *s, ckpt_t *c);
@@ -7,16 +7,28 @@ SPDX-License-Identifier: MIT
 Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "scsi.h"
 #include "emu.h"
 #include "log.h"
 #include "emscripten_env.h"
+#include "cimg.h"
+
+// Debug logging
+#define SCSI_LOG(msg_level, format_and_args...) \
+	log_printf(LOG_SRC_SCSI, msg_level, format_and_args)
+#define SCSI_LOG_INFO(format_and_args...)   SCSI_LOG(LOG_INFO,   format_and_args)
 
 /*
 This can take a directory for copy-on-write storage. The idea is that there
@@ -25,17 +37,44 @@ as a sector is written, a file is created in the COW directory with the LBA
 of the sector in the name; data is written there. On a read, the code first 
 checks if such a file exists and if so it returns the data from there.
 If it does not, it falls back to returning data from the base image.
+
+COW directories can be stacked: there can be any number of read-only layers
+between the base image and the writable COW directory, e.g. a golden image
+plus a layer of per-site customizations shared by many instances. Every layer
+is a directory in the same format as the writable one. When the device is
+created, each layer directory is scanned once to build a presence index, and
+from those an owner table is made that says, for every LBA, which layer holds
+the newest copy of that sector. That way a read only opens the one file that
+actually has the data.
+
+The base image can also be a compressed image (see cimg.c). As those are
+read-only, they can only be used together with a COW directory.
 */
 
 //Might need to change if e.g. the backing file changes for the web version.
 #define COW_VERSION_MAJOR 0
 #define COW_VERSION_MINOR 0
 
+//Max amount of COW layers, including the writable top one.
+#define HD_MAX_LAYERS 64
+
+typedef struct {
+	char *dir;
+	uint8_t *present;	//Presence index: bitmap of LBAs that have a file in this layer
+} cow_layer_t;
+
 typedef struct {
 	scsi_dev_t dev;
+	char *imagename;
 	FILE *hdfile;
+	cimg_t *cimg;		//If not NULL, the base image is a compressed image
+	uint8_t *map;		//If not NULL, the read-only base image is mapped here
+	uint64_t map_size;
 	uint8_t cmd[10];
-	char *cow_dir;
+	int n_layers;		//Amount of COW layers. If nonzero, the top one is writable.
+	cow_layer_t layer[HD_MAX_LAYERS];
+	uint8_t *owner;		//For every LBA: 0 if the base image has the data, otherwise layer idx+1
+	int n_lbas;			//Size of the owner table and presence indexes, in LBAs
 } scsi_hd_t;
 
 
@@ -51,18 +90,76 @@ static const uint8_t sense[]={
 	0,0,0,0	//sense key specific
 };
 
-//Open the COW file for a given LBA. Open it with the mode indicated.
-static FILE *open_cow_file(scsi_hd_t *hd, int lba, const char *mode) {
+//Make sure the owner table and presence indexes can hold the given LBA.
+static void ensure_lba(scsi_hd_t *hd, int lba) {
+	if (lba<hd->n_lbas) return;
+	int n=hd->n_lbas?hd->n_lbas:1024;
+	while (n<=lba) n*=2;
+	//keep presence bitmaps a whole number of bytes
+	n=(n+7)&~7;
+	hd->owner=realloc(hd->owner, n);
+	memset(&hd->owner[hd->n_lbas], 0, n-hd->n_lbas);
+	for (int l=0; l<hd->n_layers; l++) {
+		hd->layer[l].present=realloc(hd->layer[l].present, n/8);
+		memset(&hd->layer[l].present[hd->n_lbas/8], 0, (n-hd->n_lbas)/8);
+	}
+	hd->n_lbas=n;
+}
+
+static int layer_has(scsi_hd_t *hd, int l, int lba) {
+	return (hd->layer[l].present[lba/8]>>(lba&7))&1;
+}
+
+//Open the COW file for a given LBA in the given layer. Open it with the mode indicated.
+static FILE *open_cow_file(scsi_hd_t *hd, int l, int lba, const char *mode) {
 	char buf[1024];
-	snprintf(buf, sizeof(buf), "%s/cow-data-%06d.bin", hd->cow_dir, lba);
+	snprintf(buf, sizeof(buf), "%s/cow-data-%06d.bin", hd->layer[l].dir, lba);
 	FILE *f=fopen(buf, mode);
 	return f;
 }
 
+//Returns the LBA of a COW file name (cow-data-NNNNNN.bin), or -1 if it isn't one.
+static int cow_file_lba(const char *name) {
+	int lba, n=0;
+	if (strncmp(name, "cow-data-", 9)!=0 || !isdigit((unsigned char)name[9])) return -1;
+	if (sscanf(name, "cow-data-%d%n", &lba, &n)!=1 || strcmp(name+n, ".bin")!=0) return -1;
+	return (lba<0)?-1:lba;
+}
+
+//Add a COW layer on top of the existing ones and index the sectors it has.
+static int add_layer(scsi_hd_t *hd, const char *dir) {
+	if (hd->n_layers==HD_MAX_LAYERS) {
+		printf("hd: too many COW layers\n");
+		return 0;
+	}
+	DIR *d=opendir(dir);
+	if (!d) {
+		perror(dir);
+		return 0;
+	}
+	int l=hd->n_layers++;
+	hd->layer[l].dir=strdup(dir);
+	hd->layer[l].present=calloc(hd->n_lbas/8, 1);
+	struct dirent *de;
+	int count=0;
+	while ((de=readdir(d))!=NULL) {
+		int lba=cow_file_lba(de->d_name);
+		if (lba<0) continue;
+		ensure_lba(hd, lba);
+		hd->layer[l].present[lba/8]|=(1<<(lba&7));
+		hd->owner[lba]=l+1;
+		count++;
+	}
+	closedir(d);
+	SCSI_LOG_INFO("hd: COW layer %d: %s, %d sectors\n", l, dir, count);
+	return 1;
+}
+
 //Write a block, either to the COW directory or to the image.
 static void write_block(scsi_hd_t *hd, int lba, uint8_t *data) {
-	if (hd->cow_dir) {
-		FILE *f=open_cow_file(hd, lba, "w+b");
+	if (hd->n_layers) {
+		int top=hd->n_layers-1;
+		FILE *f=open_cow_file(hd, top, lba, "w+b");
 		if (!f) {
 			perror("opening cow file for write");
 			exit(1);
@@ -71,16 +168,24 @@ static void write_block(scsi_hd_t *hd, int lba, uint8_t *data) {
 		fwrite(ver, 2, 1, f);
 		fwrite(data, 512, 1, f);
 		fclose(f);
+		ensure_lba(hd, lba);
+		hd->layer[top].present[lba/8]|=(1<<(lba&7));
+		hd->owner[lba]=top+1;
 	} else {
 		fseek(hd->hdfile, lba*512, SEEK_SET);
 		fwrite(data, 512, 1, hd->hdfile);
 	}
 }
 
-//Read a block, either from the COW directory or from the image.
+//Read a block, either from the COW layers or from the image.
 static void read_block(scsi_hd_t *hd, int lba, uint8_t *data) {
-	if (hd->cow_dir) {
-		FILE *f=open_cow_file(hd, lba, "rb");
+	int l=(lba<hd->n_lbas)?hd->owner[lba]:0;
+	//l is the top-most layer that has the sector, plus one. Normally the first
+	//try succeeds; we only look further down if a file has the wrong version.
+	while (l>0) {
+		l--;
+		if (!layer_has(hd, l, lba)) continue;
+		FILE *f=open_cow_file(hd, l, lba, "rb");
 		if (f) {
 			uint8_t ver[2];
 			fread(ver, 2, 1, f);
@@ -96,6 +201,20 @@ static void read_block(scsi_hd_t *hd, int lba, uint8_t *data) {
 		}
 	}
 	//No cow file for the data; return from base image.
+	if (hd->map) {
+		uint64_t off=(uint64_t)lba*512;
+		int len=(off<hd->map_size)?((hd->map_size-off<512)?hd->map_size-off:512):0;
+		memcpy(data, hd->map+off, len);
+		memset(data+len, 0, 512-len);
+		return;
+	}
+	if (hd->cimg) {
+		if (cimg_read(hd->cimg, (uint64_t)lba*512, data, 512)<0) {
+			printf("hd: error reading lba %d from compressed image\n", lba);
+			exit(1);
+		}
+		return;
+	}
 	fseek(hd->hdfile, lba*512, SEEK_SET);
 	fread(data, 512, 1, hd->hdfile);
 }
@@ -169,7 +288,7 @@ static void hd_handle_data_out(scsi_dev_t *dev, uint8_t *msg, int len) {
 			write_block(hd, lba+i, &msg[i*512]);
 		}
 #ifdef __EMSCRIPTEN__
-		emscripten_syncfs();
+		emscripten_syncfs_request();
 #endif
 	}
 }
@@ -180,12 +299,84 @@ static int hd_handle_status(scsi_dev_t *dev) {
 	return 0;
 }
 
-scsi_dev_t *scsi_dev_hd_new(const char *imagename, const char *cow_dir) {
+//The disk contents aren't part of a checkpoint, but a command may be
+//between its command and data phase.
+static void hd_ckpt_save(scsi_dev_t *dev, ckpt_t *c, const char *name) {
+	scsi_hd_t *hd=(scsi_hd_t*)dev;
+	ckpt_put(c, name, hd->cmd, sizeof(hd->cmd));
+}
+
+static int hd_ckpt_load(scsi_dev_t *dev, ckpt_t *c, const char *name) {
+	scsi_hd_t *hd=(scsi_hd_t*)dev;
+	return ckpt_get(c, name, hd->cmd, sizeof(hd->cmd));
+}
+
+//Map a base image that is only read, so all emulator instances on a host
+//share one copy in the page cache. Returns 0 if that's not possible.
+static int map_image(scsi_hd_t *hd, const char *imagename) {
+	int fd=open(imagename, O_RDONLY);
+	if (fd<0) return 0;
+	struct stat st;
+	if (fstat(fd, &st)!=0 || st.st_size==0) {
+		close(fd);
+		return 0;
+	}
+	void *p=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p==MAP_FAILED) return 0;
+	hd->map=p;
+	hd->map_size=st.st_size;
+	return 1;
+}
+
+//Returns the size of the base image in bytes.
+static uint64_t image_size(scsi_hd_t *hd) {
+	if (hd->map) return hd->map_size;
+	if (hd->cimg) return cimg_size(hd->cimg);
+	fseek(hd->hdfile, 0, SEEK_END);
+	return ftell(hd->hdfile);
+}
+
+scsi_dev_t *scsi_dev_hd_new(const char *imagename, const char *cow_dir, const char **cow_lower) {
 	scsi_hd_t *hd=calloc(sizeof(scsi_hd_t), 1);
-	if (cow_dir && cow_dir[0]!=0) {
+	int use_cow=(cow_dir && cow_dir[0]!=0);
+	int is_cimg=cimg_is_cimg(imagename);
+	if (is_cimg && !use_cow) {
+		printf("%s: compressed images are read-only and need a COW directory (-c)\n", imagename);
+		free(hd);
+		return NULL;
+	}
+	if (cow_lower && cow_lower[0] && !use_cow) {
+		printf("%s: COW layers need a writable COW directory (-c)\n", imagename);
+		free(hd);
+		return NULL;
+	}
+	if (use_cow) {
 		//we leave the original image intact and use copy-on-write to save
 		//the new data
-		hd->cow_dir=strdup(cow_dir);
+		if (is_cimg) {
+			hd->cimg=cimg_open(imagename);
+			if (!hd->cimg) {
+				free(hd);
+				return NULL;
+			}
+		} else if (!map_image(hd, imagename)) {
+			hd->hdfile=fopen(imagename, "rb");
+		}
+	} else {
+		//open image r/w so we can write back to it.
+		hd->hdfile=fopen(imagename, "r+b");
+	}
+	if (!hd->hdfile && !hd->cimg && !hd->map) {
+		perror(imagename);
+		free(hd);
+		return NULL;
+	}
+	if (use_cow) {
+		ensure_lba(hd, image_size(hd)/512);
+		for (int i=0; cow_lower && cow_lower[i]; i++) {
+			if (!add_layer(hd, cow_lower[i])) exit(1);
+		}
 		struct stat st;
 		mkdir(cow_dir, 0755); //may fail, we don't care
 		if (stat(cow_dir, &st) == -1) {
@@ -196,20 +387,118 @@ scsi_dev_t *scsi_dev_hd_new(const char *imagename, const char *cow_dir) {
 			printf("%s: not a dir\n", cow_dir);
 			exit(1);
 		}
-		hd->hdfile=fopen(imagename, "rb");
-	} else {
-		//open image r/w so we can write back to it.
-		hd->hdfile=fopen(imagename, "r+b");
-		hd->cow_dir=NULL;
-	}
-	if (!hd->hdfile) {
-		perror(imagename);
-		free(hd);
-		return NULL;
+		if (!add_layer(hd, cow_dir)) exit(1);
 	}
+	hd->imagename=strdup(imagename);
 	hd->dev.handle_status=hd_handle_status;
 	hd->dev.handle_cmd=hd_handle_cmd;
 	hd->dev.handle_data_in=hd_handle_data_in;
 	hd->dev.handle_data_out=hd_handle_data_out;
+	hd->dev.ckpt_save=hd_ckpt_save;
+	hd->dev.ckpt_load=hd_ckpt_load;
 	return (scsi_dev_t*)hd;
 }
+
+//Returns the amount of LBAs on the disk, including sectors written beyond
+//the end of the base image.
+static int disk_lbas(scsi_hd_t *hd) {
+	int n=image_size(hd)/512;
+	//Sectors written beyond the end of the base image grow the disk.
+	for (int lba=n; lba<hd->n_lbas; lba++) {
+		if (hd->owner[lba]) n=lba+1;
+	}
+	return n;
+}
+
+int scsi_dev_hd_commit(scsi_dev_t *dev, const char *outfile) {
+	scsi_hd_t *hd=(scsi_hd_t*)dev;
+	FILE *f=fopen(outfile, "wb");
+	if (!f) {
+		perror(outfile);
+		return 0;
+	}
+	int n=disk_lbas(hd);
+	uint8_t buf[512];
+	int ok=1;
+	for (int lba=0; lba<n && ok; lba++) {
+		read_block(hd, lba, buf);
+		if (fwrite(buf, 512, 1, f)!=1) ok=0;
+	}
+	if (fclose(f)!=0) ok=0;
+	if (!ok) perror(outfile);
+	return ok;
+}
+
+int scsi_dev_hd_flush(scsi_dev_t *dev) {
+	scsi_hd_t *hd=(scsi_hd_t*)dev;
+	int ok=1;
+	if (hd->n_layers) {
+		//COW files are closed after every write, so sync the filesystem they live on.
+		int fd=open(hd->layer[hd->n_layers-1].dir, O_RDONLY);
+#ifdef __linux__
+		if (fd<0 || syncfs(fd)!=0) ok=0;
+#else
+		if (fd<0 || fsync(fd)!=0) ok=0;
+#endif
+		if (fd>=0) close(fd);
+	} else if (hd->hdfile) {
+		if (fflush(hd->hdfile)!=0 || fsync(fileno(hd->hdfile))!=0) ok=0;
+	}
+	if (!ok) perror("hd: flush");
+	return ok;
+}
+
+uint64_t scsi_dev_hd_hash(scsi_dev_t *dev) {
+	scsi_hd_t *hd=(scsi_hd_t*)dev;
+	int n=disk_lbas(hd);
+	uint8_t buf[512];
+	uint64_t h=0xcbf29ce484222325ULL; //FNV-1a
+	for (int lba=0; lba<n; lba++) {
+		read_block(hd, lba, buf);
+		for (int i=0; i<512; i++) {
+			h^=buf[i];
+			h*=0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+int scsi_dev_hd_clone(scsi_dev_t *dev, const char *dir) {
+	scsi_hd_t *hd=(scsi_hd_t*)dev;
+	if (hd->n_layers==0) {
+		printf("hd: cloning needs a COW directory (-c)\n");
+		return 0;
+	}
+	//A forked process shares the file offset of open files with its parent,
+	//so get our own. A mapping has no offset and can stay shared.
+	if (hd->map) {
+		//nothing to do
+	} else if (hd->cimg) {
+		cimg_close(hd->cimg);
+		hd->cimg=cimg_open(hd->imagename);
+		if (!hd->cimg) return 0;
+	} else {
+		fclose(hd->hdfile);
+		hd->hdfile=fopen(hd->imagename, "rb");
+		if (!hd->hdfile) {
+			perror(hd->imagename);
+			return 0;
+		}
+	}
+	//The new layer starts out empty; remove sectors left by a previous run.
+	mkdir(dir, 0755);
+	DIR *d=opendir(dir);
+	if (!d) {
+		perror(dir);
+		return 0;
+	}
+	struct dirent *de;
+	char buf[1024];
+	while ((de=readdir(d))!=NULL) {
+		if (cow_file_lba(de->d_name)<0) continue;
+		snprintf(buf, sizeof(buf), "%s/%s", dir, de->d_name);
+		unlink(buf);
+	}
+	closedir(d);
+	return add_layer(hd, dir);
+}
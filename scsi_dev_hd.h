@@ -1,6 +1,23 @@
+#include <stdint.h>
 #include "scsi.h"
 
 
 //Create a new SCSI device. cow_dir can be NULL or "" to not use COW.
-scsi_dev_t *scsi_dev_hd_new(const char *imagename, const char *cow_dir);
+//cow_lower is a NULL-terminated list of read-only COW layer directories, bottom
+//one first, that sit between the image and cow_dir. It can be NULL.
+scsi_dev_t *scsi_dev_hd_new(const char *imagename, const char *cow_dir, const char **cow_lower);
+
+//Flatten the image and all COW layers into a raw image file. Returns true on success.
+int scsi_dev_hd_commit(scsi_dev_t *dev, const char *outfile);
+
+//For a process forked from the emulator: put a new, empty writable COW layer
+//in dir on top of the existing ones, so writes don't affect the other processes.
+//Returns true on success.
+int scsi_dev_hd_clone(scsi_dev_t *dev, const char *dir);
+
+//Write everything the guest wrote so far to stable storage. Returns true on success.
+int scsi_dev_hd_flush(scsi_dev_t *dev);
+
+//Returns a hash of the disk contents as the guest sees them.
+uint64_t scsi_dev_hd_hash(scsi_dev_t *dev);
 
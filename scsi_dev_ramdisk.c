@@ -0,0 +1,233 @@
+/*
+ Simulation of a SCSI-1 hard disk that lives entirely in host memory.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include "scsi.h"
+#include "emu.h"
+#include "log.h"
+#include "ramrom.h"
+#include "scsi_dev_ramdisk.h"
+
+/*
+This is meant as a scratch disk for things like swap and /tmp: all data is
+kept in an anonymous buffer, so reads and writes are plain memcpy()s. The
+disk can be preformatted by loading a template image at startup. By default
+the contents are discarded when the emulator exits; if asked to, they're
+written back to the template image instead.
+*/
+
+// Debug logging
+#define SCSI_LOG(msg_level, format_and_args...) \
+	log_printf(LOG_SRC_SCSI, msg_level, format_and_args)
+#define SCSI_LOG_DEBUG(format_and_args...)  SCSI_LOG(LOG_DEBUG,  format_and_args)
+#define SCSI_LOG_INFO(format_and_args...)   SCSI_LOG(LOG_INFO,   format_and_args)
+#define SCSI_LOG_WARNING(format_and_args...) SCSI_LOG(LOG_WARNING, format_and_args)
+
+typedef struct {
+	scsi_dev_t dev;
+	ram_t *mem;			//Disk contents; tracks written pages for checkpoints
+	uint8_t *data;		//Buffer of mem
+	int size_lbas;
+	uint8_t cmd[10];
+	char *persist_file;		//If not NULL, contents are written here at exit
+} scsi_ramdisk_t;
+
+static const uint8_t sense[]={
+	0x80+0x00, //error code
+	0, //sense key
+	0,0,0, //additional information
+	0, //additional sense length
+	0,0,0,0, //cmd specific info
+	0,	//asc
+	0,	//ascq
+	0,	//fru code
+	0,0,0,0	//sense key specific
+};
+
+//We only support one RAM disk to be written back at exit.
+static scsi_ramdisk_t *persist_rd=NULL;
+
+static void ramdisk_persist() {
+	scsi_ramdisk_t *rd=persist_rd;
+	if (!rd) return;
+	FILE *f=fopen(rd->persist_file, "wb");
+	if (!f) {
+		perror(rd->persist_file);
+		return;
+	}
+	size_t w=fwrite(rd->data, 512, rd->size_lbas, f);
+	fclose(f);
+	if (w!=rd->size_lbas) {
+		SCSI_LOG_WARNING("ramdisk: short write persisting to %s\n", rd->persist_file);
+	}
+}
+
+void scsi_dev_ramdisk_persist_now() {
+	ramdisk_persist();
+	persist_rd=NULL;
+}
+
+static int rd_handle_cmd(scsi_dev_t *dev, uint8_t *cd, int len) {
+	scsi_ramdisk_t *rd=(scsi_ramdisk_t*)dev;
+	if (len<6 || len>10) return SCSI_DEV_ERR;
+	memcpy(rd->cmd, cd, len);
+	if (cd[0]==0) {
+		return SCSI_DEV_STATUS;
+	} else if (cd[0]==1) {
+		return SCSI_DEV_STATUS;
+	} else if (cd[0]==3) { //sense
+		return SCSI_DEV_DATA_IN;
+	} else if (cd[0]==8) { //read
+		return SCSI_DEV_DATA_IN;
+	} else if (cd[0]==0x15) { //mode select
+		return SCSI_DEV_DATA_OUT;
+	} else if (cd[0]==0xa) { //write
+		return SCSI_DEV_DATA_OUT;
+	} else if (cd[0]==0xC2) {
+		//omti config cmd
+		return SCSI_DEV_DATA_OUT;
+	} else {
+		printf("ramdisk: unsupported cmd %d\n", cd[0]);
+		exit(1);
+	}
+	return SCSI_DEV_DATA_IN;
+}
+
+static int rd_handle_data_in(scsi_dev_t *dev, uint8_t *msg, int buflen) {
+	scsi_ramdisk_t *rd=(scsi_ramdisk_t*)dev;
+	if (rd->cmd[0]==3) { //sense
+		int clen=rd->cmd[4];
+		if (clen==0) clen=4; //per scsi spec
+		if (clen>buflen) clen=buflen;
+		memcpy(msg, sense, clen);
+		return clen;
+	} else if (rd->cmd[0]==8) { //read
+		int lba=(rd->cmd[1]<<16)+(rd->cmd[2]<<8)+(rd->cmd[3]);
+		int tlen=rd->cmd[4];
+		if (tlen==0) tlen=256; //0 means 256 blocks per the spec
+		int blen=tlen*512; //length in bytes
+		if (blen>buflen) blen=buflen;
+		for (int i=0; i<blen/512; i++) {
+			if (lba+i<rd->size_lbas) {
+				memcpy(&msg[i*512], &rd->data[(lba+i)*512], 512);
+			} else {
+				SCSI_LOG_DEBUG("ramdisk: read beyond end, lba %d\n", lba+i);
+				memset(&msg[i*512], 0, 512);
+			}
+		}
+		return blen;
+	} else if (rd->cmd[0]==0xc2) {
+		//omti config command; ignored.
+	} else {
+		assert(0 && "rd_handle_data_in: unknown cmd");
+	}
+	return 0;
+}
+
+static void rd_handle_data_out(scsi_dev_t *dev, uint8_t *msg, int len) {
+	scsi_ramdisk_t *rd=(scsi_ramdisk_t*)dev;
+	if (rd->cmd[0]==0xa) { //write
+		int lba=(rd->cmd[1]<<16)+(rd->cmd[2]<<8)+(rd->cmd[3]);
+		int tlen=rd->cmd[4];
+		if (tlen==0) tlen=256; //per the spec 0 means 256 blocks
+		int blen=tlen*512;
+		if (blen>len) blen=len;
+		for (int i=0; i<blen/512; i++) {
+			if (lba+i<rd->size_lbas) {
+				memcpy(&rd->data[(lba+i)*512], &msg[i*512], 512);
+				ram_mark_dirty(rd->mem, (lba+i)*512, 512);
+			} else {
+				SCSI_LOG_DEBUG("ramdisk: write beyond end, lba %d\n", lba+i);
+			}
+		}
+	}
+	//Mode select and the omti config command are ignored.
+}
+
+static int rd_handle_status(scsi_dev_t *dev) {
+	return 0;
+}
+
+static void rd_ckpt_save(scsi_dev_t *dev, ckpt_t *c, const char *name) {
+	scsi_ramdisk_t *rd=(scsi_ramdisk_t*)dev;
+	ckpt_put(c, name, rd->cmd, sizeof(rd->cmd));
+}
+
+static int rd_ckpt_load(scsi_dev_t *dev, ckpt_t *c, const char *name) {
+	scsi_ramdisk_t *rd=(scsi_ramdisk_t*)dev;
+	return ckpt_get(c, name, rd->cmd, sizeof(rd->cmd));
+}
+
+ram_t *scsi_dev_ramdisk_ram(scsi_dev_t *dev) {
+	scsi_ramdisk_t *rd=(scsi_ramdisk_t*)dev;
+	return rd->mem;
+}
+
+scsi_dev_t *scsi_dev_ramdisk_new(const char *template_img, int size_bytes, int persist) {
+	scsi_ramdisk_t *rd=calloc(sizeof(scsi_ramdisk_t), 1);
+	FILE *f=NULL;
+	long tsize=0;
+	if (template_img && template_img[0]!=0) {
+		f=fopen(template_img, "rb");
+		if (!f) {
+			perror(template_img);
+			free(rd);
+			return NULL;
+		}
+		fseek(f, 0, SEEK_END);
+		tsize=ftell(f);
+		fseek(f, 0, SEEK_SET);
+		if (tsize<0 || tsize>INT_MAX-511) {
+			printf("%s: too large for a RAM disk\n", template_img);
+			fclose(f);
+			free(rd);
+			return NULL;
+		}
+		if (tsize>size_bytes) size_bytes=tsize;
+	}
+	rd->size_lbas=(size_bytes+511)/512;
+	if (rd->size_lbas==0) {
+		printf("ramdisk: no size or template image given\n");
+		free(rd);
+		if (f) fclose(f);
+		return NULL;
+	}
+	rd->mem=ram_new_buffer(rd->size_lbas*512);
+	rd->data=ram_buffer(rd->mem);
+	if (f) {
+		size_t r=fread(rd->data, 1, tsize, f);
+		fclose(f);
+		if (r!=tsize) {
+			printf("%s: short read loading RAM disk template\n", template_img);
+			ram_free_buffer(rd->mem);
+			free(rd);
+			return NULL;
+		}
+		if (persist) {
+			assert(persist_rd==NULL && "only one persistent ramdisk supported");
+			rd->persist_file=strdup(template_img);
+			persist_rd=rd;
+			atexit(ramdisk_persist);
+		}
+	}
+	SCSI_LOG_INFO("ramdisk: %d blocks, template %s%s\n", rd->size_lbas,
+			f?template_img:"(none)", rd->persist_file?", persistent":"");
+	rd->dev.handle_status=rd_handle_status;
+	rd->dev.handle_cmd=rd_handle_cmd;
+	rd->dev.handle_data_in=rd_handle_data_in;
+	rd->dev.handle_data_out=rd_handle_data_out;
+	rd->dev.ckpt_save=rd_ckpt_save;
+	rd->dev.ckpt_load=rd_ckpt_load;
+	return (scsi_dev_t*)rd;
+}
@@ -0,0 +1,16 @@
+#include "scsi.h"
+#include "ramrom.h"
+
+
+//Create a new SCSI disk backed by host memory. If template_img is given, the disk
+//is preloaded with its contents and is at least as large as that file. If persist
+//is true, the contents are written back to template_img on exit; otherwise they're
+//discarded.
+scsi_dev_t *scsi_dev_ramdisk_new(const char *template_img, int size_bytes, int persist);
+
+//The disk contents, so they can be saved in checkpoints like RAM.
+ram_t *scsi_dev_ramdisk_ram(scsi_dev_t *dev);
+
+//Write a persistent RAM disk back to its template image now, and not on exit.
+//Used before forking clones, which shouldn't all write the same file.
+void scsi_dev_ramdisk_persist_now();
@@ -0,0 +1,215 @@
+/*
+ Connects emulated serial channels to host pseudo-terminals or Unix-domain
+ sockets.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serport.h"
+#include "log.h"
+
+/*
+All I/O is non-blocking. Data from the guest is put in an output buffer and
+data from the host is read into an input buffer; the buffers are exchanged with
+the host fd every SERPORT_POLL_US of emulated time, so an idle port does not
+cost a syscall on every UART tick. The output buffer is also written out as soon
+as it's half full, so bulk output isn't held back by the poll interval.
+*/
+
+// Debug logging
+#define UART_LOG(msg_level, format_and_args...) \
+	log_printf(LOG_SRC_UART, msg_level, format_and_args)
+#define UART_LOG_DEBUG(format_and_args...) UART_LOG(LOG_DEBUG, format_and_args)
+#define UART_LOG_WARNING(format_and_args...)  UART_LOG(LOG_WARNING,  format_and_args)
+
+#define SERPORT_POLL_US 1000
+#define INBUF_SZ 256	//needs to be a power of two
+#define OUTBUF_SZ 4096	//needs to be a power of two
+
+enum {
+	SERPORT_PTY=0,
+	SERPORT_UNIX
+};
+
+struct serport_t {
+	int type;
+	int fd;				//fd to read/write data, or -1 if nothing is connected
+	int listen_fd;		//For Unix sockets: listening socket
+	int pty_slave_fd;	//For ptys: we keep the slave open so the master doesn't see EIO when nobody's connected.
+	char *name;			//Path of the pty slave or the socket
+	int us_since_poll;
+	uint8_t inbuf[INBUF_SZ];
+	unsigned int in_rd, in_wr;
+	uint8_t outbuf[OUTBUF_SZ];
+	unsigned int out_rd, out_wr;
+	int out_overflow;	//Set when output was dropped; cleared once the buffer drains
+};
+
+static void set_nonblock(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+}
+
+static int open_pty(serport_t *p) {
+#ifdef __EMSCRIPTEN__
+	printf("pty serial ports are not supported in the browser\n");
+	return 0;
+#else
+	int fd=posix_openpt(O_RDWR|O_NOCTTY);
+	if (fd<0 || grantpt(fd)!=0 || unlockpt(fd)!=0) {
+		perror("posix_openpt");
+		return 0;
+	}
+	p->name=strdup(ptsname(fd));
+	//Open the slave side and make it raw; whoever connects can change that.
+	p->pty_slave_fd=open(p->name, O_RDWR|O_NOCTTY);
+	if (p->pty_slave_fd>=0) {
+		struct termios t;
+		tcgetattr(p->pty_slave_fd, &t);
+		cfmakeraw(&t);
+		tcsetattr(p->pty_slave_fd, TCSANOW, &t);
+	}
+	set_nonblock(fd);
+	p->fd=fd;
+	return 1;
+#endif
+}
+
+static int open_unix(serport_t *p, const char *path) {
+	struct sockaddr_un sa={.sun_family=AF_UNIX};
+	if (strlen(path)>=sizeof(sa.sun_path)) {
+		printf("%s: socket path too long\n", path);
+		return 0;
+	}
+	strcpy(sa.sun_path, path);
+	int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path); //remove stale socket from a previous run
+	if (fd<0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa))!=0 || listen(fd, 1)!=0) {
+		perror(path);
+		if (fd>=0) close(fd);
+		return 0;
+	}
+	set_nonblock(fd);
+	p->listen_fd=fd;
+	p->name=strdup(path);
+	return 1;
+}
+
+serport_t *serport_new(const char *spec) {
+	serport_t *p=calloc(sizeof(serport_t), 1);
+	p->fd=-1;
+	p->listen_fd=-1;
+	p->pty_slave_fd=-1;
+	int ok=0;
+	if (strcmp(spec, "pty")==0) {
+		p->type=SERPORT_PTY;
+		ok=open_pty(p);
+	} else if (strncmp(spec, "unix:", 5)==0) {
+		p->type=SERPORT_UNIX;
+		ok=open_unix(p, spec+5);
+	} else {
+		printf("%s: unknown serial port type\n", spec);
+	}
+	if (!ok) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+const char *serport_name(serport_t *p) {
+	return p->name;
+}
+
+static void disconnect(serport_t *p) {
+	UART_LOG_DEBUG("serport %s: client disconnected\n", p->name);
+	close(p->fd);
+	p->fd=-1;
+	p->in_rd=p->in_wr;
+	p->out_rd=p->out_wr;
+}
+
+static void flush_out(serport_t *p) {
+	while (p->fd>=0 && p->out_rd!=p->out_wr) {
+		//Write the contiguous part of the ring buffer
+		int start=p->out_rd&(OUTBUF_SZ-1);
+		int len=p->out_wr-p->out_rd;
+		if (start+len>OUTBUF_SZ) len=OUTBUF_SZ-start;
+		int r=write(p->fd, &p->outbuf[start], len);
+		if (r<=0) {
+			if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)) break;
+			if (p->type==SERPORT_UNIX) {
+				disconnect(p);
+			} else {
+				//pty: drop the data; nobody is reading it.
+				p->out_rd=p->out_wr;
+			}
+			break;
+		}
+		p->out_rd+=r;
+	}
+	if (p->out_rd==p->out_wr) p->out_overflow=0;
+}
+
+static void fill_in(serport_t *p) {
+	while (p->fd>=0 && p->in_wr-p->in_rd<INBUF_SZ) {
+		int start=p->in_wr&(INBUF_SZ-1);
+		int len=INBUF_SZ-(p->in_wr-p->in_rd);
+		if (start+len>INBUF_SZ) len=INBUF_SZ-start;
+		int r=read(p->fd, &p->inbuf[start], len);
+		if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR || errno==EIO)) break;
+		if (r<=0) {
+			if (p->type==SERPORT_UNIX) disconnect(p);
+			break;
+		}
+		p->in_wr+=r;
+	}
+}
+
+void serport_tick(serport_t *p, int ticklen_us) {
+	p->us_since_poll+=ticklen_us;
+	if (p->us_since_poll<SERPORT_POLL_US) return;
+	p->us_since_poll=0;
+	if (p->type==SERPORT_UNIX && p->fd<0) {
+		int fd=accept(p->listen_fd, NULL, NULL);
+		if (fd>=0) {
+			UART_LOG_DEBUG("serport %s: client connected\n", p->name);
+			set_nonblock(fd);
+			p->fd=fd;
+		}
+	}
+	flush_out(p);
+	fill_in(p);
+}
+
+int serport_getc(serport_t *p) {
+	if (p->in_rd==p->in_wr) return -1;
+	return p->inbuf[(p->in_rd++)&(INBUF_SZ-1)];
+}
+
+void serport_putc(serport_t *p, uint8_t c) {
+	if (p->fd<0) return; //nobody listening
+	if (p->out_wr-p->out_rd>=OUTBUF_SZ) {
+		//Only warn once until the peer starts reading again.
+		if (!p->out_overflow) {
+			UART_LOG_WARNING("serport %s: output buffer full, dropping data\n", p->name);
+		}
+		p->out_overflow=1;
+		return;
+	}
+	p->outbuf[(p->out_wr++)&(OUTBUF_SZ-1)]=c;
+	if (p->out_wr-p->out_rd>=OUTBUF_SZ/2) flush_out(p);
+}
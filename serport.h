@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct serport_t serport_t;
+
+//Create a host-side serial port. spec is either "pty" to create a pseudo-terminal,
+//or "unix:/path" to listen on a Unix-domain socket. Returns NULL on error.
+serport_t *serport_new(const char *spec);
+
+//Returns the pty device or socket path of the port.
+const char *serport_name(serport_t *p);
+
+//Returns a received character, or -1 if there is none.
+int serport_getc(serport_t *p);
+
+//Send a character to the host side.
+void serport_putc(serport_t *p, uint8_t c);
+
+//Call this periodically to exchange data with the host.
+void serport_tick(serport_t *p, int ticklen_us);
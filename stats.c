@@ -0,0 +1,85 @@
+/*
+ Emulator runtime statistics: instructions, cycles, timeslices, interrupts
+ and I/O, plus how fast we run compared to the real machine.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "stats.h"
+
+emu_stats_t emu_stats;
+int stats_timing=0;
+
+static const char *tick_names[STATS_TICK_MAX]={"uart", "rtc", "rtcram", "scsi"};
+
+static uint64_t start_host_ns;
+
+static double per_sec(uint64_t v, uint64_t us) {
+	if (!us) return 0;
+	return (double)v*1000000.0/us;
+}
+
+void stats_start() {
+	start_host_ns=stats_now_ns();
+}
+
+void stats_report(FILE *f, stats_window_t *w, uint64_t emu_time_us) {
+	static const emu_stats_t zero;
+	uint64_t now=stats_now_ns();
+	const emu_stats_t *s=&emu_stats;
+	const emu_stats_t *last=(w && w->host_ns)?&w->last:&zero;
+	uint64_t d_emu_us=emu_time_us-((w && w->host_ns)?w->emu_us:0);
+	uint64_t d_host_us=(now-((w && w->host_ns)?w->host_ns:start_host_ns))/1000;
+
+	fprintf(f, "Stats at %llu.%06llu emulated s, %.3f host s\n",
+			(unsigned long long)(emu_time_us/1000000), (unsigned long long)(emu_time_us%1000000),
+			(now-start_host_ns)/1e9);
+	if (d_host_us) {
+		fprintf(f, " speed: %.3fx realtime (%llu emulated us in %llu host us)\n",
+				(double)d_emu_us/d_host_us, (unsigned long long)d_emu_us, (unsigned long long)d_host_us);
+	}
+	for (int i=0; i<2; i++) {
+		fprintf(f, " cpu%d: %llu insns (%.2f MIPS host), %llu cycles, %llu slices",
+				i, (unsigned long long)s->insns[i], per_sec(s->insns[i]-last->insns[i], d_host_us)/1e6,
+				(unsigned long long)s->cycles[i], (unsigned long long)s->slices[i]);
+		if (stats_timing) fprintf(f, ", %.3f host s", s->host_ns_cpu[i]/1e9);
+		fprintf(f, "\n");
+	}
+	if (stats_timing) {
+		fprintf(f, " device ticks:");
+		for (int i=0; i<STATS_TICK_MAX; i++) fprintf(f, " %s %.3fs", tick_names[i], s->host_ns_tick[i]/1e9);
+		fprintf(f, "\n");
+	}
+	fprintf(f, " interrupts (vector: raised/acked):");
+	for (int v=0; v<256; v++) {
+		if (!s->int_raised[v] && !s->int_acked[v]) continue;
+		fprintf(f, " %02x:%llu/%llu", v, (unsigned long long)s->int_raised[v], (unsigned long long)s->int_acked[v]);
+	}
+	fprintf(f, "\n");
+	fprintf(f, " mapper faults %llu, bus errors %llu\n",
+			(unsigned long long)s->mapper_faults, (unsigned long long)s->bus_errors);
+	fprintf(f, " scsi: %llu cmds, %llu bytes in, %llu bytes out\n",
+			(unsigned long long)s->scsi_cmds, (unsigned long long)s->scsi_bytes_in,
+			(unsigned long long)s->scsi_bytes_out);
+	fprintf(f, " console: %llu bytes in, %llu bytes out\n",
+			(unsigned long long)s->console_in, (unsigned long long)s->console_out);
+	if (s->pace_sleeps || s->pace_max_lag_us) {
+		fprintf(f, " pacing: %llu sleeps, %.1f us avg oversleep, %llu us max lag, %llu us lag dropped\n",
+				(unsigned long long)s->pace_sleeps,
+				s->pace_sleeps?(double)s->pace_oversleep_ns/s->pace_sleeps/1000:0.0,
+				(unsigned long long)s->pace_max_lag_us, (unsigned long long)s->pace_dropped_us);
+	}
+	fflush(f);
+
+	if (w) {
+		memcpy(&w->last, s, sizeof(w->last));
+		w->emu_us=emu_time_us;
+		w->host_ns=now;
+	}
+}
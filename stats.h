@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+//Device ticks we keep host time for
+enum {
+	STATS_TICK_UART=0,
+	STATS_TICK_RTC,
+	STATS_TICK_RTCRAM,
+	STATS_TICK_SCSI,
+	STATS_TICK_MAX
+};
+
+//Emulator runtime counters. These are plain globals that are incremented
+//in place, so keeping them costs next to nothing.
+typedef struct {
+	uint64_t insns[2];			//instructions executed per CPU
+	uint64_t cycles[2];			//cycles executed per CPU
+	uint64_t slices[2];			//timeslices run per CPU
+	uint64_t host_ns_cpu[2];	//host time spent executing per CPU (only with timing on)
+	uint64_t host_ns_tick[STATS_TICK_MAX];	//host time spent in device ticks (only with timing on)
+	uint64_t int_raised[256];	//interrupts raised, per vector
+	uint64_t int_acked[256];	//interrupts acknowledged, per vector
+	uint64_t mapper_faults;
+	uint64_t bus_errors;
+	uint64_t scsi_cmds;
+	uint64_t scsi_bytes_in;		//device to memory
+	uint64_t scsi_bytes_out;	//memory to device
+	uint64_t console_in;
+	uint64_t console_out;
+	uint64_t pace_sleeps;		//times the realtime pacer slept
+	uint64_t pace_oversleep_ns;	//total time the pacer slept past its deadline
+	uint64_t pace_max_lag_us;	//largest amount emulation was behind the host
+	uint64_t pace_dropped_us;	//total lag the pacer gave up on catching up
+} emu_stats_t;
+
+extern emu_stats_t emu_stats;
+
+//If true, the main loop measures the host time spent per CPU and device.
+extern int stats_timing;
+
+static inline uint64_t stats_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+//Mark the start of emulation.
+void stats_start();
+
+//Counters at the previous report of a periodic report stream, so its rates
+//cover the time since then. Zero-initialize before the first report.
+typedef struct {
+	emu_stats_t last;
+	uint64_t emu_us;
+	uint64_t host_ns;
+} stats_window_t;
+
+//Print all statistics. Rates are calculated over the time since the previous
+//report in w, which is then updated. If w is NULL, rates are since the start.
+void stats_report(FILE *f, stats_window_t *w, uint64_t emu_time_us);
+
+#endif
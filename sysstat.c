@@ -0,0 +1,171 @@
+/*
+ Syscall statistics: counts, latencies and bytes transferred per syscall.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sysstat.h"
+#include "sysvr2-strace.h"
+
+/*
+A syscall starts when the job CPU executes TRAP #0 and ends when the CPU next
+returns to user mode in the same map id. As a process that sleeps in a syscall
+gives the CPU to other processes, there can be a pending syscall for every map
+id; the latency thus includes time spent sleeping, which is what the process
+sees. Calls that don't return (exit) or that return as a different process
+(the child side of fork) are simply never finished.
+
+Latencies are in emulated CPU cycles and are kept as log2 histograms.
+*/
+
+#define MAX_SYSNO 64	//anything higher is counted as MAX_SYSNO
+#define N_BUCKETS 32
+#define N_MAPIDS 256
+#define SYS_READ 3
+#define SYS_WRITE 4
+#define SYS_EXIT 1
+
+typedef struct {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t cycles;
+	uint64_t bytes;
+	uint32_t hist[N_BUCKETS];
+} callstat_t;
+
+typedef struct {
+	int sysno;			//-1 if nothing pending
+	uint64_t start;
+} pending_t;
+
+static char *out_file=NULL;
+static callstat_t *per_map[N_MAPIDS];	//[MAX_SYSNO+1] per map id, allocated on first use
+static pending_t pending[N_MAPIDS];
+
+void sysstat_init(const char *filename) {
+	out_file=strdup(filename);
+	for (int i=0; i<N_MAPIDS; i++) pending[i].sysno=-1;
+}
+
+int sysstat_active() {
+	return out_file!=NULL;
+}
+
+void sysstat_enter(int mapid, int sysno, uint64_t cycles) {
+	if (sysno==SYS_EXIT) {
+		//Never returns
+		pending[mapid].sysno=-1;
+		return;
+	}
+	if (sysno<0 || sysno>MAX_SYSNO) sysno=MAX_SYSNO;
+	pending[mapid].sysno=sysno;
+	pending[mapid].start=cycles;
+}
+
+static int bucket_for(uint64_t v) {
+	int b=0;
+	while (v>1 && b<N_BUCKETS-1) {
+		v>>=1;
+		b++;
+	}
+	return b;
+}
+
+void sysstat_return(int mapid, uint64_t cycles, uint32_t d0, int error) {
+	pending_t *p=&pending[mapid];
+	if (p->sysno<0) return;
+	if (!per_map[mapid]) per_map[mapid]=calloc(sizeof(callstat_t), MAX_SYSNO+1);
+	callstat_t *c=&per_map[mapid][p->sysno];
+	uint64_t lat=cycles-p->start;
+	c->count++;
+	c->cycles+=lat;
+	c->hist[bucket_for(lat)]++;
+	if (error) {
+		c->errors++;
+	} else if (p->sysno==SYS_READ || p->sysno==SYS_WRITE) {
+		c->bytes+=d0;
+	}
+	p->sysno=-1;
+}
+
+static void sysno_name(int sysno, char *buf, int len) {
+	const char *n=m68k_strace_name(sysno);
+	if (sysno==MAX_SYSNO) {
+		snprintf(buf, len, "other");
+	} else if (n) {
+		snprintf(buf, len, "%s(%d)", n, sysno);
+	} else {
+		snprintf(buf, len, "sys%d", sysno);
+	}
+}
+
+static void print_hist(FILE *f, const callstat_t *c) {
+	uint32_t max=0;
+	for (int b=0; b<N_BUCKETS; b++) if (c->hist[b]>max) max=c->hist[b];
+	for (int b=0; b<N_BUCKETS; b++) {
+		if (!c->hist[b]) continue;
+		char bar[41];
+		int n=(c->hist[b]*40ULL+max-1)/max;
+		memset(bar, '#', n);
+		bar[n]=0;
+		fprintf(f, "    %10llu-%-10llu %8u %s\n", b?(1ULL<<b):0ULL, (2ULL<<b)-1, c->hist[b], bar);
+	}
+}
+
+static void print_stat(FILE *f, const char *name, const callstat_t *c) {
+	fprintf(f, "%-14s %9llu calls %7llu errors %12llu cycles avg %14llu cycles total",
+			name, (unsigned long long)c->count, (unsigned long long)c->errors,
+			(unsigned long long)(c->cycles/c->count), (unsigned long long)c->cycles);
+	if (c->bytes) fprintf(f, " %12llu bytes", (unsigned long long)c->bytes);
+	fprintf(f, "\n");
+}
+
+void sysstat_dump() {
+	if (!out_file) return;
+	FILE *f=fopen(out_file, "w");
+	if (!f) {
+		perror(out_file);
+		return;
+	}
+	//Totals over all map ids
+	callstat_t tot[MAX_SYSNO+1]={0};
+	for (int m=0; m<N_MAPIDS; m++) {
+		if (!per_map[m]) continue;
+		for (int s=0; s<=MAX_SYSNO; s++) {
+			callstat_t *c=&per_map[m][s];
+			tot[s].count+=c->count;
+			tot[s].errors+=c->errors;
+			tot[s].cycles+=c->cycles;
+			tot[s].bytes+=c->bytes;
+			for (int b=0; b<N_BUCKETS; b++) tot[s].hist[b]+=c->hist[b];
+		}
+	}
+	char name[32];
+	fprintf(f, "Syscalls, all map ids. Latency histogram is in cycles.\n");
+	for (int s=0; s<=MAX_SYSNO; s++) {
+		if (!tot[s].count) continue;
+		sysno_name(s, name, sizeof(name));
+		print_stat(f, name, &tot[s]);
+		print_hist(f, &tot[s]);
+	}
+	fprintf(f, "\nSyscalls per map id\n");
+	for (int m=0; m<N_MAPIDS; m++) {
+		if (!per_map[m]) continue;
+		fprintf(f, "Map id %d:\n", m);
+		for (int s=0; s<=MAX_SYSNO; s++) {
+			if (!per_map[m][s].count) continue;
+			sysno_name(s, name, sizeof(name));
+			fprintf(f, "  ");
+			print_stat(f, name, &per_map[m][s]);
+			print_hist(f, &per_map[m][s]);
+		}
+	}
+	fclose(f);
+}
@@ -0,0 +1,22 @@
+#ifndef SYSSTAT_H
+#define SYSSTAT_H
+
+#include <stdint.h>
+
+//Start collecting syscall statistics. They're written to filename by sysstat_dump().
+void sysstat_init(const char *filename);
+
+//Returns true if statistics are being collected.
+int sysstat_active();
+
+//A process with the given map id does a syscall.
+void sysstat_enter(int mapid, int sysno, uint64_t cycles);
+
+//The CPU returns to user mode in the given map id. d0 is the syscall return
+//value and error is true if the syscall returned an error.
+void sysstat_return(int mapid, uint64_t cycles, uint32_t d0, int error);
+
+//Write the statistics.
+void sysstat_dump();
+
+#endif
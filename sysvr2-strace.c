@@ -104,6 +104,31 @@ static void stprint(void *ctx, uint32_t sp, const char *fmt, ...)
         }
     }
 }
+static const char *syscall_names[] = {
+    [1] = "rexit", [2] = "fork", [3] = "read", [4] = "write",
+    [5] = "open", [6] = "close", [7] = "wait", [8] = "creat",
+    [9] = "link", [10] = "unlink", [11] = "exec", [12] = "chdir",
+    [13] = "gtime", [14] = "mknod", [15] = "chmod", [16] = "chown",
+    [17] = "sbreak", [18] = "stat", [19] = "seek", [20] = "getpid",
+    [21] = "mount", [22] = "umount", [23] = "setuid", [24] = "getuid",
+    [25] = "stime", [26] = "ptrace", [27] = "alarm", [28] = "fstat",
+    [29] = "pause", [30] = "utime", [33] = "access", [34] = "nice",
+    [36] = "sync", [37] = "kill", [39] = "setpgrp", [41] = "dup",
+    [42] = "pipe", [43] = "times", [44] = "prof", [46] = "setgid",
+    [47] = "getgid", [48] = "ssig", [49] = "msgsys", [51] = "acct",
+    [52] = "shmsys", [53] = "semsys", [54] = "ioctl", [55] = "uadmin",
+    [57] = "utssys", [59] = "exece", [60] = "umask", [61] = "chroot",
+    [62] = "fcntl", [63] = "ulimit",
+};
+
+const char *m68k_strace_name(int d0)
+{
+    if (d0 < 0 || d0 >= sizeof(syscall_names) / sizeof(syscall_names[0])) {
+        return NULL;
+    }
+    return syscall_names[d0];
+}
+
 char *m68k_strace(void *ctx, int d0, uint32_t sp)
 {
     stbuflen = 0;
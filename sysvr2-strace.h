@@ -7,6 +7,8 @@ uint32_t stget32(void *ctx, uint32_t addr);
 uint8_t stget8(void *ctx, uint32_t addr);
 
 char *m68k_strace(void *ctx, int d0, uint32_t sp);
+// Returns the name of a syscall, or NULL if unknown.
+const char *m68k_strace_name(int d0);
 
 #endif
 
@@ -0,0 +1,113 @@
+/*
+ Binary instruction trace writer. See trace.h for the format; tracedec.c
+ decodes it.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+//Size of a block. Instructions are encoded into memory and written out a
+//block at a time.
+#define BLOCK_SZ (1024*1024)
+//Max size of one encoded instruction
+#define MAX_INSN_SZ 16
+
+struct trace_t {
+	FILE *f;
+	int is_pipe;
+	trace_block_hdr_t hdr;	//header for the block being built
+	uint32_t last_id;
+	uint32_t last_pc;
+	uint16_t last_sr;
+	uint8_t *buf;
+	int len;
+};
+
+trace_t *trace_open(const char *filename, int cpu, int compress) {
+	trace_t *t=calloc(sizeof(trace_t), 1);
+	if (compress) {
+		if (strchr(filename, '\'')) {
+			printf("%s: can't have quotes in a compressed trace filename\n", filename);
+			free(t);
+			return NULL;
+		}
+		char cmd[strlen(filename)+32];
+		sprintf(cmd, "gzip -c > '%s'", filename);
+		t->f=popen(cmd, "w");
+		t->is_pipe=1;
+	} else {
+		t->f=fopen(filename, "wb");
+	}
+	if (!t->f) {
+		perror(filename);
+		free(t);
+		return NULL;
+	}
+	trace_file_hdr_t fh={.magic=TRACE_MAGIC, .cpu=cpu};
+	fwrite(&fh, sizeof(fh), 1, t->f);
+	t->buf=malloc(BLOCK_SZ);
+	return t;
+}
+
+static void flush_block(trace_t *t) {
+	if (t->len==0) return;
+	t->hdr.len=t->len;
+	fwrite(&t->hdr, sizeof(t->hdr), 1, t->f);
+	fwrite(t->buf, t->len, 1, t->f);
+	t->len=0;
+}
+
+static void put_varint(trace_t *t, uint32_t v) {
+	while (v>=0x80) {
+		t->buf[t->len++]=(v&0x7f)|0x80;
+		v>>=7;
+	}
+	t->buf[t->len++]=v;
+}
+
+void trace_insn(trace_t *t, uint32_t insn_id, uint32_t pc, uint16_t sr, uint16_t ir) {
+	pc&=0xffffff;
+	if (t->len+MAX_INSN_SZ>BLOCK_SZ) flush_block(t);
+	if (t->len==0) {
+		//Starting a new block: record the state it starts with.
+		t->hdr.insn_id=t->last_id;
+		t->hdr.pc=t->last_pc;
+		t->hdr.sr=t->last_sr;
+	}
+	int32_t delta=pc-t->last_pc;
+	uint32_t zz=((uint32_t)delta<<1)^(delta>>31);
+	int flags=0;
+	if (sr!=t->last_sr) flags|=TRACE_FL_SR;
+	if (insn_id!=t->last_id+1) flags|=TRACE_FL_ID;
+	//Addresses are 24 bits, so there's room for the flags.
+	put_varint(t, (zz<<2)|flags);
+	if (flags&TRACE_FL_SR) {
+		t->buf[t->len++]=sr>>8;
+		t->buf[t->len++]=sr;
+	}
+	if (flags&TRACE_FL_ID) put_varint(t, insn_id-t->last_id-1);
+	t->buf[t->len++]=ir>>8;
+	t->buf[t->len++]=ir;
+	t->last_id=insn_id;
+	t->last_pc=pc;
+	t->last_sr=sr;
+}
+
+void trace_close(trace_t *t) {
+	flush_block(t);
+	if (t->is_pipe) {
+		pclose(t->f);
+	} else {
+		fclose(t->f);
+	}
+	free(t->buf);
+	free(t);
+}
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+Binary instruction trace format. A trace file contains the instructions one CPU
+executed. It starts with a trace_file_hdr_t, followed by blocks. Every block
+starts with a trace_block_hdr_t giving the length of the data and the state
+before the first instruction in the block, so blocks can be decoded on their
+own. Every instruction then is:
+
+- varint: (zigzag(pc - previous pc) << 2) | flags
+- if flags & TRACE_FL_SR: 16-bit SR, big endian
+- if flags & TRACE_FL_ID: varint (insn_id - previous insn_id - 1). Instruction
+  IDs are shared between the CPUs, so this happens when the other CPU ran.
+- 16-bit IR, big endian. Note this is the opcode of the *previous* instruction,
+  as the trace hook runs before the new opcode is fetched.
+*/
+
+#define TRACE_MAGIC "PLXTRC1"
+#define TRACE_FL_SR 1
+#define TRACE_FL_ID 2
+
+typedef struct {
+	char magic[8];
+	uint32_t cpu;
+	uint32_t reserved;
+} trace_file_hdr_t;
+
+typedef struct {
+	uint32_t len;		//bytes of instruction data following this header
+	uint32_t insn_id;	//id of the instruction before the first one in this block
+	uint32_t pc;		//pc of the instruction before the first one in this block
+	uint16_t sr;		//sr before the first instruction in this block
+	uint16_t pad;
+} trace_block_hdr_t;
+
+typedef struct trace_t trace_t;
+
+//Open a trace file for the given CPU. If compress is true, the file is
+//written through gzip. Returns NULL on error.
+trace_t *trace_open(const char *filename, int cpu, int compress);
+
+//Add an instruction to the trace.
+void trace_insn(trace_t *t, uint32_t insn_id, uint32_t pc, uint16_t sr, uint16_t ir);
+
+//Write out remaining data and close the trace.
+void trace_close(trace_t *t);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ Decoder for binary instruction traces, as written by 'emu -trace'.
+*/
+
+/*
+SPDX-License-Identifier: MIT
+Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "Musashi/m68k.h"
+
+/*
+The trace only contains the opcode word of every instruction, so to show
+operands we need the memory contents. These are taken from memory images (the
+ROMs and the RAM snapshot emu writes next to the trace) but only if the image
+has the same opcode at that address; if not, or if there's no image, the
+operands are shown as they decode from zeroes and the line is marked with '?'.
+*/
+
+#define MAX_IMAGES 8
+
+typedef struct {
+	uint32_t addr;
+	uint32_t size;
+	uint8_t *data;
+} image_t;
+
+static image_t image[MAX_IMAGES];
+static int n_images=0;
+
+//Instruction being disassembled
+static uint32_t dis_pc;
+static uint16_t dis_ir;
+static image_t *dis_img;	//image that matches dis_ir at dis_pc, or NULL
+static int dis_unknown;		//set if we needed memory we don't know
+
+static void load_image(uint32_t addr, const char *filename) {
+	if (n_images==MAX_IMAGES) {
+		printf("Too many images\n");
+		exit(1);
+	}
+	FILE *f=fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	image_t *im=&image[n_images++];
+	im->addr=addr;
+	im->size=ftell(f);
+	im->data=malloc(im->size);
+	fseek(f, 0, SEEK_SET);
+	if (fread(im->data, 1, im->size, f)!=im->size) {
+		perror(filename);
+		exit(1);
+	}
+	fclose(f);
+}
+
+static int img_read16(image_t *im, uint32_t addr, unsigned int *v) {
+	if (addr<im->addr || addr+2>im->addr+im->size) return 0;
+	addr-=im->addr;
+	*v=(im->data[addr]<<8)|im->data[addr+1];
+	return 1;
+}
+
+static image_t *find_image(uint32_t pc, uint16_t ir) {
+	for (int i=0; i<n_images; i++) {
+		unsigned int v;
+		if (img_read16(&image[i], pc, &v) && v==ir) return &image[i];
+	}
+	return NULL;
+}
+
+//Memory accessors for the disassembler.
+unsigned int m68k_read_memory_16(unsigned int address) {
+	unsigned int v=0;
+	if (address==dis_pc) return dis_ir;
+	if (!dis_img || !img_read16(dis_img, address, &v)) dis_unknown=1;
+	return v;
+}
+
+unsigned int m68k_read_memory_32(unsigned int address) {
+	return (m68k_read_memory_16(address)<<16)|m68k_read_memory_16(address+2);
+}
+
+unsigned int m68k_read_memory_8(unsigned int address) {
+	return m68k_read_memory_16(address&~1)>>((address&1)?0:8);
+}
+
+//Reader that knows about block boundaries.
+typedef struct {
+	FILE *f;
+	uint8_t *buf;
+	int len;
+	int pos;
+	uint32_t id, pc;
+	uint16_t sr;
+} reader_t;
+
+static uint32_t get_varint(reader_t *r) {
+	uint32_t v=0;
+	int shift=0;
+	while (r->pos<r->len) {
+		uint8_t b=r->buf[r->pos++];
+		v|=(uint32_t)(b&0x7f)<<shift;
+		if (!(b&0x80)) break;
+		shift+=7;
+	}
+	return v;
+}
+
+//Reads the next instruction. Returns 0 at the end of the trace.
+static int next_insn(reader_t *r, uint16_t *ir) {
+	if (r->pos>=r->len) {
+		trace_block_hdr_t bh;
+		if (fread(&bh, sizeof(bh), 1, r->f)!=1) return 0;
+		r->buf=realloc(r->buf, bh.len);
+		if (fread(r->buf, 1, bh.len, r->f)!=bh.len) return 0;
+		r->len=bh.len;
+		r->pos=0;
+		r->id=bh.insn_id;
+		r->pc=bh.pc;
+		r->sr=bh.sr;
+	}
+	uint32_t v=get_varint(r);
+	uint32_t zz=v>>2;
+	int32_t delta=(zz>>1)^-(int32_t)(zz&1);
+	r->pc=(r->pc+delta)&0xffffff;
+	if (v&TRACE_FL_SR) {
+		r->sr=(r->buf[r->pos]<<8)|r->buf[r->pos+1];
+		r->pos+=2;
+	}
+	r->id++;
+	if (v&TRACE_FL_ID) r->id+=get_varint(r);
+	*ir=(r->buf[r->pos]<<8)|r->buf[r->pos+1];
+	r->pos+=2;
+	return 1;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-n] [-u15 file] [-u17 file] [-ram file] [-img addr file] trace\n", name);
+	printf(" -n Don't disassemble; print in the old trace.txt format\n");
+	printf(" -u15, -u17 ROM images (default: U15-MERGED.BIN and U17-MERGED.BIN if they exist)\n");
+	printf(" -ram Physical RAM snapshot, loaded at address 0 (default: trace name with .ram)\n");
+	printf(" -img Load any image at the given address\n");
+	printf("Traces ending in .gz are decompressed with gzip.\n");
+	exit(1);
+}
+
+static int file_exists(const char *name) {
+	FILE *f=fopen(name, "rb");
+	if (f) fclose(f);
+	return f!=NULL;
+}
+
+int main(int argc, char **argv) {
+	const char *u15="U15-MERGED.BIN", *u17="U17-MERGED.BIN";
+	const char *ram=NULL;
+	int no_dis=0;
+	int i=1;
+	while (i<argc && argv[i][0]=='-') {
+		if (strcmp(argv[i], "-n")==0) {
+			no_dis=1;
+		} else if (strcmp(argv[i], "-u15")==0 && i+1<argc) {
+			u15=argv[++i];
+		} else if (strcmp(argv[i], "-u17")==0 && i+1<argc) {
+			u17=argv[++i];
+		} else if (strcmp(argv[i], "-ram")==0 && i+1<argc) {
+			ram=argv[++i];
+		} else if (strcmp(argv[i], "-img")==0 && i+2<argc) {
+			load_image(strtoul(argv[i+1], NULL, 0), argv[i+2]);
+			i+=2;
+		} else {
+			usage(argv[0]);
+		}
+		i++;
+	}
+	if (argc-i!=1) usage(argv[0]);
+	const char *tracefile=argv[i];
+
+	reader_t r={0};
+	int len=strlen(tracefile);
+	int is_gz=(len>3 && strcmp(tracefile+len-3, ".gz")==0);
+	if (is_gz) {
+		if (strchr(tracefile, '\'')) usage(argv[0]);
+		char cmd[len+32];
+		sprintf(cmd, "gzip -dc < '%s'", tracefile);
+		r.f=popen(cmd, "r");
+	} else {
+		r.f=fopen(tracefile, "rb");
+	}
+	if (!r.f) {
+		perror(tracefile);
+		exit(1);
+	}
+	trace_file_hdr_t fh;
+	if (fread(&fh, sizeof(fh), 1, r.f)!=1 || strcmp(fh.magic, TRACE_MAGIC)!=0) {
+		printf("%s: not a trace file\n", tracefile);
+		exit(1);
+	}
+
+	if (!no_dis) {
+		//The RAM snapshot is named after the trace, minus the cpu and .gz suffix.
+		char ramname[len+8];
+		if (!ram) {
+			strcpy(ramname, tracefile);
+			if (is_gz) ramname[len-3]=0;
+			char *dot=strrchr(ramname, '.');
+			if (dot) strcpy(dot, ".ram");
+			if (file_exists(ramname)) ram=ramname;
+		}
+		if (ram) load_image(0, ram);
+		//The ROMs live at 0x800000, but are mirrored at 0 during boot.
+		if (file_exists(u17)) {
+			load_image(0x800000, u17);
+			load_image(0, u17);
+		}
+		if (file_exists(u15)) {
+			load_image(0x808000, u15);
+			load_image(0x8000, u15);
+		}
+	}
+
+	//The IR stored with an instruction is the opcode of the previous one,
+	//so we need to look one instruction ahead.
+	uint32_t id=0, pc=0;
+	uint16_t sr=0, ir;
+	int have_prev=0;
+	while (1) {
+		int have_next=next_insn(&r, &ir);
+		if (have_prev) {
+			if (no_dis) {
+				printf("%d %d %06x %x\n", id, fh.cpu, pc, sr);
+			} else {
+				char dis[256];
+				if (have_next) {
+					dis_unknown=0;
+					dis_pc=pc;
+					dis_ir=ir;
+					dis_img=find_image(pc, ir);
+					m68k_disassemble(dis, pc, M68K_CPU_TYPE_68010);
+				} else {
+					//Last instruction; we don't know its opcode.
+					strcpy(dis, "");
+					dis_unknown=1;
+				}
+				printf("%10u %d %06x %04x %s%s\n", id, fh.cpu, pc, sr, dis, dis_unknown?" ?":"");
+			}
+		}
+		if (!have_next) break;
+		id=r.id;
+		pc=r.pc;
+		sr=r.sr;
+		have_prev=1;
+	}
+	if (is_gz) {
+		pclose(r.f);
+	} else {
+		fclose(r.f);
+	}
+	return 0;
+}
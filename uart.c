@@ -18,11 +18,20 @@ Copyright (c) 2024 Sprite_tm <jeroen@spritesmods.com>
 #include "emu.h"
 #include "log.h"
 #include "int.h"
+#include "serport.h"
+#include "script.h"
+#include "stats.h"
+#include "replay.h"
 
 #include <termios.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef __EMSCRIPTEN__
 #include <sys/select.h>
+#else
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
 
 // Debug logging
 #define UART_LOG(msg_level, format_and_args...) \
@@ -86,14 +95,172 @@ static void ctrl_c_inc() {
 	}
 }
 
-static int uart_poll_for_console_character() {
-	char c;
+/*
+Console output goes into a big stdio buffer rather than being flushed for every
+character. It's written out when the buffer fills up, when the guest hasn't
+written anything for CONSOLE_FLUSH_IDLE_US of emulated time, and when a key is
+received from the console. As log messages go through the same stdio stream
+(and flush it), console output and logs stay in order.
+*/
+#define CONSOLE_OUTBUF_SZ (64*1024)
+#define CONSOLE_FLUSH_IDLE_US 2000
+
+static int console_out_pending=0;
+static int console_idle_us=0;
+
+//Console callbacks, if the emulator is embedded.
+static void (*console_out_cb)(void *opaque, char c)=NULL;
+static int (*console_in_cb)(void *opaque)=NULL;
+static void *console_cb_opaque;
+
+void uart_console_set_cb(void (*out)(void *opaque, char c), int (*in)(void *opaque), void *opaque) {
+	console_out_cb=out;
+	console_in_cb=in;
+	console_cb_opaque=opaque;
+}
+
+void uart_console_init() {
+	setvbuf(stdout, NULL, _IOFBF, CONSOLE_OUTBUF_SZ);
+}
+
+static void uart_console_flush() {
+	if (!console_out_pending) return;
+	fflush(stdout);
+	console_out_pending=0;
+}
+
+//Scripts, cloning and the library interface all watch the console output.
+#define MAX_CONSOLE_HOOKS 4
+static uart_console_hook_t console_hooks[MAX_CONSOLE_HOOKS];
+static int n_console_hooks=0;
+
+int uart_console_add_hook(uart_console_hook_t hook) {
+	if (n_console_hooks==MAX_CONSOLE_HOOKS) return 0;
+	console_hooks[n_console_hooks++]=hook;
+	return 1;
+}
+
+int uart_match_add(uart_match_t *m, char c, const char *str, int len) {
+	if (m->len==UART_MATCH_BUF_SZ) {
+		//Drop the oldest half. Strings are at most that long, so we can't
+		//lose a partial match this way.
+		memmove(m->buf, m->buf+UART_MATCH_BUF_SZ/2, UART_MATCH_BUF_SZ/2);
+		m->len=UART_MATCH_BUF_SZ/2;
+	}
+	m->buf[m->len++]=c;
+	//Checking the tail also finds matches that overlap a partial one.
+	return (str && m->len>=len && memcmp(m->buf+m->len-len, str, len)==0);
+}
+
+int uart_match_find(uart_match_t *m, const char *str, int len) {
+	for (int i=0; i+len<=m->len; i++) {
+		if (memcmp(m->buf+i, str, len)==0) {
+			int end=i+len;
+			memmove(m->buf, m->buf+end, m->len-end);
+			m->len-=end;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void uart_match_clear(uart_match_t *m) {
+	m->len=0;
+}
+
+void uart_console_printc(char val) {
+	emu_stats.console_out++;
+	for (int i=0; i<n_console_hooks; i++) console_hooks[i](val);
+	if (console_out_cb) {
+		console_out_cb(console_cb_opaque, val);
+		return;
+	}
+	putchar(val);
+	console_out_pending=1;
+	console_idle_us=0;
+}
+
+#ifndef __EMSCRIPTEN__
+/*
+Console input is read by a separate thread that blocks on stdin and puts
+whatever it gets into a single-producer/single-consumer ring buffer. Checking
+for input from the emulator thread then is only a matter of comparing two
+indexes, rather than doing a select() syscall for every UART status read.
+*/
+#define CONSOLE_INBUF_SZ 1024 //needs to be a power of two
+
+static uint8_t console_inbuf[CONSOLE_INBUF_SZ];
+static atomic_uint console_in_wr=0; //only written by the reader thread
+static atomic_uint console_in_rd=0; //only written by the emulator thread
+
+static void *console_reader_thread(void *arg) {
+	while (1) {
+		uint8_t buf[64];
+		int n=read(STDIN_FILENO, buf, sizeof(buf));
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) break; //EOF or error; no more input will come.
+		for (int i=0; i<n; i++) {
+			unsigned int wr=atomic_load_explicit(&console_in_wr, memory_order_relaxed);
+			//If the buffer is full, wait for the emulator to catch up.
+			while (wr-atomic_load_explicit(&console_in_rd, memory_order_acquire)>=CONSOLE_INBUF_SZ) {
+				usleep(1000);
+			}
+			console_inbuf[wr&(CONSOLE_INBUF_SZ-1)]=buf[i];
+			atomic_store_explicit(&console_in_wr, wr+1, memory_order_release);
+		}
+	}
+	return NULL;
+}
+
+static void console_start_reader() {
+	//Signals should be handled by the emulator thread, so block them here.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t t;
+	if (pthread_create(&t, NULL, console_reader_thread, NULL)!=0) {
+		UART_LOG_WARNING("Could not start console reader thread; no console input.\n");
+	} else {
+		pthread_detach(t);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+//Returns true and puts the next character in *c if there is console input.
+static int console_read_char(char *c) {
+	unsigned int rd=atomic_load_explicit(&console_in_rd, memory_order_relaxed);
+	if (rd==atomic_load_explicit(&console_in_wr, memory_order_acquire)) return 0;
+	*c=console_inbuf[rd&(CONSOLE_INBUF_SZ-1)];
+	atomic_store_explicit(&console_in_rd, rd+1, memory_order_release);
+	return 1;
+}
+
+#else
+
+static void console_start_reader() {
+}
+
+//Returns true and puts the next character in *c if there is console input.
+//The web version has no threads, so we poll the fd here.
+static int console_read_char(char *c) {
 	fd_set input;
 	struct timeval no_wait = {
 		.tv_sec  = 0L,
 		.tv_usec = 0L
 	};
-	int result;
+	FD_ZERO(&input);
+	FD_SET(STDIN_FILENO, &input);
+	int result = select((STDIN_FILENO+1), &input, NULL, NULL, &no_wait);
+	if (result > 0 && FD_ISSET(STDIN_FILENO, &input)) {
+		// read single character
+		return (read(STDIN_FILENO, c, 1) == 1);
+	}
+	return 0;
+}
+#endif
+
+static int uart_poll_for_console_character() {
+	char c;
 
 	//If user pressed ctl-c or any other character that generates a
 	//signal instead, handle that.
@@ -103,37 +270,31 @@ static int uart_poll_for_console_character() {
 		return r;
 	}
 
-	FD_ZERO(&input);
-	FD_SET(STDIN_FILENO, &input);
-
-	result = select((STDIN_FILENO+1), &input, NULL, NULL, &no_wait);
-
-	if (result > 0 && FD_ISSET(STDIN_FILENO, &input)) {
-		// read single character
-		result = read(STDIN_FILENO, &c, 1);
-		if (result == 1) {
-			ctrl_c_pressed_times=0; //reset ctrl-c counter
-			//Swap around DEL and BSP. Terminals nowadays send the former,
-			//Unix expects the latter. Note you can usually press ctrl-backspace
-			//to get 'the other one', depending on your terminal.
-			if (c==0x7F) {
-				c=8;
-			} else if (c==8) {
-				c=0x7F;
-			}
-			return c;
+	//Scripted input goes before whatever the user types.
+	int sc=script_getc();
+	if (sc>=0) return sc;
+
+	if (console_in_cb) return console_in_cb(console_cb_opaque);
+
+	if (console_read_char(&c)) {
+		//Make sure whatever the guest printed before is visible.
+		uart_console_flush();
+		ctrl_c_pressed_times=0; //reset ctrl-c counter
+		//Swap around DEL and BSP. Terminals nowadays send the former,
+		//Unix expects the latter. Note you can usually press ctrl-backspace
+		//to get 'the other one', depending on your terminal.
+		if (c==0x7F) {
+			c=8;
+		} else if (c==8) {
+			c=0x7F;
 		}
+		return c;
 	}
 
 	// Fall through, nothing waiting
 	return -1;
 }
 
-void uart_console_printc(char val) {
-	printf("%c", val);
-	fflush(stdout);
-}
-
 //Registers defined in the dual UART chip
 #define REG_CMD 0
 #define REG_MODECTL 1
@@ -151,31 +312,160 @@ void uart_console_printc(char val) {
 
 #define INTCTL_STATUS_AFFECTS_VECTOR 0x4
 
+/*
+By default, the UARTs are unthrottled: a transmitted character is passed to the
+host immediately, the transmitter is always ready, and as soon as the guest
+reads a received character the next one (if any) is fetched from the host, so
+an ISR can drain a whole burst of input in one go.
+
+In paced mode, both directions run at the baud rate the guest programmed: the
+transmitter reports busy for one character time after each write, and a new
+received character is only fetched from the host one character time after the
+previous one. The baud rate is derived from the time constant, the baud rate
+generator prescaler and the clock mode in the same way the real chip does it;
+we assume a PCLK of UART_PCLK_HZ and 10 bits (start, 8 data, stop) per char.
+*/
+#define UART_PCLK_HZ 3686400
+#define UART_DEFAULT_BAUD 9600
+#define UART_BITS_PER_CHAR 10
+
+static int uart_paced=0;
 
 typedef struct {
 	uint8_t regs[32];
 	uint8_t char_rcv;
 	uint8_t has_char_rcv;
 	uint8_t us_to_loopback;
+	serport_t *port;		//Host port this channel is connected to, or NULL
+	int char_us;			//Time one character takes at the programmed baud rate
+	int tx_busy_us;			//Paced mode: time until the transmitter is empty again
+	int rx_wait_us;			//Paced mode: time until the next character can be received
+	uint64_t tx_bytes;		//Throughput counters
+	uint64_t rx_bytes;
+	uint64_t tx_busy_writes;	//Characters written while the transmitter was still busy
 } chan_t;
 
 struct uart_t {
 	char *name;
+	int idx;				//Order of creation; channels are serial ports idx*2 and idx*2+1
 	int is_console;
 	chan_t chan[2];
 	int int_raised;
+	uint64_t us_total;		//Emulated time this UART has been running
 };
 
+//For the statistics printed at exit.
+#define MAX_UARTS 4
+static uart_t *all_uarts[MAX_UARTS];
+static int n_uarts=0;
+
+void uart_set_paced(int paced) {
+	uart_paced=paced;
+}
+
+void uart_report_stats(FILE *f) {
+	for (int i=0; i<n_uarts; i++) {
+		uart_t *u=all_uarts[i];
+		if (u->us_total==0) continue;
+		for (int c=0; c<2; c++) {
+			chan_t *ch=&u->chan[c];
+			if (ch->tx_bytes==0 && ch->rx_bytes==0) continue;
+			double secs=u->us_total/1000000.0;
+			fprintf(f, " uart %s chan %s: tx %llu bytes (%.0f B/s), rx %llu bytes (%.0f B/s), %llu writes while tx busy, %d baud\n",
+				u->name, c?"B":"A",
+				(unsigned long long)ch->tx_bytes, ch->tx_bytes/secs,
+				(unsigned long long)ch->rx_bytes, ch->rx_bytes/secs,
+				(unsigned long long)ch->tx_busy_writes,
+				(1000000*UART_BITS_PER_CHAR)/ch->char_us);
+		}
+	}
+}
+
+//Recalculate the character time from the baud rate related registers.
+static void chan_update_baud(uart_t *u, int chan) {
+	chan_t *ch=&u->chan[chan];
+	int tc=ch->regs[REG_TC];
+	if (tc==0) tc=256; //time constant of 0 means 256
+	int prescale=(ch->regs[REG_BRG]&0x2)?64:4;
+	//Clock mode: x1, x16, x32, x64
+	const int clkdiv[4]={1, 16, 32, 64};
+	int mult=clkdiv[(ch->regs[REG_MODECTL]>>6)&3];
+	int baud=UART_PCLK_HZ/(prescale*tc*mult);
+	//If the guest hasn't programmed anything sane (yet), use a sane default.
+	if (baud<50 || baud>1000000) baud=UART_DEFAULT_BAUD;
+	ch->char_us=(1000000*UART_BITS_PER_CHAR)/baud;
+	UART_LOG_DEBUG("uart %s chan %s: %d baud, %d us/char\n", u->name, chan?"B":"A", baud, ch->char_us);
+}
+
 uart_t *uart_new(const char *name, int is_console) {
 	uart_t *u=calloc(sizeof(uart_t), 1);
 	u->name=strdup(name);
 	u->is_console=is_console;
+	for (int c=0; c<2; c++) chan_update_baud(u, c);
+	u->idx=n_uarts;
+	if (n_uarts<MAX_UARTS) all_uarts[n_uarts++]=u;
 
-	if (is_console) uart_set_console_raw_mode();
+	if (is_console && !console_in_cb) {
+		uart_set_console_raw_mode();
+		console_start_reader();
+	}
 
 	return u;
 }
 
+void uart_set_port(uart_t *u, int chan, serport_t *port) {
+	u->chan[chan].port=port;
+}
+
+//Returns true if the channel is connected to something on the host side.
+static int chan_has_host(uart_t *u, int chan) {
+	return u->chan[chan].port || (u->is_console && chan==1);
+}
+
+//Get a character from whatever the channel is connected to on the host side.
+//Returns -1 if there is none.
+static int chan_host_getc(uart_t *u, int chan) {
+	//When replaying, input comes from the recording only.
+	if (replay_playing()) return replay_input(u->idx*2+chan, -1);
+	int c=-1;
+	//Huh. The main console is on channel *B* of the UART.
+	if (u->chan[chan].port) {
+		c=serport_getc(u->chan[chan].port);
+	} else if (u->is_console && chan==1) {
+		c=uart_poll_for_console_character();
+		if (c>=0) emu_stats.console_in++;
+	}
+	return replay_input(u->idx*2+chan, c);
+}
+
+static void chan_host_putc(uart_t *u, int chan, uint8_t val) {
+	if (u->chan[chan].port) {
+		serport_putc(u->chan[chan].port, val);
+	} else if (u->is_console && chan==1) {
+		uart_console_printc(val);
+	}
+}
+
+//If the channel can receive a character, see if the host has one for us.
+static void chan_poll_host(uart_t *u, int chan) {
+	if (u->chan[chan].has_char_rcv) return;
+	//In paced mode, the next char still is 'on the wire'.
+	if (uart_paced && u->chan[chan].rx_wait_us) return;
+	int in_ch = chan_host_getc(u, chan);
+	if (in_ch >= 0) {
+		u->chan[chan].char_rcv = in_ch;
+		u->chan[chan].has_char_rcv = 1;
+		u->chan[chan].rx_bytes++;
+		u->chan[chan].rx_wait_us=u->chan[chan].char_us;
+	}
+}
+
+//Returns true if the transmitter can accept a new character.
+static int chan_tx_empty(uart_t *u, int chan) {
+	if (u->chan[chan].us_to_loopback) return 0;
+	return !uart_paced || u->chan[chan].tx_busy_us==0;
+}
+
 static void check_ints(uart_t *u) {
 	int need_int=0; //1 if we need to raise an interrupt
 	int int_chan=0; //channel to raise the interrupt for
@@ -242,8 +532,10 @@ void uart_write8(void *obj, unsigned int addr, unsigned int val) {
 			u->chan[chan].us_to_loopback=80;
 			UART_LOG_DEBUG("uart %s chan %s: write send loopback char 0x%X\n", u->name, chan?"B":"A", val);
 		} else {
-			//Huh. The main console is on channel *B* of the UART.
-			if (u->is_console && chan==1) uart_console_printc(val);
+			if (!chan_tx_empty(u, chan)) u->chan[chan].tx_busy_writes++;
+			chan_host_putc(u, chan, val);
+			u->chan[chan].tx_bytes++;
+			u->chan[chan].tx_busy_us=u->chan[chan].char_us;
 		}
 	} else if (a==REG_TC) {
 		UART_LOG_DEBUG("uart %s chan %s: write conf time const reg 0x%X\n", u->name, chan?"B":"A", val);
@@ -256,6 +548,7 @@ void uart_write8(void *obj, unsigned int addr, unsigned int val) {
 		u->chan[1].regs[a]=val;
 	}
 	u->chan[chan].regs[a]=val;
+	if (a==REG_TC || a==REG_BRG || a==REG_MODECTL) chan_update_baud(u, chan);
 	check_ints(u);
 }
 
@@ -266,27 +559,21 @@ unsigned int uart_read8(void *obj, unsigned int addr) {
 	int a=(addr&0xf);
 	bool is_in_loopback = (u->chan[chan].regs[0]&1);
 
-	// Poll for console input if the emulated device might be expecting data
+	// Poll for host input if the emulated device might be expecting data
 	// (done at top of function because .has_char_rcv being set will determine
 	// if the character is ever read; so we cannot only do it in read character)
-	if (chan==1 && u->is_console && !is_in_loopback && !u->chan[chan].has_char_rcv) {
-		int in_ch = uart_poll_for_console_character();
-		if (in_ch >= 0) {
-			u->chan[chan].char_rcv = in_ch;
-			u->chan[chan].has_char_rcv = 1;
-		}
-	}
+	if (chan_has_host(u, chan) && !is_in_loopback) chan_poll_host(u, chan);
 
 	int ret=u->chan[chan].regs[a];
 	if (a==REG_STAT0) {
 		//D7-0: break, underrun, cts, hunt, dcd, tx buf empty, int pending, rx char avail
 		int r=0;
-		if (u->chan[chan].us_to_loopback==0) r|=0x4; //handle tx buf empty flag
+		if (chan_tx_empty(u, chan)) r|=0x4; //handle tx buf empty flag
 		if (u->chan[chan].has_char_rcv && u->chan[chan].us_to_loopback==0) {
 			//should actually only set int pending flag when rx int is enabled...
 			r|=0x3;
 		}
-		UART_LOG_DEBUG("uart %s chan %s: read8 status0 -> %x\n", u->name, chan?"B":"A", addr, r);
+		UART_LOG_DEBUG("uart %s chan %s: read8 status0 -> %x\n", u->name, chan?"B":"A", r);
 		ret=r;
 	} else if (a==REG_STAT1) {
 		//D7-0: eof, crc err, rx overrun, parity err, res c2, res c1, res c0, all sent
@@ -297,12 +584,15 @@ unsigned int uart_read8(void *obj, unsigned int addr) {
 		int r=0x41;
 		if (u->chan[chan].char_rcv==0x3E) r=0x11;
 
-		UART_LOG_DEBUG("uart %s chan %s: read8 status1 -> %x\n", u->name, chan?"B":"A", addr, r);
+		UART_LOG_DEBUG("uart %s chan %s: read8 status1 -> %x\n", u->name, chan?"B":"A", r);
 		ret=r;
 	} else if (a==REG_DATA) {
 		UART_LOG_DEBUG("read char %x\n", u->chan[chan].char_rcv);
 		u->chan[chan].has_char_rcv=0;
 		ret=u->chan[chan].char_rcv;
+		//Unthrottled: immediately have the next char ready so an ISR can
+		//drain all pending input in one go.
+		if (!uart_paced && chan_has_host(u, chan) && !is_in_loopback) chan_poll_host(u, chan);
 	}
 	
 	UART_LOG_DEBUG("uart %s chan %s: read8 %x -> %x\n", u->name, chan?"B":"A", addr, u->chan[chan].regs[addr]);
@@ -312,6 +602,7 @@ unsigned int uart_read8(void *obj, unsigned int addr) {
 
 
 void uart_tick(uart_t *u, int ticklen_us) {
+	u->us_total+=ticklen_us;
 	for (int c=0; c<2; c++) {
 		if (u->chan[c].has_char_rcv && u->chan[c].us_to_loopback) {
 			if (u->chan[c].us_to_loopback>ticklen_us){
@@ -320,21 +611,48 @@ void uart_tick(uart_t *u, int ticklen_us) {
 				u->chan[c].us_to_loopback=0;
 			}
 		}
+		u->chan[c].tx_busy_us-=ticklen_us;
+		if (u->chan[c].tx_busy_us<0) u->chan[c].tx_busy_us=0;
+		u->chan[c].rx_wait_us-=ticklen_us;
+		if (u->chan[c].rx_wait_us<0) u->chan[c].rx_wait_us=0;
 	}
 
-	// if our console uart has ints enabled on ch B just poll it
-	if (u->is_console) {
-		int chan = 1; // B
-		if (u->chan[chan].regs[REG_INTCTL] & 0x18 && !u->chan[chan].has_char_rcv) {
-			int in_ch = uart_poll_for_console_character();
-			if (in_ch >= 0) {
-				u->chan[chan].char_rcv = in_ch;
-				u->chan[chan].has_char_rcv = 1;
-			}
-		}
+	if (u->is_console && console_out_pending) {
+		console_idle_us+=ticklen_us;
+		if (console_idle_us>=CONSOLE_FLUSH_IDLE_US) uart_console_flush();
+	}
+
+	// if a channel connected to the host has rx ints enabled, just poll it
+	for (int c=0; c<2; c++) {
+		if (u->chan[c].port) serport_tick(u->chan[c].port, ticklen_us);
+		if (chan_has_host(u, c) && (u->chan[c].regs[REG_INTCTL] & 0x18)) chan_poll_host(u, c);
 	}
 
 	check_ints(u);
 }
 
+//Checkpointed state of an UART. Host port connections are not part of it.
+typedef struct {
+	chan_t chan[2];
+	int int_raised;
+	uint64_t us_total;
+} uart_state_t;
+
+void uart_ckpt_save(uart_t *u, ckpt_t *c) {
+	uart_state_t st={0};
+	memcpy(st.chan, u->chan, sizeof(st.chan));
+	for (int i=0; i<2; i++) st.chan[i].port=NULL;
+	st.int_raised=u->int_raised;
+	st.us_total=u->us_total;
+	ckpt_put(c, u->name, &st, sizeof(st));
+}
 
+int uart_ckpt_load(uart_t *u, ckpt_t *c) {
+	uart_state_t st;
+	if (!ckpt_get(c, u->name, &st, sizeof(st))) return 0;
+	for (int i=0; i<2; i++) st.chan[i].port=u->chan[i].port;
+	memcpy(u->chan, st.chan, sizeof(u->chan));
+	u->int_raised=st.int_raised;
+	u->us_total=st.us_total;
+	return 1;
+}
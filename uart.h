@@ -1,5 +1,8 @@
 
 
+#include "serport.h"
+#include "checkpoint.h"
+
 typedef struct uart_t uart_t;
 
 //Memory range access handlers
@@ -8,5 +11,50 @@ unsigned int uart_read8(void *obj, unsigned int addr);
 
 uart_t *uart_new(const char *name, int is_console);
 
+//If true, transmit and receive at the baud rate programmed by the guest.
+//If false (default), characters are passed on as fast as the guest handles them.
+void uart_set_paced(int paced);
+
+//Connect a channel (0=A, 1=B) to a host serial port. This takes precedence
+//over the console.
+void uart_set_port(uart_t *u, int chan, serport_t *port);
+
+//Set up buffering for console output. Call before anything is printed.
+void uart_console_init();
+
+//Use these instead of stdout and stdin for the console. in returns -1 if there
+//is no input. Call before the console UART is created.
+void uart_console_set_cb(void (*out)(void *opaque, char c), int (*in)(void *opaque), void *opaque);
+
+//Called for every character the guest prints on the console.
+typedef void (*uart_console_hook_t)(char c);
+//Add a hook for console output. Returns 0 if there are too many.
+int uart_console_add_hook(uart_console_hook_t hook);
+
+//Matches strings against console output, to wait for the guest to print
+//something. Strings can be up to UART_MATCH_MAX long.
+#define UART_MATCH_BUF_SZ 4096
+#define UART_MATCH_MAX (UART_MATCH_BUF_SZ/2)
+typedef struct {
+	char buf[UART_MATCH_BUF_SZ];	//console output since the last clear
+	int len;
+} uart_match_t;
+
+//Add a character of output. Returns true if the output now ends in str; str
+//can be NULL to only record the output.
+int uart_match_add(uart_match_t *m, char c, const char *str, int len);
+//Look for str in the output recorded so far. If it's there, drop the output
+//up to and including it and return true.
+int uart_match_find(uart_match_t *m, const char *str, int len);
+//Forget the output recorded so far.
+void uart_match_clear(uart_match_t *m);
+
+//Print the throughput of every channel that was used, for the statistics report.
+void uart_report_stats(FILE *f);
+
 //Call this periodically to handle timed events
 void uart_tick(uart_t *u, int ticklen_us);
+
+//Save or restore the UART state in a checkpoint.
+void uart_ckpt_save(uart_t *u, ckpt_t *c);
+int uart_ckpt_load(uart_t *u, ckpt_t *c);